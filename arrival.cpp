@@ -0,0 +1,67 @@
+/*
+Copyright (c) 2014 David Hubbard
+
+This program is free software: you can redistribute it and/or modify it under the terms of
+the GNU Affero General Public License version 3, as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License version 3 for more details.
+
+You should have received a copy of the GNU Affero General Public License version 3 along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+#include "iface.h"
+#include "arrival.h"
+
+using namespace tuner_ns;
+
+void arrival::reset()
+{
+	memset(&s, 0, sizeof(s));
+	last_ns = 0;
+	mean_ns = 0;
+	jitter_ns = 0;
+	cur_burst = 0;
+}
+
+void arrival::add(unsigned long long ns)
+{
+	s.n++;
+	if (!last_ns) {
+		last_ns = ns;
+		cur_burst = 1;
+		return;
+	}
+	// the clock is CLOCK_REALTIME: if it steps back, count the gap as 0
+	long long d = ns > last_ns ? (long long) (ns - last_ns) : 0;
+	last_ns = ns;
+
+	unsigned long long us = d/1000;
+	unsigned k;
+	for (k = 0; k < NUM_GAP - 1; k++) if (us < gap_us(k)) break;
+	s.gap[k]++;
+
+	if (mean_ns) {
+		long long dev = d - mean_ns;
+		if (dev < 0) dev = -dev;
+		jitter_ns += (dev - jitter_ns)/16;
+		mean_ns += (d - mean_ns)/16;
+	} else mean_ns = d;
+	s.mean_us = (u32) (mean_ns/1000);
+	s.jitter_us = (u32) (jitter_ns/1000);
+
+	if (us < BURST_US) {
+		cur_burst++;
+		return;
+	}
+	// the burst is over
+	for (k = 0; k < NUM_BURST - 1; k++) if (cur_burst < (2u << k)) break;
+	s.burst[k]++;
+	if (cur_burst > s.max_burst) s.max_burst = cur_burst;
+	cur_burst = 1;
+}
@@ -0,0 +1,57 @@
+/*
+Copyright (c) 2014 David Hubbard
+
+This program is free software: you can redistribute it and/or modify it under the terms of
+the GNU Affero General Public License version 3, as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License version 3 for more details.
+
+You should have received a copy of the GNU Affero General Public License version 3 along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+namespace tuner_ns {
+
+// arrival keeps statistics of when datagrams arrived: an inter-arrival histogram, the mean gap and its
+// jitter, and a histogram of bursts (datagrams closer together than BURST_US). It is for sizing receive
+// buffers and seeing a tuner that bursts or a congested network. Like tsqual the receive thread is the
+// only writer and takes no lock, so get() on another thread can be off by a datagram
+class arrival {
+public:
+	enum arrival_constants {
+		NUM_GAP = 18,	// gap[0] < 16us, gap[k] < 16us << k, gap[NUM_GAP - 1] is everything longer (> 1s)
+		NUM_BURST = 8,	// burst[k] is 2^k to 2^(k+1) - 1 datagrams, burst[NUM_BURST - 1] anything longer
+		BURST_US = 50,	// one 1328 byte datagram takes 11us at 1 Gbit/s
+	};
+
+	struct stats {
+		u32 n;		// datagrams
+		u32 gap[NUM_GAP];
+		u32 burst[NUM_BURST];
+		u32 max_burst;
+		u32 mean_us;	// moving average of the gap
+		u32 jitter_us;	// moving average of how far each gap is from mean_us (RFC 3550 style, gain 1/16)
+	};
+
+	arrival() { reset(); }
+	void reset();
+
+	// add() takes the arrival time of one datagram in ns. receive thread only
+	void add(unsigned long long ns);
+
+	void get(stats * out) const { *out = s; }
+
+	// gap_us() is the upper bound of gap[k] in us
+	static unsigned gap_us(unsigned k) { return 16u << k; }
+
+protected:
+	stats s;
+	unsigned long long last_ns;
+	long long mean_ns, jitter_ns;
+	u32 cur_burst;
+};
+
+}
@@ -0,0 +1,156 @@
+/*
+Copyright (c) 2014 David Hubbard
+
+This program is free software: you can redistribute it and/or modify it under the terms of
+the GNU Affero General Public License version 3, as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License version 3 for more details.
+
+You should have received a copy of the GNU Affero General Public License version 3 along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include "mpgts.h"
+#include "chident.h"
+
+using namespace tuner_ns;
+
+void chident::clear()
+{
+	if (vct) {
+		for (unsigned i = 0; i < n_ch; i++) free(vct[i]);
+		free(vct);
+		vct = 0;
+	}
+	n_ch = 0;
+}
+
+int chident::got_vct(mpgts * itm, u8 d, slot & s)
+{
+	unsigned long long n;
+	if (read(itm->get_table_fd(d), &n, sizeof(n)) != sizeof(n)) return 0;	// EAGAIN: nothing yet
+	if (!(itm->take_table_events(d) & mpgatsc::ev_vct)) return 0;	// PAT, PMT or MGT
+	char * v = itm->get_vct(d);
+	if (!v || !v[0]) {
+		free(v);	// an empty VCT, keep waiting for one with channels in it
+		return 0;
+	}
+	vct[s.idx] = v;
+	return 1;
+}
+
+int chident::run(mpgts * itm, unsigned n_ch_, const unsigned * chlist, stop_cb cb /*= 0*/, void * ctx /*= 0*/)
+{
+	clear();
+	vct = (typeof(vct)) calloc(sizeof(*vct), n_ch_ ? n_ch_ : 1);
+	if (!vct) {
+		fprintf(stderr, "chident::run(): malloc failed\n");
+		return 1;
+	}
+	n_ch = n_ch_;
+
+	slot s[tuner::NUM_CHANNELS];
+	u8 d;
+	for (d = 0; d < tuner::NUM_CHANNELS; d++) s[d].st = idle;
+	unsigned next = 0, done = 0, found = 0, stop = 0;
+
+	for (;;) {
+		// advance every DT3305 as far as it can go without waiting
+		unsigned long now = mono_ms();
+		for (d = 0; d < tuner::NUM_CHANNELS; d++) {
+			slot & sl = s[d];
+			if (sl.st == idle) {
+				if (stop || next >= n_ch) continue;
+				sl.idx = next++;
+				if (itm->set_freq(d, chlist[sl.idx])) return 1;
+				now = mono_ms();
+				sl.st = locking;
+				sl.deadline = now + itm->lock_timeout(chlist[sl.idx], locktime::sync, 1000);
+				sl.next_poll = now;
+			}
+			if (sl.st == locking && now >= sl.next_poll) {
+				u8 status;
+				u32 ptmse, eqmse;
+				if (itm->get_mse(d, &status, &ptmse, &eqmse)) return 1;
+				now = mono_ms();
+				if (status & 4) {
+					if (itm->start_ts(d)) return 1;
+					got_vct(itm, d, sl);	// clear the count left over from the last channel
+					sl.st = streaming;
+					now = mono_ms();
+					sl.next_poll = now + TS_LOCK_MS;
+					sl.deadline = now + VCT_MS;
+				} else if (now >= sl.deadline) {
+					itm->lock_gave_up(d);
+					sl.st = idle;
+					done++;
+					d--;	// pick the next channel for this DT3305 now
+					continue;
+				} else {
+					sl.next_poll = now + LOCK_POLL_MS;
+				}
+			}
+			if (sl.st == streaming && now >= sl.next_poll && sl.next_poll < sl.deadline) {
+				// sync lock alone is not enough: a stream with too many TS errors will not deliver a VCT either
+				if (!itm->ts_lock(d, TS_LOCK_MS)) sl.deadline = now;
+				sl.next_poll = sl.deadline;	// only once
+			}
+			if (sl.st == streaming && now >= sl.deadline) {
+				if (itm->stop_ts(d)) return 1;
+				sl.st = idle;
+				done++;
+				d--;
+				continue;
+			}
+		}
+
+		// sleep until the receive thread signals a VCT or the next poll or deadline
+		struct pollfd pfd[tuner::NUM_CHANNELS];
+		long timeout = -1;
+		unsigned busy = 0;
+		for (d = 0; d < tuner::NUM_CHANNELS; d++) {
+			slot & sl = s[d];
+			pfd[d].fd = -1;
+			pfd[d].events = POLLIN;
+			pfd[d].revents = 0;
+			if (sl.st == idle) continue;
+			busy++;
+			unsigned long until = sl.st == locking || sl.next_poll < sl.deadline ? sl.next_poll : sl.deadline;
+			if (sl.st == streaming) pfd[d].fd = itm->get_table_fd(d);
+			long ms = until > now ? (long) (until - now) : 0;
+			if (timeout < 0 || ms < timeout) timeout = ms;
+		}
+		if (!busy) break;
+
+		printf("\r\e[K %u/%u channels, %u identified", done, n_ch, found);
+		for (d = 0; d < tuner::NUM_CHANNELS; d++) if (s[d].st != idle)
+			printf(" | %2u %s", chlist[s[d].idx], s[d].st == locking ? "lock" : "vct ");
+		fflush(stdout);
+
+		if (poll(pfd, tuner::NUM_CHANNELS, (int) timeout) < 0 && errno != EINTR) {
+			fprintf(stderr, "chident::run(): poll failed: %d %s\n", errno, strerror(errno));
+			return 1;
+		}
+		for (d = 0; d < tuner::NUM_CHANNELS; d++) if (s[d].st == streaming && (pfd[d].revents & POLLIN)) {
+			int r = got_vct(itm, d, s[d]);
+			if (r < 0) return 1;
+			if (!r) continue;
+			if (itm->stop_ts(d)) return 1;
+			s[d].st = idle;
+			done++;
+			found++;
+		}
+		if (cb && !stop && cb(ctx)) stop = 1;
+	}
+	printf("\r\e[K %u/%u channels, %u identified\n", done, n_ch, found);
+	return 0;
+}
@@ -0,0 +1,62 @@
+/*
+Copyright (c) 2014 David Hubbard
+
+This program is free software: you can redistribute it and/or modify it under the terms of
+the GNU Affero General Public License version 3, as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License version 3 for more details.
+
+You should have received a copy of the GNU Affero General Public License version 3 along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+namespace tuner_ns {
+
+// chident identifies channels: each DT3305 tunes a channel, waits for sync lock, streams until the receive thread
+// signals a VCT (see mpgts::get_table_fd()), then stops and takes the next channel right away. A DT3305 never
+// waits for the other one, so a slow or dead channel only holds up its own DT3305
+class chident {
+public:
+	enum chident_constants {
+		LOCK_POLL_MS = 20,	// get_mse() interval while waiting for sync lock
+		VCT_MS = 2000,		// a VCT repeats at least every 400ms (ATSC A/65), give up after a few
+		TS_LOCK_MS = 500,	// after streaming this long, a stream that fails mpgts::ts_lock() is given up on
+	};
+
+	// stop_cb is called after each event, it returns nonzero to stop taking new channels
+	typedef int (* stop_cb)(void * ctx);
+
+	chident() : vct(0), n_ch(0) {}
+	~chident() { clear(); }
+
+	// run() identifies every channel in chlist, progress goes to stdout
+	int run(mpgts * itm, unsigned n_ch_, const unsigned * chlist, stop_cb cb = 0, void * ctx = 0);
+
+	// get_vct() is the VCT lines of chlist[i], 0 if it was not identified
+	const char * get_vct(unsigned i) const { return i < n_ch && vct ? vct[i] : 0; }
+	unsigned get_n() const { return n_ch; }
+
+protected:
+	enum slot_state {
+		idle,
+		locking,	// set_freq() done, polling get_mse()
+		streaming,	// start_ts() done, waiting for the VCT
+	};
+	struct slot {
+		slot_state st;
+		unsigned idx;		// index into chlist
+		unsigned long deadline;	// mono_ms() to give up on this stage
+		unsigned long next_poll;	// locking: next get_mse(). streaming: when to check ts_lock()
+	};
+
+	char ** vct;
+	unsigned n_ch;
+
+	void clear();
+	int got_vct(mpgts * itm, u8 d, slot & s);
+};
+
+}
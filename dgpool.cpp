@@ -0,0 +1,116 @@
+/*
+Copyright (c) 2014 David Hubbard
+
+This program is free software: you can redistribute it and/or modify it under the terms of
+the GNU Affero General Public License version 3, as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License version 3 for more details.
+
+You should have received a copy of the GNU Affero General Public License version 3 along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include "iface.h"
+#include "dgpool.h"
+
+using namespace tuner_ns;
+
+int dgpool::open(unsigned n)
+{
+	{
+		// this will trigger a compiler error if put() would share a cache line with get()
+		u32 ctl_size_check[(int) (offsetof(ctl, ret) - CACHE_LINE) + 1];
+		u32 ctl_size_check2[(int) (CACHE_LINE - offsetof(ctl, ret)) + 1];
+		(void) ctl_size_check; (void) ctl_size_check2;
+	}
+
+	if (bufs) {
+		fprintf(stderr, "dgpool::open(): already open\n");
+		return 1;
+	}
+	if (!n || n > MAX_BUFS) {
+		fprintf(stderr, "dgpool::open(%u): must be 1 - %u\n", n, MAX_BUFS);
+		return 1;
+	}
+	void * p = 0, * q = 0;
+	if (posix_memalign(&p, CACHE_LINE, sizeof(ctl)) || posix_memalign(&q, CACHE_LINE, sizeof(dgbuf) * n)) {
+		fprintf(stderr, "dgpool::open(%u): posix_memalign failed\n", n);
+		free(p);
+		return 1;
+	}
+	c = (ctl *) p;
+	bufs = (dgbuf *) q;
+	memset(c, 0, sizeof(*c));
+	n_bufs = n;
+
+	own = 0;
+	for (unsigned i = n; i--; ) {
+		bufs[i].ref = 0;
+		bufs[i].len = 0;
+		bufs[i].ms = 0;
+		bufs[i].pool = this;
+		bufs[i].buf = bufs[i].mem;
+		bufs[i].next = own;
+		own = &bufs[i];
+	}
+	return 0;
+}
+
+void dgpool::close()
+{
+	if (c && c->in_use) {
+		// a consumer never gave them back: better to leak them than to free what it may still read or put()
+		fprintf(stderr, "dgpool::close(): %u of %u still in use, not freed\n", c->in_use, n_bufs);
+	} else {
+		free(bufs);
+		free(c);
+	}
+	c = 0;
+	bufs = 0;
+	n_bufs = 0;
+	own = 0;
+}
+
+dgbuf * dgpool::get()
+{
+	if (!own) own = __atomic_exchange_n(&c->ret, (dgbuf *) 0, __ATOMIC_ACQUIRE);
+	dgbuf * b = own;
+	if (!b) {
+		c->empty++;
+		return 0;
+	}
+	own = b->next;
+	b->ref = 1;
+	u32 n = __atomic_add_fetch(&c->in_use, 1, __ATOMIC_RELAXED);
+	if (n > c->high_water) c->high_water = n;
+	return b;
+}
+
+void dgpool::put(dgbuf * b)
+{
+	if (__atomic_sub_fetch(&b->ref, 1, __ATOMIC_ACQ_REL)) return;
+
+	// only get() ever takes from ret, and it takes all of it, so there is no ABA problem here
+	ctl * pc = b->pool->c;
+	__atomic_sub_fetch(&pc->in_use, 1, __ATOMIC_RELAXED);
+	dgbuf * h = __atomic_load_n(&pc->ret, __ATOMIC_RELAXED);
+	do b->next = h;
+	while (!__atomic_compare_exchange_n(&pc->ret, &h, b, 1 /*weak*/, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+void dgpool::get_counts(counts * out) const
+{
+	memset(out, 0, sizeof(*out));
+	if (!c) return;
+	out->size = n_bufs;
+	out->in_use = c->in_use;
+	out->high_water = c->high_water;
+	out->empty = c->empty;
+}
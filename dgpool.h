@@ -0,0 +1,88 @@
+/*
+Copyright (c) 2014 David Hubbard
+
+This program is free software: you can redistribute it and/or modify it under the terms of
+the GNU Affero General Public License version 3, as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License version 3 for more details.
+
+You should have received a copy of the GNU Affero General Public License version 3 along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+namespace tuner_ns {
+
+class dgpool;
+
+// dgbuf is one datagram from the tuner. Whoever has a reference can read buf (the 7 TS packets are at
+// buf + 12) until it calls dgpool::put(). Nobody writes buf once the receive thread has handed it on
+// a dgbuf with pool == 0 is borrowed: buf is someone else's memory, only good for the call it was passed
+// to, and it must not be held. Its mem is not used
+struct dgbuf {
+	enum dgbuf_constants {
+		DGRAM = 1328,
+	};
+	volatile u32 ref;
+	u32 len;
+	unsigned long ms;	// mono_ms() when it was received
+	u32 gen;	// for the receiver to tag what it has handed on, see mpgts::dmx_gen
+	dgpool * pool;
+	dgbuf * next;	// on a free list
+	u8 * buf;	// mem, unless borrowed
+	u8 mem[DGRAM];
+} __attribute__((aligned(64)));
+
+// dgpool is a fixed number of dgbufs, so receiving costs no malloc() and any number of consumers can
+// keep a datagram without copying it: each one takes a reference with hold() and gives it back with put().
+// get() is only for the one thread that owns the pool (the receive thread), it takes from a free list of
+// its own. put() from any thread pushes the last reference onto a return list, and get() takes the whole
+// return list at once when its own runs out
+class dgpool {
+public:
+	enum dgpool_constants {
+		CACHE_LINE = 64,
+		MAX_BUFS = 1 << 18,
+	};
+
+	struct counts {
+		u32 size;
+		u32 in_use;	// right now
+		u32 high_water;	// the most ever in use at once
+		unsigned long empty;	// get() found none left
+	};
+
+	dgpool() : c(0), bufs(0), n_bufs(0), own(0) {}
+
+	int open(unsigned n);
+	void close();
+	int is_open() const { return bufs != 0; }
+
+	// get() returns a dgbuf with one reference, or 0 if they are all in use. owner only
+	dgbuf * get();
+
+	// any thread
+	static void hold(dgbuf * b) { __atomic_add_fetch(&b->ref, 1, __ATOMIC_RELAXED); }
+	static void put(dgbuf * b);
+
+	void get_counts(counts * out) const;
+
+protected:
+	struct ctl {
+		// owner's cache line
+		u32 high_water;
+		unsigned long empty;
+		// put()'s cache line
+		dgbuf * volatile ret __attribute__((aligned(CACHE_LINE)));
+		volatile u32 in_use;
+	} __attribute__((aligned(CACHE_LINE)));
+
+	ctl * c;
+	dgbuf * bufs;
+	u32 n_bufs;
+	dgbuf * own;	// the owner's free list
+};
+
+}
@@ -0,0 +1,145 @@
+/*
+Copyright (c) 2014 David Hubbard
+
+This program is free software: you can redistribute it and/or modify it under the terms of
+the GNU Affero General Public License version 3, as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License version 3 for more details.
+
+You should have received a copy of the GNU Affero General Public License version 3 along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stddef.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "iface.h"
+#include "dgpool.h"
+#include "dgring.h"
+
+using namespace tuner_ns;
+
+int dgring::open(unsigned depth)
+{
+	{
+		// this will trigger a compiler error if ctl does not put head and tail on separate cache lines
+		u32 ctl_size_check[(int) (offsetof(ctl, tail) - CACHE_LINE) + 1];
+		u32 ctl_size_check2[(int) (CACHE_LINE - offsetof(ctl, tail)) + 1];
+		(void) ctl_size_check; (void) ctl_size_check2;
+	}
+
+	if (slots) {
+		fprintf(stderr, "dgring::open(): already open\n");
+		return 1;
+	}
+	if (!depth || depth > MAX_DEPTH) {
+		fprintf(stderr, "dgring::open(%u): depth must be 1 - %u\n", depth, MAX_DEPTH);
+		return 1;
+	}
+	u32 n = 1;
+	while (n < depth) n <<= 1;
+
+	void * p = 0, * q = 0;
+	if (posix_memalign(&p, CACHE_LINE, sizeof(ctl)) || posix_memalign(&q, CACHE_LINE, sizeof(*slots) * n)) {
+		fprintf(stderr, "dgring::open(%u): posix_memalign failed\n", n);
+		free(p);
+		return 1;
+	}
+	c = (ctl *) p;
+	slots = (dgbuf **) q;
+	memset(c, 0, sizeof(*c));
+	mask = n - 1;
+
+	efd = eventfd(0, EFD_CLOEXEC);
+	if (efd == -1) {
+		fprintf(stderr, "dgring::open(): eventfd failed: %d %s\n", errno, strerror(errno));
+		close();
+		return 1;
+	}
+	return 0;
+}
+
+void dgring::close()
+{
+	if (slots) for (dgbuf * b; (b = peek()); release()) dgpool::put(b);
+	free(slots);
+	free(c);
+	slots = 0;
+	c = 0;
+	mask = 0;
+	if (efd != -1) ::close(efd);
+	efd = -1;
+}
+
+int dgring::push(dgbuf * b)
+{
+	u32 head = c->head;
+	u32 used = head - __atomic_load_n(&c->tail, __ATOMIC_ACQUIRE);
+	if (used > mask) {
+		c->full++;
+		return 1;
+	}
+	if (used + 1 > c->high_water) c->high_water = used + 1;
+	slots[head & mask] = b;
+
+	// seq_cst on both sides: either wait() sees the new head, or push() sees sleeping
+	__atomic_store_n(&c->head, head + 1, __ATOMIC_SEQ_CST);
+	c->pushed++;
+	if (__atomic_load_n(&c->sleeping, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&c->sleeping, 0, __ATOMIC_SEQ_CST)) {
+		c->wakeups++;
+		wake();
+	}
+	return 0;
+}
+
+dgbuf * dgring::peek()
+{
+	u32 tail = c->tail;
+	if (tail == __atomic_load_n(&c->head, __ATOMIC_ACQUIRE)) return 0;
+	return slots[tail & mask];
+}
+
+void dgring::release()
+{
+	__atomic_store_n(&c->tail, c->tail + 1, __ATOMIC_RELEASE);
+	c->popped++;
+}
+
+void dgring::wait()
+{
+	__atomic_store_n(&c->sleeping, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&c->head, __ATOMIC_SEQ_CST) != c->tail) {
+		c->sleeping = 0;
+		return;
+	}
+	unsigned long long v;
+	if (read(efd, &v, sizeof(v)) != sizeof(v) && errno != EINTR)
+		fprintf(stderr, "dgring::wait(): read(eventfd) failed: %d %s\n", errno, strerror(errno));
+	c->sleeping = 0;
+}
+
+void dgring::wake()
+{
+	unsigned long long one = 1;
+	if (write(efd, &one, sizeof(one)) != sizeof(one))
+		fprintf(stderr, "dgring::wake(): write(eventfd) failed: %d %s\n", errno, strerror(errno));
+}
+
+void dgring::get_counts(counts * out) const
+{
+	memset(out, 0, sizeof(*out));
+	if (!c) return;
+	out->pushed = c->pushed;
+	out->popped = c->popped;
+	out->full = c->full;
+	out->depth = mask + 1;
+	out->high_water = c->high_water;
+	out->wakeups = c->wakeups;
+}
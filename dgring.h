@@ -0,0 +1,81 @@
+/*
+Copyright (c) 2014 David Hubbard
+
+This program is free software: you can redistribute it and/or modify it under the terms of
+the GNU Affero General Public License version 3, as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License version 3 for more details.
+
+You should have received a copy of the GNU Affero General Public License version 3 along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+namespace tuner_ns {
+
+// dgring is a single producer, single consumer ring of dgbuf references: the receive thread fills it and a demux
+// thread empties it, so a slow fwrite() in the demux no longer holds up the next recvmmsg(). Neither side
+// takes a lock. The producer's and the consumer's indexes are on cache lines of their own. The consumer
+// sleeps on an eventfd when the ring is empty, and the producer only writes the eventfd if it is asleep
+class dgring {
+public:
+	enum dgring_constants {
+		CACHE_LINE = 64,
+		MAX_DEPTH = 1 << 16,
+	};
+
+	// backpressure: full counts datagrams dropped because the consumer fell depth behind
+	struct counts {
+		unsigned long pushed, popped, full;
+		u32 depth;
+		u32 high_water;	// the most slots ever in use at once
+		u32 wakeups;	// times the producer had to wake the consumer
+	};
+
+	dgring() : c(0), slots(0), mask(0), efd(-1) {}
+
+	// open() rounds depth up to a power of 2
+	int open(unsigned depth);
+	void close();	// put()s whatever is still in the ring
+	int is_open() const { return slots != 0; }
+
+	// producer: push() hands b and its reference to the consumer. If the ring is full it returns 1 and
+	// the reference stays with the caller
+	int push(dgbuf * b);
+
+	// consumer: peek() returns 0 if the ring is empty, release() drops it from the ring. The reference is
+	// the consumer's from peek() on
+	dgbuf * peek();
+	void release();
+
+	// wait() sleeps until the producer pushes something or wake() is called. consumer only
+	void wait();
+	void wake();	// any thread
+
+	// producer: pos() before waiting for passed(pos): the consumer has released everything pushed before pos()
+	u32 pos() const { return c->head; }
+	int passed(u32 p) const { return (int) (__atomic_load_n(&c->tail, __ATOMIC_ACQUIRE) - p) >= 0; }
+
+	void get_counts(counts * out) const;
+
+protected:
+	struct ctl {
+		// producer's cache line
+		volatile u32 head;
+		u32 high_water, wakeups;
+		unsigned long pushed, full;
+		// consumer's cache line
+		volatile u32 tail __attribute__((aligned(CACHE_LINE)));
+		volatile u32 sleeping;
+		unsigned long popped;
+	} __attribute__((aligned(CACHE_LINE)));
+
+	ctl * c;
+	dgbuf ** slots;
+	u32 mask;
+	int efd;
+};
+
+}
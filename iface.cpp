@@ -19,6 +19,7 @@ this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <string.h>
 #include <errno.h>
 #include <stdio.h>
+#include <time.h>
 #include "iface.h"
 
 #ifndef _SIZEOF_ADDR_IFREQ
@@ -169,3 +170,17 @@ int get_hw_addr(int sock_to_kernel, const char * ifname, u8 hwaddr[6])
 		hwaddr[i] = ifr.ifr_hwaddr.sa_data[i];
 	return 0;
 }
+
+unsigned long mono_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long) ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+unsigned long long wall_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (unsigned long long) ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
@@ -22,3 +22,9 @@ int foreach_if(int sock_to_kernel, foreach_if_cb cb, void * ctx);
 void __ip_printf(char * s, size_t len, u32 ip, const char * funcname, unsigned long line);
 
 int get_hw_addr(int sock_to_kernel, const char * ifname, u8 hwaddr[6]);
+
+// milliseconds from a monotonic clock, only useful for measuring time intervals
+unsigned long mono_ms();
+
+// milliseconds since the unix epoch
+unsigned long long wall_ms();
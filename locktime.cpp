@@ -0,0 +1,172 @@
+/*
+Copyright (c) 2014 David Hubbard
+
+This program is free software: you can redistribute it and/or modify it under the terms of
+the GNU Affero General Public License version 3, as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License version 3 for more details.
+
+You should have received a copy of the GNU Affero General Public License version 3 along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include "iface.h"
+#include "locktime.h"
+
+using namespace tuner_ns;
+
+const u16 lathist::bucket_ms[] = {
+	5, 10, 15, 20, 25, 30, 40, 50, 60, 70, 80, 100,
+	120, 150, 200, 250, 300, 400, 500, 650, 800, 1000, 1500, 2000,
+};
+
+void lathist::age()
+{
+	for (unsigned i = 0; i <= NUM_BUCKETS; i++) n[i] >>= 1;
+}
+
+void lathist::add(unsigned long ms)
+{
+	if (total() >= AGE_AT) age();
+	unsigned i;
+	for (i = 0; i < NUM_BUCKETS - 1; i++) if (ms <= bucket_ms[i]) break;
+	n[i]++;
+
+	{
+		// this will trigger a compiler error if bucket_ms[] is sized wrong
+		u32 bucket_ms_size_check1[(int) (sizeof(bucket_ms)/sizeof(bucket_ms[0]) - NUM_BUCKETS)];
+		u32 bucket_ms_size_check2[(int) (NUM_BUCKETS - sizeof(bucket_ms)/sizeof(bucket_ms[0]))];
+		(void) bucket_ms_size_check1; (void) bucket_ms_size_check2;
+	}
+}
+
+void lathist::add_miss()
+{
+	if (total() >= AGE_AT) age();
+	n[NUM_BUCKETS]++;
+}
+
+unsigned lathist::total() const
+{
+	unsigned t = 0;
+	for (unsigned i = 0; i <= NUM_BUCKETS; i++) t += n[i];
+	return t;
+}
+
+unsigned lathist::percentile(unsigned pct, unsigned min_samples /*= 1*/) const
+{
+	unsigned t = total();
+	if (!t || t < min_samples) return 0;
+
+	// want is the number of samples at or below the percentile, rounded up
+	unsigned want = (t*pct + 99)/100, sum = 0, i;
+	for (i = 0; i < NUM_BUCKETS; i++) {
+		sum += n[i];
+		if (sum >= want) return bucket_ms[i];
+	}
+	return 0;	// percentile is in the misses
+}
+
+void locktime::clear()
+{
+	for (unsigned t = 0; t < MAX_TVCH; t++)
+		for (unsigned a = 0; a < MAX_ANT; a++)
+			for (unsigned s = 0; s < NUM_STAGES; s++) h[t][a][s].clear();
+}
+
+void locktime::add(unsigned tvch, unsigned ant, lock_stage st, unsigned long ms)
+{
+	if (tvch >= MAX_TVCH || ant >= MAX_ANT || st >= NUM_STAGES) return;
+	h[tvch][ant][st].add(ms);
+}
+
+void locktime::miss(unsigned tvch, unsigned ant, lock_stage st)
+{
+	if (tvch >= MAX_TVCH || ant >= MAX_ANT || st >= NUM_STAGES) return;
+	h[tvch][ant][st].add_miss();
+}
+
+unsigned locktime::timeout(unsigned tvch, unsigned ant, lock_stage st) const
+{
+	if (tvch >= MAX_TVCH || ant >= MAX_ANT || st >= NUM_STAGES) return 0;
+	unsigned ms = h[tvch][ant][st].percentile(PCT, MIN_SAMPLES);
+	if (!ms) return 0;
+	return ms + ms/4 + 10;	// margin: 25% + 10ms
+}
+
+int locktime::load(const char * filename)
+{
+	FILE * f = fopen(filename, "r");
+	if (!f) {
+		if (errno == ENOENT) return 0;
+		fprintf(stderr, "locktime::load(%s) failed: %d %s\n", filename, errno, strerror(errno));
+		return 1;
+	}
+
+	clear();
+	char line[512];
+	unsigned lineno = 0;
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		if (line[0] == '#' || line[0] == '\n') continue;
+
+		// tvch ant stage n[0] .. n[NUM_BUCKETS]
+		unsigned tvch, ant, st;
+		int pos;
+		if (sscanf(line, "%u %u %u%n", &tvch, &ant, &st, &pos) != 3 ||
+			tvch >= MAX_TVCH || ant >= MAX_ANT || st >= NUM_STAGES)
+		{
+			fprintf(stderr, "locktime::load(%s) line %u invalid, ignored\n", filename, lineno);
+			continue;
+		}
+		lathist & lh = h[tvch][ant][st];
+		const char * p = line + pos;
+		for (unsigned i = 0; i <= lathist::NUM_BUCKETS; i++) {
+			unsigned v;
+			int len;
+			if (sscanf(p, "%u%n", &v, &len) != 1) {
+				fprintf(stderr, "locktime::load(%s) line %u short, ignored\n", filename, lineno);
+				lh.clear();
+				break;
+			}
+			lh.n[i] = (u16) v;
+			p += len;
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+int locktime::save(const char * filename) const
+{
+	FILE * f = fopen(filename, "w");
+	if (!f) {
+		fprintf(stderr, "locktime::save(%s) failed: %d %s\n", filename, errno, strerror(errno));
+		return 1;
+	}
+
+	fprintf(f, "# seztuner lock times: tvch ant stage(0=carrier 1=sync) then counts for buckets (ms):");
+	for (unsigned i = 0; i < lathist::NUM_BUCKETS; i++) fprintf(f, " %u", lathist::bucket_ms[i]);
+	fprintf(f, " miss\n");
+
+	for (unsigned t = 0; t < MAX_TVCH; t++)
+		for (unsigned a = 0; a < MAX_ANT; a++)
+			for (unsigned s = 0; s < NUM_STAGES; s++) {
+				const lathist & lh = h[t][a][s];
+				if (!lh.total()) continue;
+				fprintf(f, "%u %u %u", t, a, s);
+				for (unsigned i = 0; i <= lathist::NUM_BUCKETS; i++) fprintf(f, " %u", lh.n[i]);
+				fprintf(f, "\n");
+			}
+
+	if (fclose(f)) {
+		fprintf(stderr, "locktime::save(%s) close failed: %d %s\n", filename, errno, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,83 @@
+/*
+Copyright (c) 2014 David Hubbard
+
+This program is free software: you can redistribute it and/or modify it under the terms of
+the GNU Affero General Public License version 3, as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License version 3 for more details.
+
+You should have received a copy of the GNU Affero General Public License version 3 along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+namespace tuner_ns {
+
+// lathist is a histogram of latencies in ms with fixed bucket bounds
+class lathist {
+public:
+	enum lathist_constants {
+		NUM_BUCKETS = 24,
+		AGE_AT = 64,	// when the total reaches AGE_AT all counts are halved, so old samples fade out
+	};
+
+	// upper bound of each bucket in ms, anything bigger goes in the last bucket
+	static const u16 bucket_ms[NUM_BUCKETS];
+
+	u16 n[NUM_BUCKETS + 1];	// n[NUM_BUCKETS] counts misses: gave up before the event happened
+
+	lathist() { clear(); }
+	void clear() { for (unsigned i = 0; i <= NUM_BUCKETS; i++) n[i] = 0; }
+	void add(unsigned long ms);
+	void add_miss();
+	unsigned total() const;
+
+	// percentile() returns the upper bound in ms of the bucket holding the pct percentile
+	// returns 0 if there are fewer than min_samples or the percentile falls in the misses
+	unsigned percentile(unsigned pct, unsigned min_samples = 1) const;
+
+protected:
+	void age();
+};
+
+// locktime learns how long each channel takes to reach carrier lock and sync lock
+// there is one locktime per tuner, so the model is per channel, per antenna and per device
+class locktime {
+public:
+	enum lock_stage {
+		carrier = 0,	// get_mse() status & 1
+		sync = 1,	// get_mse() status & 4
+		NUM_STAGES
+	};
+
+	enum locktime_constants {
+		MAX_TVCH = 160,		// more than any channel plan
+		MAX_ANT = 4,		// indexed by tuner::tuner_antennas
+		MIN_SAMPLES = 8,	// do not trust a histogram with fewer samples than this
+		PCT = 95,		// timeout() uses the 95th percentile
+	};
+
+	void clear();
+	void add(unsigned tvch, unsigned ant, lock_stage st, unsigned long ms);
+	void miss(unsigned tvch, unsigned ant, lock_stage st);
+
+	// timeout() is the PCT percentile plus a margin, or 0 if not enough is known about this channel yet
+	// a channel that starts missing its timeout will have misses in the histogram: that pushes the
+	// percentile into the misses and timeout() returns 0 again until it has been re-learned
+	unsigned timeout(unsigned tvch, unsigned ant, lock_stage st) const;
+
+	const lathist * get(unsigned tvch, unsigned ant, lock_stage st) const {
+		if (tvch >= MAX_TVCH || ant >= MAX_ANT || st >= NUM_STAGES) return 0;
+		return &h[tvch][ant][st];
+	}
+
+	// load() returns 0 (and leaves the model empty) if the file does not exist yet
+	int load(const char * filename);
+	int save(const char * filename) const;
+
+protected:
+	lathist h[MAX_TVCH][MAX_ANT][NUM_STAGES];
+};
+
+}
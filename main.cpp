@@ -19,7 +19,12 @@ this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdlib.h>
 #include <termios.h>
 #include <sys/time.h>
+#include <time.h>
 #include "mpgts.h"
+#include "ttlbench.h"
+#include "survey.h"
+#include "chident.h"
+#include "rxbench.h"
 
 using namespace tuner_ns;
 
@@ -65,148 +70,54 @@ static int rawgetch()
 	return r;
 }
 
-static int get_ch_id(mpgts * itm, unsigned n_ch, unsigned * chlist)
-{
-	size_t vct_max = 65536;
-	char * vct_all = (typeof(vct_all)) malloc(sizeof(*vct_all) * vct_max);
-	if (!vct_all) {
-		fprintf(stderr, "failed to malloc vct_all\n");
-		return 1;
-	}
-	vct_all[0] = 0;
-
-	printf("freq lock phase_mse eq_mse | freq lock phase_mse eq_mse | cycle\n");
-	static const unsigned tuner_max_ch = tuner::NUM_CHANNELS;
-	unsigned scan;
-	unsigned go = 1;
-	for (scan = 0; go && n_ch; ) {
-		// tune two channels
-		unsigned i = scan;
-		u8 ch;
-		for (ch = 0; ch < tuner_max_ch; ch++) {
-			if (itm->get_freq(ch) != chlist[i]) {
-				printf(" %2u   --  ----      ----   | ", chlist[i]);
-				fflush(stdout);
-				if (itm->set_freq(ch, chlist[i])) {
-					free(vct_all);
-					return 1;
-				}
-			}
-			i++;
-			if (i >= n_ch) break;
-		}
-
-		u8 status[tuner_max_ch];
-		for (ch = 0; ch < tuner_max_ch; ch++) status[ch] = 0;
-
-		// wait for tuner to lock
-		#define tune_nl "\r"
-		unsigned j;
-		for (j = 0; j < 100; j++) {
-			// if all channels are done
-			for (ch = 0; ch < tuner_max_ch; ch++) if (!(status[ch] & 0x40)) break;
-			if (ch >= tuner_max_ch) {
-				j = 10000000;	// stop after this loop
-			} else {
-				if (j) {
-					printf("%u (any key to stop)", 100 - j);
-					fflush(stdout);
-					int r = rawgetch();
-					if (r == -1) {
-						free(vct_all);
-						return 1;
-					}
-					if (r) {
-						go = 0;
-						break;
-					}
-				}
-				usleep(160000);
-			}
-			i = scan;
-			for (ch = 0; ch < tuner_max_ch; ch++) {
-				if ((status[ch] & 0xf) != 0xf) {
-					u32 ptmse, eqmse;
-					if (itm->get_mse(ch, &status[ch], &ptmse, &eqmse)) {
-						free(vct_all);
-						return 1;
-					}
-					printf("%s %2u   %2x  %4x      %4x   | ", (ch == 0) ? tune_nl "\e[K" : "",
-						chlist[i], status[ch], ptmse >> 4, eqmse >> 4);
-				} else if (status[ch] & 0x40) {
-					u8 ignore;
-					u32 ptmse, eqmse;
-					if (itm->get_mse(ch, &ignore, &ptmse, &eqmse)) {
-						free(vct_all);
-						return 1;
-					}
-					printf("%s %2u done%u %4x      %4x   | ", (ch == 0) ? tune_nl "\e[K" : "",
-						chlist[i], ch, ptmse >> 4, eqmse >> 4);
-				} else {
-					printf("%s %2u start %u                | ", (ch == 0) ? tune_nl "\e[K" : "", chlist[i], ch);
-					if ((status[ch] & 0x20) == 0) {
-						if (itm->start_ts(ch)) {
-							free(vct_all);
-							return 1;
-						}
-						status[ch] |= 0x20;
-					}
-					if (itm->get_vct(ch)) {
-						// stop this TS, wait for all channels before displaying VCT data
-						if (itm->stop_ts(ch)) {
-							free(vct_all);
-							return 1;
-						}
-						status[ch] |= 0x40;
-					}
-				}
-
-				i++;
-				if (i >= n_ch) break;
-			}
-		}
+static tuner::tuner_plan use_plan = tuner::air;	// -C selects cable
 
-		// get VCT data for any channel that succeeded, and then remove that channel
-		i = scan;
-		for (ch = 0; ch < tuner_max_ch; ch++, i++) if (status[ch] & 0x40) {
-			if (i >= n_ch) break;
-			size_t len = strlen(vct_all) + strlen(itm->get_vct(ch)) + 1;
-			if (len > vct_max) {
-				vct_all = (typeof(vct_all)) realloc(vct_all, sizeof(*vct_all) * (vct_max *= 2));
-				if (!vct_all) {
-					fprintf(stderr, "failed to realloc vct_all to %zu\n", vct_max);
-					return 1;
-				}
-			}
-			strcat(vct_all, itm->get_vct(ch));
-			// remove from chlist because it has been successfully tuned
-			n_ch--;
-			memmove(&chlist[i], &chlist[i + 1], (n_ch - i)*sizeof(chlist[0]));
-			i--;
-		}
-		if (!n_ch) break;
-		printf(tune_nl);
+// the lock time model for each tuner is kept in the current directory
+// cable channels are different frequencies than broadcast channels with the same number, so they get their own file
+static void locktime_file(char * buf, size_t len, mpgts * itm)
+{
+	const u8 * mac = itm->get_mac();
+	snprintf(buf, len, "locktime-%02x%02x%02x%02x%02x%02x%s.txt", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5],
+		use_plan == tuner::cable ? "-catv" : "");
+}
 
-		// TODO: fix low VHF channels (2-6)
-	}
+// any key stops get_ch_id() from starting more channels
+static int get_ch_id_stop(void * ctx)
+{
+	(void) ctx;
+	return rawgetch() != 0;	// -1 (stdin is not a tty) also stops
+}
 
-	if (vct_all[0]) {
-		printf("\nfreq digital channel: (channel name can be found on wikipedia)\n%s", vct_all);
+static int get_ch_id(mpgts * itm, unsigned n_ch, unsigned * chlist)
+{
+	printf("identifying (any key to stop)\n");
+	chident id;
+	if (id.run(itm, n_ch, chlist, get_ch_id_stop)) return 1;
+
+	unsigned i, any = 0;
+	for (i = 0; i < id.get_n(); i++) {
+		const char * v = id.get_vct(i);
+		if (!v) continue;
+		if (!any) printf("\nfreq digital channel: (channel name can be found on wikipedia)\n");
+		any = 1;
+		printf("%s", v);
 	}
-	free(vct_all);
 	return 0;
 }
 
 
-static int do_item(unsigned idx, mpgts * itm, tuner::tuner_antennas selected_antenna)
+static int do_item(unsigned idx, mpgts * itm, tuner::tuner_antennas selected_antenna, unsigned per_ch_ant)
 {
 	char dstr[256]; ip_printf(dstr, itm->get_ip());
+	char ltfile[64]; locktime_file(ltfile, sizeof(ltfile), itm);
 	(void) idx;
 
 	if (itm->open()) {
 		fprintf(stderr, "%s failed\n", dstr);
 		return 1;
 	}
+	if (itm->set_plan(use_plan)) return 1;
+	if (itm->load_locktime(ltfile)) return 1;
 
 	unsigned n_ch = 0, * chlist = 0;
 	if (selected_antenna != tuner::nc) {
@@ -216,12 +127,23 @@ static int do_item(unsigned idx, mpgts * itm, tuner::tuner_antennas selected_ant
 		}
 	}
 
-	if (itm->scan(&n_ch, &chlist)) {
-		fprintf(stderr, "%s failed to test antenna\n", dstr);
-		return 1;
+	if (per_ch_ant) {
+		if (itm->scan_antennas(&n_ch, &chlist, scan_progress_cb, dstr)) {
+			fprintf(stderr, "%s failed to test antennas\n", dstr);
+			return 1;
+		}
+		printf("\n%s antenna per channel:", dstr);	// the extra \n at the beginning is due to scan_progress_cb
+		unsigned i;
+		for (i = 0; i < n_ch; i++) printf(" %u:a%u", chlist[i], (unsigned) itm->get_ch_antenna(chlist[i]));
+		printf("\n");
+	} else {
+		if (itm->scan(&n_ch, &chlist)) {
+			fprintf(stderr, "%s failed to test antenna\n", dstr);
+			return 1;
+		}
+		if (selected_antenna == tuner::nc)
+			printf("%s auto-detected -a%u\n", dstr, (unsigned) itm->get_antenna());
 	}
-	if (selected_antenna == tuner::nc)
-		printf("%s auto-detected -a%u\n", dstr, (unsigned) itm->get_antenna());
 
 	{
 		unsigned n2 = 0, * chlist2 = 0;
@@ -286,6 +208,7 @@ static int do_item(unsigned idx, mpgts * itm, tuner::tuner_antennas selected_ant
 					printf(" %u.%u:n", endch[ch], ch);
 					fflush(stdout);
 				}
+				itm->lock_gave_up(ch);
 				end[ch] = 0;
 				break;
 			} else {
@@ -293,6 +216,8 @@ static int do_item(unsigned idx, mpgts * itm, tuner::tuner_antennas selected_ant
 				u32 ptmse, eqmse;
 				if (itm->get_mse(ch, &status, &ptmse, &eqmse)) return 1;
 				//printf(" %2x p %5x e %5x", status, ptmse, eqmse);
+				// sync lock only: nothing streams here so there is no PER yet. get_ch_id() checks ts_lock()
+				// once it streams each strong channel, see chident
 				if (status > 3) {
 					if (dbg) printf(" %u.%u:y", endch[ch], ch);
 						else printf(" %u", endch[ch]);
@@ -310,7 +235,8 @@ static int do_item(unsigned idx, mpgts * itm, tuner::tuner_antennas selected_ant
 			}
 		}
 
-		end[ch] = cur_ms + 1000;
+		// wait for sync lock as long as this channel usually needs, or 1s if it is not known yet
+		end[ch] = cur_ms + itm->lock_timeout(chlist[i], locktime::sync, 1000);
 		endch[ch] = chlist[i];
 		if (itm->set_freq(ch, endch[ch])) return 1;
 		if (dbg) printf(" start%u.%u", endch[ch], ch);
@@ -336,6 +262,7 @@ static int do_item(unsigned idx, mpgts * itm, tuner::tuner_antennas selected_ant
 					printf(" %u.%u:n", endch[ch], ch);
 					fflush(stdout);
 				}
+				itm->lock_gave_up(ch);
 				end[ch] = 0;
 			} else {
 				u8 status;
@@ -360,19 +287,26 @@ static int do_item(unsigned idx, mpgts * itm, tuner::tuner_antennas selected_ant
 	free(chlist);
 
 	i = (unsigned) get_ch_id(itm, strongch_use, strongch);
+	itm->get_zaplat().print(stdout);
+	if (itm->save_locktime(ltfile)) i = 1;
 	itm->close();
 	return (int) i;
 }
 
-static int do_record(mpgts * itm, unsigned tvch, tuner::tuner_antennas selected_antenna)
+#define tune_nl "\r"
+static int do_record(mpgts * itm, unsigned tvch, tuner::tuner_antennas selected_antenna, siglog * log,
+	unsigned fast_zap)
 {
 	char dstr[256]; ip_printf(dstr, itm->get_ip());
 	char tsfile[16]; snprintf(tsfile, sizeof(tsfile), "%02u.ts", tvch);
+	char ltfile[64]; locktime_file(ltfile, sizeof(ltfile), itm);
 
 	if (itm->open()) {
 		fprintf(stderr, "%s failed\n", dstr);
 		return 1;
 	}
+	if (itm->set_plan(use_plan)) return 1;
+	if (itm->load_locktime(ltfile)) return 1;
 
 	unsigned n_ch = 0, * chlist = 0;
 	if (selected_antenna != tuner::nc) {
@@ -394,31 +328,282 @@ static int do_record(mpgts * itm, unsigned tvch, tuner::tuner_antennas selected_
 	if (i >= n_ch) fprintf(stderr, "%s warn: %u not detected in channel scan\n", dstr, tvch);
 
 	u8 ch = 0;
-	if (itm->open_dump(ch, tsfile)) return 1;
-	if (itm->start_ts(ch)) return 1;
-	if (itm->set_freq(ch, tvch)) return 1;
+	if (fast_zap) {
+		// both DT3305 are busy: one live, one standby
+		if (itm->fz_start(n_ch, chlist, tvch, tsfile)) return 1;
+	} else {
+		if (itm->open_dump(ch, tsfile)) return 1;
+		if (itm->start_ts(ch)) return 1;
+		if (itm->set_freq(ch, tvch)) return 1;
+	}
 
-	printf("freq lock phase_mse eq_mse | (press any key to stop)\n");
+	// get_mse() until sync lock so AFC and the lock time model see the lock, after that the monitor does the polling
+	if (itm->start_monitor(100, log)) return 1;
+	unsigned synced = 0;
+	printf("freq lock phase_mse eq_mse  offset | 1s avg: eq_mse  per_ppm tei  cc kdrop hdrop  lost | (press %s, any other key to stop)\n",
+		fast_zap ? "+ or - to change channel" : "s to rescan on the idle tuner");
 	for (;;) {
-		u8 status;
-		u32 ptmse, eqmse;
-		if (itm->get_mse(ch, &status, &ptmse, &eqmse)) return 1;
-		printf(tune_nl "\e[K %2u   %2x  %4x      %4x   |", tvch, status, ptmse >> 4, eqmse >> 4);
+		if (fast_zap) {
+			ch = itm->fz_live_ch();
+			tvch = itm->get_freq(ch);
+		}
+		sigsample s;
+		sigwindow w;
+		if (!synced) {
+			if (itm->get_mse(ch, &s.status, &s.ptmse, &s.eqmse)) return 1;
+			s.cr_hz = 0;
+			if ((s.status & 1) && itm->get_cr_offset(ch, &s.cr_hz)) return 1;
+			synced = s.status & 4;
+			w.locked = 0;
+		} else if (itm->get_signal(ch, &s) || itm->get_signal_window(ch, 1000, &w)) {
+			usleep(100000);
+			continue;
+		}
+		printf(tune_nl "\e[K %2u   %2x  %4x      %4x  %6d |", tvch, s.status, s.ptmse >> 4, s.eqmse >> 4, s.cr_hz);
+		if (w.locked) printf("         %4x", w.eqmse_mean >> 4);
+		else printf("             ");
+		tserr e;
+		if (!itm->get_ts_errors(ch, 1000, &e) && e.pkts)
+			printf(" %8u %3u %3u", e.per_ppm(), e.tei, e.cc);
+		else printf("                 ");
+		// kdrop: datagrams the kernel dropped, hdrop: datagrams sez dropped (a slow dump file), so not the antenna's fault
+		mpgts::rxstats rs;
+		unsigned long hdrop = 0;
+		if (!itm->get_rx_stats(ch, &rs)) {
+			printf(" %5lu", rs.sock_drops + rs.ring_drops);
+			hdrop = rs.host_drops;
+		} else printf("      ");
+		// lost: datagrams that never reached the demux, less hdrop: the network, or the kernel (see kdrop)
+		rxseq::counts sc;
+		if (!itm->get_seq(ch, &sc)) {
+			hdrop += sc.nobuf;
+			printf(" %5lu %5lu |", hdrop, sc.lost > hdrop ? sc.lost - hdrop : 0);
+		} else printf("             |");
 		fflush(stdout);
 
-		eqmse = (u32) rawgetch();
-		if (eqmse == (u32) -1) return 1;
-		if (eqmse) break;
+		int r = rawgetch();
+		if (r == -1) return 1;
+		if (fast_zap && (r == '+' || r == '-')) {
+			unsigned fast;
+			if (itm->fz_step(r == '+' ? 1 : -1, &fast)) return 1;
+			printf("\nzap to %u: %s, %lu ms\n", itm->get_freq(itm->fz_live_ch()), fast ? "fast" : "slow",
+				itm->fz_last_zap_ms());
+			synced = 0;
+			continue;
+		}
+		if (r == 's' && !fast_zap) {
+			// refresh the channel list without stopping the recording on ch
+			unsigned n2 = 0, * chlist2 = 0;
+			printf("\n");
+			if (itm->scan(&n2, &chlist2, scan_progress_cb, dstr, 20, tuner::SCAN_ALL & ~(1 << ch))) return 1;
+			printf("\n%s carrier freqs:", dstr);	// the extra \n at the beginning is due to scan_progress_cb
+			for (i = 0; i < n2; i++) printf(" %u", chlist2[i]);
+			printf("\n");
+			free(chlist2);
+			continue;
+		}
+		if (r) break;
 		usleep(100000);
 	}
+	printf("\nzap ms:");
+	for (unsigned st = 0; st < zaplat::NUM_STAGES; st++)
+		printf(" %s=%ld", zaplat::stage_name[st], itm->get_zap(ch, (zaplat::zap_stage) st));
 	printf("\n");
+
+	// when datagrams arrived: a tuner that bursts or a congested network shows up here, not in the TS errors
+	arrival::stats as;
+	if (!itm->get_arrival(ch, &as) && as.n) {
+		printf("arrival: %u datagrams, mean gap %uus, jitter %uus, longest burst %u\n  gap <us:", as.n, as.mean_us,
+			as.jitter_us, as.max_burst);
+		for (i = 0; i < arrival::NUM_GAP; i++) if (as.gap[i]) {
+			if (i < arrival::NUM_GAP - 1) printf(" %u=%u", arrival::gap_us(i), as.gap[i]);
+			else printf(" more=%u", as.gap[i]);
+		}
+		printf("\n  burst:");
+		for (i = 0; i < arrival::NUM_BURST; i++) if (as.burst[i]) printf(" %u+=%u", 1u << i, as.burst[i]);
+		printf("\n");
+	}
+
+	// full: datagrams dropped because the demux thread (the dump file's fwrite()) fell too far behind
+	dgring::counts dc;
+	if (!itm->get_ring_counts(ch, &dc))
+		printf("demux ring: depth %u, most used %u, full %lu, wakeups %u\n", dc.depth, dc.high_water, dc.full,
+			dc.wakeups);
+	dgpool::counts pc;
+	if (!itm->get_pool_counts(&pc))
+		printf("datagram pool: %u buffers, most used %u, empty %lu\n", pc.size, pc.high_water, pc.empty);
+	return itm->save_locktime(ltfile);
+}
+
+// time-to-lock benchmark: results go to stdout, everything else to stderr
+static int do_bench(mpgts * itm, tuner::tuner_antennas selected_antenna, unsigned reps, unsigned json, unsigned * first)
+{
+	char dstr[256]; ip_printf(dstr, itm->get_ip());
+	char ltfile[64]; locktime_file(ltfile, sizeof(ltfile), itm);
+
+	if (itm->open()) {
+		fprintf(stderr, "%s failed\n", dstr);
+		return 1;
+	}
+	if (itm->set_plan(use_plan)) return 1;
+	if (itm->load_locktime(ltfile)) return 1;
+	if (selected_antenna != tuner::nc && itm->set_antenna(selected_antenna)) {
+		fprintf(stderr, "%s failed to select antenna\n", dstr);
+		return 1;
+	}
+
+	unsigned n_ch = 0, * chlist = 0;
+	if (itm->scan(&n_ch, &chlist)) {
+		fprintf(stderr, "%s failed to test antenna\n", dstr);
+		return 1;
+	}
+	fprintf(stderr, "%s -a%u, %u channels\n", dstr, (unsigned) itm->get_antenna(), n_ch);
+
+	ttlbench b;
+	int r = b.run(itm, n_ch, chlist, reps);
+	free(chlist);
+	if (r) return 1;
+	if (json) b.print_json(stdout, first);
+	else b.print_csv(stdout, *first);
+	*first = 0;
+	return itm->save_locktime(ltfile);
+}
+
+// site survey: every channel on every input, shared out to all tuners at once
+static int do_survey(mpgts * list, unsigned n)
+{
+	unsigned i;
+	char ltfile[64];
+	for (i = 0; i < n; i++) {
+		char dstr[256]; ip_printf(dstr, list[i].get_ip());
+		locktime_file(ltfile, sizeof(ltfile), &list[i]);
+		if (list[i].open()) {
+			fprintf(stderr, "%s failed\n", dstr);
+			return 1;
+		}
+		if (list[i].set_plan(use_plan)) return 1;
+		if (list[i].load_locktime(ltfile)) return 1;
+	}
+
+	survey s;
+	if (s.run(list, n)) return 1;
+	s.print(stdout);
+
+	for (i = 0; i < n; i++) {
+		locktime_file(ltfile, sizeof(ltfile), &list[i]);
+		if (list[i].save_locktime(ltfile)) return 1;
+	}
+	return 0;
+}
+
+// the -q summary of one tuner + demod + channel in the siglog
+struct query_line {
+	u8 mac[6];
+	u8 demod, tvch;
+	unsigned n, synced, drops;
+	unsigned long long eqsum, down_ms;
+	u32 eqmin, eqmax;
+	unsigned long long lost_ms;	// when sync was lost, 0 if it has sync
+	unsigned long long prev_ms;
+};
+
+struct query_ctx {
+	query_line * l;
+	unsigned n, max;
+};
+
+static void print_wall_ms(unsigned long long ms)
+{
+	time_t t = (time_t) (ms / 1000);
+	struct tm tm;
+	localtime_r(&t, &tm);
+	char buf[64];
+	strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+	printf("%s.%03u", buf, (unsigned) (ms % 1000));
+}
+
+static void query_cb(void * ctx, const siglog_entry & e)
+{
+	query_ctx * q = (query_ctx *) ctx;
+	unsigned i;
+	for (i = 0; i < q->n; i++) {
+		query_line & l = q->l[i];
+		if (l.demod == e.demod && l.tvch == e.tvch && !memcmp(l.mac, e.mac, 6)) break;
+	}
+	if (i == q->n) {
+		if (q->n >= q->max) {
+			unsigned max = q->max ? q->max*2 : 16;
+			query_line * p = (typeof(p)) realloc(q->l, sizeof(*p) * max);
+			if (!p) return;	// out of memory: ignore the new channel
+			q->l = p;
+			q->max = max;
+		}
+		query_line & l = q->l[q->n++];
+		memset(&l, 0, sizeof(l));
+		memcpy(l.mac, e.mac, 6);
+		l.demod = e.demod;
+		l.tvch = e.tvch;
+		l.eqmin = 0xfffff;
+	}
+
+	query_line & l = q->l[i];
+	l.n++;
+	if (e.status & 4) {
+		l.synced++;
+		l.eqsum += e.eqmse;
+		if (e.eqmse < l.eqmin) l.eqmin = e.eqmse;
+		if (e.eqmse > l.eqmax) l.eqmax = e.eqmse;
+		if (l.lost_ms) {
+			l.down_ms += e.ms - l.lost_ms;
+			print_wall_ms(e.ms);
+			printf(" %02x%02x%02x%02x%02x%02x demod %u ch %2u sync back after %.1fs\n", l.mac[0], l.mac[1], l.mac[2],
+				l.mac[3], l.mac[4], l.mac[5], l.demod, l.tvch, (e.ms - l.lost_ms) / 1000.0);
+			l.lost_ms = 0;
+		}
+	} else if (!l.lost_ms && l.n > 1 && l.synced) {
+		l.drops++;
+		l.lost_ms = e.ms;
+		print_wall_ms(e.ms);
+		printf(" %02x%02x%02x%02x%02x%02x demod %u ch %2u lost sync (status %x, last sample ", l.mac[0], l.mac[1],
+			l.mac[2], l.mac[3], l.mac[4], l.mac[5], l.demod, l.tvch, e.status);
+		print_wall_ms(l.prev_ms);
+		printf(")\n");
+	}
+	l.prev_ms = e.ms;
+}
+
+static int do_query(unsigned hours)
+{
+	unsigned long long now = wall_ms();
+	query_ctx q;
+	memset(&q, 0, sizeof(q));
+	if (siglog::query("siglog", now - hours*3600000ULL, now, query_cb, &q)) {
+		free(q.l);
+		return 1;
+	}
+
+	printf("tuner        demod ch  samples synced drops  down_s  eq_mse min/avg/max\n");
+	for (unsigned i = 0; i < q.n; i++) {
+		const query_line & l = q.l[i];
+		printf("%02x%02x%02x%02x%02x%02x %u   %2u %8u %5.1f%% %5u %7.1f", l.mac[0], l.mac[1], l.mac[2], l.mac[3],
+			l.mac[4], l.mac[5], l.demod, l.tvch, l.n, 100.0*l.synced/l.n, l.drops, l.down_ms / 1000.0);
+		if (l.synced) printf("  %4x/%4x/%4x", l.eqmin >> 4, (u32) (l.eqsum / l.synced) >> 4, l.eqmax >> 4);
+		printf("\n");
+	}
+	free(q.l);
 	return 0;
 }
 
 int main(int argc, char ** argv)
 {
 	tuner::tuner_antennas selected_antenna = tuner::nc;
+	unsigned per_ch_ant = 0;
 	unsigned record_ch = 0;
+	unsigned use_log = 0;
+	unsigned fast_zap = 0;
+	unsigned bench_reps = 0, bench_json = 0;
+	unsigned do_site_survey = 0;
+	unsigned use_uring = 0, use_packet = 0, ring_depth = mpgts::RING_DEPTH_DEFAULT;
 	unsigned i;
 	for (i = 1; (int) i < argc; i++) {
 		unsigned v;
@@ -430,8 +615,37 @@ int main(int argc, char ** argv)
 			case '2': selected_antenna = tuner::ant2; break;
 			case '3': selected_antenna = tuner::coax; break;
 			}
+		} else if (!strcmp(argv[i], "-A")) {
+			per_ch_ant = 1;
+		} else if (!strncmp(argv[i], "-b", 2) && sscanf(&argv[i][2], "%u", &v) == 1 && v) {
+			bench_reps = v;
+		} else if (!strcmp(argv[i], "-J")) {
+			bench_json = 1;
+		} else if (!strcmp(argv[i], "-z")) {
+			fast_zap = 1;
+		} else if (!strcmp(argv[i], "-S")) {
+			do_site_survey = 1;
+		} else if (!strcmp(argv[i], "-U")) {
+			use_uring = 1;
+		} else if (!strcmp(argv[i], "-P")) {
+			use_packet = 1;
+		} else if (!strncmp(argv[i], "-D", 2) && sscanf(&argv[i][2], "%u", &v) == 1 && v <= dgring::MAX_DEPTH) {
+			ring_depth = v;
+		} else if (!strncmp(argv[i], "-R", 2) && sscanf(&argv[i][2], "%u", &v) == 1 && v &&
+			v*2 <= rxbench::MAX_SOCKS)
+		{
+			rxbench rb;
+			if (rb.run(v*2)) return 1;
+			rb.print(stdout);
+			return 0;
+		} else if (!strcmp(argv[i], "-C")) {
+			use_plan = tuner::cable;
+		} else if (!strcmp(argv[i], "-l")) {
+			use_log = 1;
+		} else if (!strncmp(argv[i], "-q", 2) && sscanf(&argv[i][2], "%u", &v) == 1 && v) {
+			return do_query(v);
 		} else if (!strncmp(argv[i], "-c", 2) && sscanf(&argv[i][2], "%u", &v) == 1 &&
-			v >= tuner::TVCH_MIN && v <= tuner::TVCH_MAX)
+			v >= tuner::TVCH_MIN && v <= tuner::CATV_MAX)
 		{
 			record_ch = v;
 		} else {
@@ -440,6 +654,18 @@ int main(int argc, char ** argv)
 				"    -a1 = use Sezmi Antenna 1   | Antenna 2    Coax    Antenna 1  |\n"
 				"    -a2 = use Sezmi Antenna 2   | Power    Ethernet to Sezmi ...  |\n"
 				"    -a3 = use Coax Antenna      +---------------------------------+\n"
+				"    -A  = pick the best antenna for each channel instead of one for all\n"
+				"    -S  = site survey: every channel on every input using all tuners, table to stdout\n"
+				"    -C  = cable: scan QAM64 / QAM256 cable channels 2 - 135 on the coax input\n"
+				"    -bN = time-to-lock benchmark: tune every channel N times on each demod, CSV to stdout\n"
+				"    -J  = with -b, JSON instead of CSV\n"
+				"    -l  = while recording, log signal quality to siglog/\n"
+				"    -z  = with -c, fast channel change: keep the other demod tuned to the next channel\n"
+				"    -qH = print signal dropouts logged in siglog/ in the last H hours\n"
+				"    -U  = receive the TS with io_uring instead of epoll\n"
+				"    -P  = receive the TS with an AF_PACKET ring on the NIC (needs CAP_NET_RAW)\n"
+				"    -DN = demux up to N datagrams behind the receive thread, -D0 demuxes on the receive thread\n"
+				"    -RN = receive benchmark, no tuner needed: N tuners' worth of loopback streams, one thread\n"
 				"    This is just an example of how to use the tuner.\n"
 				"    It dumps the TVCT channel names of any ATSC channel it can find.\n",
 				argv[0]);
@@ -447,6 +673,11 @@ int main(int argc, char ** argv)
 		}
 	}
 
+	if (record_ch > tuner::TVCH_MAX && use_plan != tuner::cable) {
+		fprintf(stderr, "Error: -c%u is only a cable channel, use -C\n", record_ch);
+		return 1;
+	}
+
 	unsigned list_use = 0;
 	mpgts * list = mpgts::find(&list_use);
 	if (!list) return 1;
@@ -454,21 +685,48 @@ int main(int argc, char ** argv)
 		fprintf(stderr, "Error: no tuners found\n");
 		return 1;
 	}
+	for (i = 0; i < list_use; i++) {
+		list[i].set_rx_uring(use_uring);
+		list[i].set_rx_packet(use_packet);
+		list[i].set_ring_depth(ring_depth);
+	}
 
-	if (record_ch) {
+	if (do_site_survey) {
+		if (do_survey(list, list_use)) {
+			free(list);
+			return 1;
+		}
+	} else if (bench_reps) {
+		unsigned first = 1;
+		if (bench_json) printf("[");
+		for (i = 0; i < list_use; i++) {
+			if (do_bench(&list[i], selected_antenna, bench_reps, bench_json, &first)) {
+				free(list);
+				return 1;
+			}
+		}
+		if (bench_json) printf("\n]\n");
+	} else if (record_ch) {
 		if (i != 1) {
 			printf("%s found %u IPs, using only first to record %02u.ts:\n", argv[0], list_use, record_ch);
 		} else {
 			printf("%s found 1 IP, recording %02u.ts:\n", argv[0], record_ch);
 		}
-		if (do_record(&list[0], record_ch, selected_antenna)) {
+		siglog log;
+		if (use_log && log.open("siglog")) {
+			free(list);
+			return 1;
+		}
+		int r = do_record(&list[0], record_ch, selected_antenna, use_log ? &log : 0, fast_zap);
+		list[0].stop_monitor();	// before log goes away
+		if (r) {
 			free(list);
 			return 1;
 		}
 	} else {
 		printf("%s found %u IP%s, probing in order found:\n", argv[0], list_use, list_use == 1 ? "" : "s");
 		for (i = 0; i < list_use; i++) {
-			if (do_item(i, &list[i], selected_antenna)) {
+			if (do_item(i, &list[i], selected_antenna, per_ch_ant)) {
 				free(list);
 				return 1;
 			}
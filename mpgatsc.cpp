@@ -20,21 +20,15 @@ this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <pthread.h>
 #include "mpgts.h"
 
 using namespace tuner_ns;
 
-int mpgatsc::init()
+void mpgatsc::reset_stream()
 {
-	if (!iconv_hnd) {
-		iconv_hnd = iconv_open("ASCII", "UTF-16");
-		if (iconv_hnd == (iconv_t) -1) {
-			fprintf(stderr, "iconv_open(ASCII, UTF-16) failed: %d %s\n", errno, strerror(errno));
-			return 1;
-		}
-	}
-
-	// may be receiving a completely new stream: reset all state
+	qual.reset();
+	seq.reset();
 	unsigned i;
 	for (i = 0; i < sizeof(pktlist)/sizeof(pktlist[0]); i++) {
 		pktlen[i] = 0;
@@ -52,6 +46,45 @@ int mpgatsc::init()
 		free(vctstr);
 		vctstr = 0;
 	}
+	if (vct_mtx) {
+		pthread_mutex_lock((pthread_mutex_t *) vct_mtx);
+		char * p = vct_pub;
+		vct_pub = 0;
+		vct_pub_ver = 32;
+		pthread_mutex_unlock((pthread_mutex_t *) vct_mtx);
+		free(p);
+	}
+	ev_pending = 0;
+}
+
+static void * mpgatsc_mutex()
+{
+	pthread_mutex_t * m = (typeof(m)) malloc(sizeof(*m));
+	if (!m) {
+		fprintf(stderr, "mpgatsc::init(): malloc failed\n");
+		return 0;
+	}
+	pthread_mutex_init(m, 0);
+	return m;
+}
+
+int mpgatsc::init()
+{
+	// not in the constructor: mpgts::find() moves mpgatsc objects around with realloc()
+	if (!vct_mtx && !(vct_mtx = mpgatsc_mutex())) return 1;
+	if (!sub_mtx && !(sub_mtx = mpgatsc_mutex())) return 1;
+	if (!tap_mtx && !(tap_mtx = mpgatsc_mutex())) return 1;
+
+	if (!iconv_hnd) {
+		iconv_hnd = iconv_open("ASCII", "UTF-16");
+		if (iconv_hnd == (iconv_t) -1) {
+			fprintf(stderr, "iconv_open(ASCII, UTF-16) failed: %d %s\n", errno, strerror(errno));
+			return 1;
+		}
+	}
+
+	// may be receiving a completely new stream: reset all state
+	reset_stream();
 
 	// only reset dumpfile if bytes have been written
 	// otherwise, calling open_dump() right before start_ts() would result in dumpfile getting closed
@@ -70,6 +103,18 @@ mpgatsc::~mpgatsc()
 		free(vctstr);
 		vctstr = 0;
 	}
+	if (vct_pub) {
+		free(vct_pub);
+		vct_pub = 0;
+	}
+	void * m[] = { vct_mtx, sub_mtx, tap_mtx };
+	for (unsigned i = 0; i < sizeof(m)/sizeof(m[0]); i++) if (m[i]) {
+		pthread_mutex_destroy((pthread_mutex_t *) m[i]);
+		free(m[i]);
+	}
+	vct_mtx = 0;
+	sub_mtx = 0;
+	tap_mtx = 0;
 	if (pat) {
 		free(pat);
 		pat = 0;
@@ -451,6 +496,8 @@ int mpgatsc::parse_tbl(u8 * pkt, u32 len, u32 pid)
 				pat[prog] = childpid;
 			}
 		}
+		zap_mark(zaplat::pat);
+		tbl_parsed(ev_pat, pat_curver);
 		break;
 	}
 
@@ -459,6 +506,7 @@ int mpgatsc::parse_tbl(u8 * pkt, u32 len, u32 pid)
 		case 0xc7:	// MGT
 			if (atsc_parse_hdr(pkt, len, &pos, &mgt_curver, "MGT")) return pos ? 1 : 0;
 			if (parse_mgt(pkt, len, pos)) return 1;
+			tbl_parsed(ev_mgt, mgt_curver);
 			break;
 
 		case 0xc8:	// TVCT (terrestrial)
@@ -470,6 +518,7 @@ int mpgatsc::parse_tbl(u8 * pkt, u32 len, u32 pid)
 			}
 			vct_curver = prev_curver;
 			if (parse_vct(pkt, len, pos, "TVCT")) return 1;
+			vct_parsed();
 			break;
 		}
 
@@ -482,6 +531,7 @@ int mpgatsc::parse_tbl(u8 * pkt, u32 len, u32 pid)
 			}
 			vct_curver = prev_curver;
 			if (parse_vct(pkt, len, pos, "CVCT")) return 1;
+			vct_parsed();
 			break;
 		}
 
@@ -494,6 +544,7 @@ int mpgatsc::parse_tbl(u8 * pkt, u32 len, u32 pid)
 			}
 			vct_curver = prev_curver;
 			if (parse_vct(pkt, len, pos, "SVCT")) return 1;
+			vct_parsed();
 			break;
 		}
 
@@ -526,6 +577,8 @@ int mpgatsc::parse_tbl(u8 * pkt, u32 len, u32 pid)
 			if (mpg_parse_hdr(pkt, len, &pos, &id, &pmt_curver, "PMT", 2 /*PMT tblid*/)) return pos ? 1 : 0;
 			if (id && id != 3) fprintf(stderr, "Warn: PMT with prog=%u (should be 3)\n", id);
 			pcr_pid = (((u32) pkt[pos] << 8) + pkt[pos + 1]) & 0x1fff;
+			zap_mark(zaplat::pmt);
+			tbl_parsed(ev_pmt, pmt_curver);
 			//dump_pkt(pkt + pos, 26);
 		}
 		break;
@@ -533,17 +586,149 @@ int mpgatsc::parse_tbl(u8 * pkt, u32 len, u32 pid)
 	return 0;
 }
 
+void mpgatsc::tbl_parsed(unsigned ev, u32 ver)
+{
+	__sync_fetch_and_or(&ev_pending, ev);
+	if (ev_fd != -1) {
+		unsigned long long one = 1;
+		if (write(ev_fd, &one, sizeof(one)) != sizeof(one))
+			fprintf(stderr, "mpgatsc::tbl_parsed(): write(eventfd) failed: %d %s\n", errno, strerror(errno));
+	}
+
+	// tables only change every few seconds at most, so taking the lock here costs nothing
+	if (!sub_mtx) return;
+	pthread_mutex_lock((pthread_mutex_t *) sub_mtx);
+	for (unsigned i = 0; i < MAX_SUBS; i++) if (subs[i].mask & ev) subs[i].cb(subs[i].ctx, ev, ver);
+	pthread_mutex_unlock((pthread_mutex_t *) sub_mtx);
+}
+
+void mpgatsc::vct_parsed()
+{
+	zap_mark(zaplat::vct);
+
+	// publish a copy: vctstr is rebuilt in place by the next parse_vct()
+	char * p = vct_mtx ? (typeof(p)) malloc(strlen(vctstr) + 1) : 0;
+	if (!p) {
+		fprintf(stderr, "mpgatsc::vct_parsed(): malloc failed\n");
+	} else {
+		strcpy(p, vctstr);
+		pthread_mutex_lock((pthread_mutex_t *) vct_mtx);
+		char * old = vct_pub;
+		vct_pub = p;
+		vct_pub_ver = vct_curver;
+		pthread_mutex_unlock((pthread_mutex_t *) vct_mtx);
+		free(old);
+	}
+	tbl_parsed(ev_vct, vct_curver);
+}
+
+char * mpgatsc::copy_vct(u32 * ver /*= 0*/) const
+{
+	if (!vct_mtx) return 0;
+	char * p = 0;
+	pthread_mutex_lock((pthread_mutex_t *) vct_mtx);
+	if (vct_pub) {
+		p = (typeof(p)) malloc(strlen(vct_pub) + 1);
+		if (p) strcpy(p, vct_pub);
+		else fprintf(stderr, "mpgatsc::copy_vct(): malloc failed\n");
+	}
+	if (ver) *ver = vct_pub_ver;
+	pthread_mutex_unlock((pthread_mutex_t *) vct_mtx);
+	return p;
+}
+
+int mpgatsc::subscribe(unsigned mask, tbl_cb cb, void * ctx)
+{
+	if (!sub_mtx || !cb || !(mask & EV_ALL)) {
+		fprintf(stderr, "mpgatsc::subscribe(%x) invalid\n", mask);
+		return 1;
+	}
+	pthread_mutex_lock((pthread_mutex_t *) sub_mtx);
+	unsigned i;
+	for (i = 0; i < MAX_SUBS; i++) if (!subs[i].mask) break;
+	if (i < MAX_SUBS) {
+		subs[i].cb = cb;
+		subs[i].ctx = ctx;
+		subs[i].mask = mask & EV_ALL;
+	}
+	pthread_mutex_unlock((pthread_mutex_t *) sub_mtx);
+	if (i >= MAX_SUBS) {
+		fprintf(stderr, "mpgatsc::subscribe(%x): already %u subscribers\n", mask, (unsigned) MAX_SUBS);
+		return 1;
+	}
+	return 0;
+}
+
+void mpgatsc::unsubscribe(tbl_cb cb, void * ctx)
+{
+	if (!sub_mtx) return;
+	pthread_mutex_lock((pthread_mutex_t *) sub_mtx);
+	for (unsigned i = 0; i < MAX_SUBS; i++) if (subs[i].cb == cb && subs[i].ctx == ctx) {
+		subs[i].mask = 0;
+		subs[i].cb = 0;
+		subs[i].ctx = 0;
+	}
+	pthread_mutex_unlock((pthread_mutex_t *) sub_mtx);
+}
+
+int mpgatsc::tap(dgram_cb cb, void * ctx)
+{
+	if (!tap_mtx || !cb) {
+		fprintf(stderr, "mpgatsc::tap() invalid\n");
+		return 1;
+	}
+	pthread_mutex_lock((pthread_mutex_t *) tap_mtx);
+	unsigned i;
+	for (i = 0; i < MAX_TAPS; i++) if (!taps[i].cb) break;
+	if (i < MAX_TAPS) {
+		taps[i].cb = cb;
+		taps[i].ctx = ctx;
+		n_taps++;
+	}
+	pthread_mutex_unlock((pthread_mutex_t *) tap_mtx);
+	if (i >= MAX_TAPS) {
+		fprintf(stderr, "mpgatsc::tap(): already %u taps\n", (unsigned) MAX_TAPS);
+		return 1;
+	}
+	return 0;
+}
+
+void mpgatsc::untap(dgram_cb cb, void * ctx)
+{
+	if (!tap_mtx) return;
+	pthread_mutex_lock((pthread_mutex_t *) tap_mtx);
+	for (unsigned i = 0; i < MAX_TAPS; i++) if (taps[i].cb == cb && taps[i].ctx == ctx) {
+		taps[i].cb = 0;
+		taps[i].ctx = 0;
+		n_taps--;
+	}
+	pthread_mutex_unlock((pthread_mutex_t *) tap_mtx);
+}
+
+void mpgatsc::run_taps(dgbuf * b)
+{
+	// without taps this is every datagram, so it skips the lock. A tap() that races this misses one datagram,
+	// and so does a borrowed one: rx_datagram() only borrows when there are no taps
+	if (!n_taps || !tap_mtx || !b->pool) return;
+	pthread_mutex_lock((pthread_mutex_t *) tap_mtx);
+	for (unsigned i = 0; i < MAX_TAPS; i++) if (taps[i].cb) taps[i].cb(taps[i].ctx, b);
+	pthread_mutex_unlock((pthread_mutex_t *) tap_mtx);
+}
+
 static const unsigned max_pkt_len = 0x1003;
 int mpgatsc::thread_demux(u8 pkt[188])
 {
 	if (pkt[0] != 0x47) {
-		fprintf(stderr, "thread_demux: sync byte is %02x not 47\n", pkt[0]);
-		return 1;
+		// each datagram starts on a packet boundary, so the next packet is still worth a look
+		qual.sync_loss();
+		return 0;
 	}
 	if (pkt[1] & 0x80) {
-		//fprintf(stderr, "thread_demux: FEC fail\n");
+		qual.tei();	// FEC fail: the pid and cc cannot be trusted either
 		return 0;
 	}
+	u32 pid = (((u32) pkt[1] << 8) + pkt[2]) & 0x1fff;
+	qual.pkt(pid, pkt);
 	if (dumpfile) {
 		if (fwrite(pkt, 1, 188, (FILE *) dumpfile) != 188) {
 			fprintf(stderr, "thread_demux: write(%s) failed: %d %s\n", dumpfilename, errno, strerror(errno));
@@ -552,11 +737,11 @@ int mpgatsc::thread_demux(u8 pkt[188])
 		}
 	}
 
-	u32 pid = (((u32) pkt[1] << 8) + pkt[2]) & 0x1fff;
 	u32 pos = 4;
 
 	if (pkt[3] & 0x20) {
 		if (pid == 0) fprintf(stderr, "thread_demux: PAT with adaptation %02x\n", pkt[4]);
+		if (pcr_pid && pid == pcr_pid && pkt[4] && (pkt[5] & 0x10)) zap_mark(zaplat::pcr);	// PCR flag
 		pos += pkt[pos] + 1;
 		if (pos > 188) {
 			fprintf(stderr, "Warn: thread_demux: adaptation len %u invalid\n", pos);
@@ -644,3 +829,12 @@ int mpgatsc::open_dump(const char * filename)
 	fprintf(stderr, "dumpfile=%p this=%p\n", dumpfile, this);
 	return 0;
 }
+
+void mpgatsc::move_dump(mpgatsc & from)
+{
+	if (dumpfile) fclose((FILE *) dumpfile);
+	dumpfile = from.dumpfile;
+	memcpy(dumpfilename, from.dumpfilename, sizeof(dumpfilename));
+	from.dumpfile = 0;
+	from.dumpfilename[0] = 0;
+}
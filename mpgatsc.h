@@ -24,7 +24,14 @@ protected:
 	unsigned pat_use, pat_max;
 	unsigned * pat;
 	void * iconv_hnd;
-	char * vctstr;
+	char * vctstr;		// demux thread only: parse_vct() builds the VCT lines here
+	char * vct_pub;		// copy of vctstr for other threads, under vct_mtx
+	u32 vct_pub_ver;
+	void * vct_mtx;
+	void * sub_mtx;		// held while callbacks run
+	void * tap_mtx;		// held while taps run
+	volatile unsigned n_taps;
+	volatile unsigned ev_pending;
 	char dumpfilename[256];
 	void * dumpfile;
 
@@ -32,6 +39,9 @@ protected:
 	int parse_vct(u8 * pkt, u32 pos, u32 len, const char * tblname);
 	int parse_descriptors(u8 * pkt, u32 pos, u32 len, const char * tblname);
 	int parse_tbl(u8 * pkt, u32 len, u32 pid);
+	void zap_mark(zaplat::zap_stage st) { if (zap && zap->is_armed()) zap->mark(st); }
+	void tbl_parsed(unsigned ev, u32 ver);
+	void vct_parsed();
 
 public:
 	mpgatsc() {
@@ -55,19 +65,98 @@ public:
 		dumpfilename[0] = 0;
 		dumpfile = 0;
 		tvch = 0;
+		zap = 0;
+		ev_fd = -1;
+		ev_pending = 0;
+		vct_pub = 0;
+		vct_pub_ver = 32;
+		vct_mtx = 0;
+		sub_mtx = 0;
+		for (unsigned i = 0; i < MAX_SUBS; i++) {
+			subs[i].mask = 0;
+			subs[i].cb = 0;
+			subs[i].ctx = 0;
+		}
+		tap_mtx = 0;
+		n_taps = 0;
+		for (unsigned i = 0; i < MAX_TAPS; i++) {
+			taps[i].cb = 0;
+			taps[i].ctx = 0;
+		}
 	}
 
 	~mpgatsc();
 
 	int init();
 
-	int thread_demux(u8 pkt[188]);
+	// reset_stream() forgets all tables, for when the DT3305 has been tuned to another channel
+	// unlike init() it leaves the dump file alone
+	void reset_stream();
 
-	const char * get_vct() const { return vctstr; }
+	int thread_demux(u8 pkt[188]);
 
 	int open_dump(const char * filename);
 
+	// move_dump() takes over the dump file of from, so the packets from this stream go there instead
+	// must only be called from the demux thread
+	void move_dump(mpgatsc & from);
+
+	// table events: the PAT, PMT, MGT or VCT was parsed for the first time since reset_stream(), or changed version
+	enum tbl_event {
+		ev_pat = 1,
+		ev_pmt = 2,
+		ev_mgt = 4,
+		ev_vct = 8,
+		EV_ALL = 0xf,
+	};
+	enum mpgatsc_constants {
+		MAX_SUBS = 4,
+		MAX_TAPS = 4,
+	};
+	typedef void (* tbl_cb)(void * ctx, unsigned ev, u32 ver);
+
+	// subscribe() calls cb on the demux thread for every event in mask, it returns 1 if there are MAX_SUBS
+	// already. cb must be quick and must not subscribe() or unsubscribe(); it can call copy_vct().
+	// once unsubscribe() returns cb is not running and will not be called again
+	int subscribe(unsigned mask, tbl_cb cb, void * ctx);
+	void unsubscribe(tbl_cb cb, void * ctx);
+
+	// without a callback: ev_fd becomes readable on every event, take_events() returns (and clears) the events
+	// since the last take_events(). reset_stream() clears them too
+	unsigned take_events() { return __sync_fetch_and_and(&ev_pending, 0); }
+
+	// taps see every datagram after thread_demux() has, in order. tap() returns 1 if there are MAX_TAPS already.
+	// b is only good until cb returns, unless cb takes a reference with dgpool::hold(b): then the 7 TS packets
+	// at b->buf + 12 stay put without a copy until dgpool::put(b), which any thread can call. cb must be quick,
+	// it runs on the demux thread. Once untap() returns cb is not running and will not be called again
+	typedef void (* dgram_cb)(void * ctx, dgbuf * b);
+	int tap(dgram_cb cb, void * ctx);
+	void untap(dgram_cb cb, void * ctx);
+	void run_taps(dgbuf * b);	// demux thread only
+	unsigned has_taps() const { return n_taps; }
+
+	// copy_vct() is a malloc()ed copy of the VCT lines that the caller must free(), or 0 if there is no VCT yet
+	// it is safe to call from any thread
+	char * copy_vct(u32 * ver = 0) const;
+
 	unsigned tvch;
+	zapclock * zap;	// thread_demux() marks the PSI stages of the channel change here
+	tsqual qual;	// thread_demux() counts every packet here, reset_stream() clears it
+	rxseq seq;	// mpgts::dmx_dgram() puts datagrams in order here before thread_demux(), reset_stream() clears it
+	int ev_fd;	// eventfd, thread_demux() adds 1 on every table event. -1 if not used
+
+protected:
+	struct tbl_sub {
+		unsigned mask;
+		tbl_cb cb;
+		void * ctx;
+	};
+	tbl_sub subs[MAX_SUBS];	// under sub_mtx
+	struct dgram_tap {
+		dgram_cb cb;
+		void * ctx;
+	};
+	dgram_tap taps[MAX_TAPS];	// under tap_mtx
 };
 
 }
@@ -18,77 +18,599 @@ this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdlib.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <poll.h>
 #include <arpa/inet.h>
+#include <netinet/udp.h>
+#include <linux/filter.h>
 #include "mpgts.h"
 
 using namespace tuner_ns;
 
-void * mpgts::thread_main()
+struct mpgts::rxbatch {
+	struct mmsghdr msg[RX_BATCH];
+	struct iovec iov[RX_BATCH];
+	// UDP_GRO segment size, SO_RXQ_OVFL and SO_TIMESTAMPNS
+	char ctrl[RX_BATCH][CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(u32)) + CMSG_SPACE(sizeof(struct timespec))];
+	u8 buf[RX_GRO_BATCH*RX_GRO_MAX];	// RX_BATCH x RX_MAX, or RX_GRO_BATCH x RX_GRO_MAX with UDP_GRO
+	dgbuf * b[RX_BATCH];	// without UDP_GRO: the dgbuf iov[k] points at, 0 if it points into buf
+};
+
+// rx_setup() turns on UDP_GRO if want_gro, then points the rxbatch buffers at rx->buf
+int mpgts::rx_setup()
 {
-	for (;;) {
-		fd_set rfds, wfds, efds;
-		FD_ZERO(&rfds);
-		FD_ZERO(&wfds);
-		FD_ZERO(&efds);
-		FD_SET(udp_sock[0], &rfds);
-		FD_SET(udp_sock[1], &rfds);
-
-		struct timespec t_out;
-		t_out.tv_sec = 0;
-		t_out.tv_nsec = 100*1000000L;
-		int max_sock = udp_sock[0];
-		if (udp_sock[1] > udp_sock[0]) max_sock = udp_sock[1];
-		ssize_t r = pselect(max_sock + 1, &rfds, &wfds, &efds, &t_out, 0 /*sigmask*/);
-		if (r < 0) {
-			fprintf(stderr, "mpegts: pselect() failed: %d %s\n", errno, strerror(errno));
+	{
+		// this will trigger a compiler error if rx->buf is too small without UDP_GRO
+		u32 rx_buf_size_check[(int) (RX_GRO_BATCH*RX_GRO_MAX - RX_BATCH*RX_MAX) + 1];
+		(void) rx_buf_size_check;
+	}
+
+	rx_gro = 0;
+	if (want_gro && !rx_uring && !rx_packet) {	// ring does not ask for the UDP_GRO cmsg, pkt has its own
+		int on = 1;
+		unsigned i;
+		for (i = 0; i < 2; i++) if (setsockopt(udp_sock[i], SOL_UDP, UDP_GRO, &on, sizeof(on))) {
+			if (errno != ENOPROTOOPT)
+				fprintf(stderr, "mpgts::open(%u): UDP_GRO failed: %d %s\n", i, errno, strerror(errno));
+			break;
+		}
+		if (i >= 2) rx_gro = 1;
+		else {
+			// both sockets share rx, so both or neither
+			on = 0;
+			while (i--) setsockopt(udp_sock[i], SOL_UDP, UDP_GRO, &on, sizeof(on));
+		}
+	}
+
+	// the kernel only writes msg_len, msg_flags and msg_controllen, so the rest is set up once
+	memset(rx->msg, 0, sizeof(rx->msg));
+	unsigned n = rx_gro ? RX_GRO_BATCH : RX_BATCH;
+	unsigned len = rx_gro ? RX_GRO_MAX : RX_MAX;
+	for (unsigned k = 0; k < n; k++) {
+		rx->iov[k].iov_base = rx->buf + k*len;
+		rx->iov[k].iov_len = len;
+		rx->msg[k].msg_hdr.msg_iov = &rx->iov[k];
+		rx->msg[k].msg_hdr.msg_iovlen = 1;
+		rx->msg[k].msg_hdr.msg_control = rx->ctrl[k];
+	}
+	return 0;
+}
+
+static unsigned long long real_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (unsigned long long) ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+// rx_cmsg() returns the size of each datagram coalesced in a UDP_GRO buffer, len if it was not coalesced
+// *ovfl is set to the SO_RXQ_OVFL count if there is one: it is only sent after the first drop
+// *ns is set to the SO_TIMESTAMPNS arrival time, it is left alone if there is none
+static unsigned rx_cmsg(struct msghdr * h, unsigned len, volatile u32 * ovfl, unsigned long long * ns)
+{
+	unsigned seg = len;
+	for (struct cmsghdr * c = CMSG_FIRSTHDR(h); c; c = CMSG_NXTHDR(h, c)) {
+		if (c->cmsg_level == SOL_UDP && c->cmsg_type == UDP_GRO) {
+			int sz;
+			memcpy(&sz, CMSG_DATA(c), sizeof(sz));
+			if (sz > 0) seg = sz;
+		} else if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_RXQ_OVFL) {
+			u32 n;
+			memcpy(&n, CMSG_DATA(c), sizeof(n));
+			*ovfl = n;
+		} else if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) {
+			struct timespec ts;
+			memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+			*ns = (unsigned long long) ts.tv_sec*1000000000 + ts.tv_nsec;
+		}
+	}
+	return seg;
+}
+
+// rx_sockopt() sets the receive buffer and turns on SO_RXQ_OVFL for udp_sock[i]
+int mpgts::rx_sockopt(u8 i)
+{
+	if (want_rcvbuf) {
+		// SO_RCVBUFFORCE can go past net.core.rmem_max but needs CAP_NET_ADMIN
+		int v = (int) want_rcvbuf;
+		if (setsockopt(udp_sock[i], SOL_SOCKET, SO_RCVBUFFORCE, &v, sizeof(v)) &&
+			setsockopt(udp_sock[i], SOL_SOCKET, SO_RCVBUF, &v, sizeof(v)))
+		{
+			fprintf(stderr, "mpgts::open(%u): SO_RCVBUF %u failed: %d %s\n", i, want_rcvbuf, errno, strerror(errno));
+			return 1;
+		}
+	}
+	int v = 0;
+	socklen_t vlen = sizeof(v);
+	if (getsockopt(udp_sock[i], SOL_SOCKET, SO_RCVBUF, &v, &vlen)) v = 0;
+	rcvbuf[i] = (unsigned) v;	// the kernel doubles what was asked for, and caps it at rmem_max
+	if (want_rcvbuf && rcvbuf[i] < want_rcvbuf) {
+		fprintf(stderr, "Warn: mpgts%u: SO_RCVBUF is %u, not %u (raise net.core.rmem_max)\n", i, rcvbuf[i],
+			want_rcvbuf);
+	}
+
+	v = 1;
+	if (setsockopt(udp_sock[i], SOL_SOCKET, SO_RXQ_OVFL, &v, sizeof(v))) {
+		fprintf(stderr, "mpgts::open(%u): SO_RXQ_OVFL failed: %d %s\n", i, errno, strerror(errno));
+		return 1;
+	}
+	if (setsockopt(udp_sock[i], SOL_SOCKET, SO_TIMESTAMPNS, &v, sizeof(v))) {
+		fprintf(stderr, "mpgts::open(%u): SO_TIMESTAMPNS failed: %d %s\n", i, errno, strerror(errno));
+		return 1;
+	}
+	arr[i].reset();
+
+	struct stat st;
+	if (fstat(udp_sock[i], &st)) {
+		fprintf(stderr, "mpgts::open(%u): fstat failed: %d %s\n", i, errno, strerror(errno));
+		return 1;
+	}
+	udp_inode[i] = (unsigned long) st.st_ino;	// to find it in /proc/net/udp
+	rx_ovfl[i] = 0;
+	rx_dgrams[i] = 0;
+	return 0;
+}
+
+// proc_udp() reads the drops and rx_queue columns of /proc/net/udp for both sockets
+// "sl local_address rem_address st tx_queue:rx_queue tr:tm->when retrnsmt uid timeout inode ref pointer drops"
+int mpgts::proc_udp(unsigned long drops[2], unsigned queue[2]) const
+{
+	FILE * f = fopen("/proc/net/udp", "r");
+	if (!f) {
+		fprintf(stderr, "mpgts::proc_udp(): /proc/net/udp failed: %d %s\n", errno, strerror(errno));
+		return 1;
+	}
+	unsigned found = 0;
+	char line[512];
+	while (found < 2 && fgets(line, sizeof(line), f)) {
+		unsigned txq, rxq;
+		unsigned long inode, d;
+		if (sscanf(line, " %*u: %*x:%*x %*x:%*x %*x %x:%x %*x:%*x %*x %*u %*u %lu %*u %*x %lu",
+			&txq, &rxq, &inode, &d) != 4)
+		{
+			continue;	// the header line
+		}
+		for (unsigned i = 0; i < 2; i++) if (inode == udp_inode[i]) {
+			drops[i] = d;
+			queue[i] = rxq;
+			found++;
+		}
+	}
+	fclose(f);
+	if (found < 2) {
+		fprintf(stderr, "mpgts::proc_udp(): %u of 2 sockets found\n", found);
+		return 1;
+	}
+	return 0;
+}
+
+int mpgts::get_rx_stats(u8 ch, rxstats * out)
+{
+	if (ch >= tuner::NUM_CHANNELS || udp_sock[ch] == -1) return 1;
+	memset(out, 0, sizeof(*out));
+	unsigned long drops[2] = { 0, 0 };
+	unsigned queue[2] = { 0, 0 };
+	if (proc_udp(drops, queue)) return 1;
+
+	out->dgrams = rx_dgrams[ch];
+	out->host_drops = host_drops[ch];
+	out->ovfl = rx_ovfl[ch];
+	out->rcvbuf = rcvbuf[ch];
+	out->rx_queue = queue[ch];
+	if (rx_packet) {
+		// the muted UDP sockets drop everything on purpose, the ring is what counts
+		__sync_fetch_and_add(&pkt_drops, pkt.get_drops());
+		out->ring_drops = pkt_drops;
+	} else out->sock_drops = drops[ch];
+	return 0;
+}
+
+// rx_datagram() returns nonzero if thread_main() should stop
+// b is 0 if buf is not in a dgbuf yet. Otherwise buf is b->buf and rx_datagram() takes over the reference
+int mpgts::rx_datagram(u8 i, u8 * buf, unsigned len, unsigned long now, unsigned long long ns, dgbuf * b /*= 0*/)
+{
+	if (len == 0) fprintf(stderr, "mpegts: recvmmsg%u got 0 bytes\n", i);
+	else if (len != 1328) fprintf(stderr, "Warn: mpegts%u: %u byte packet (not 1328)\n", i, len);
+	if (len != 1328) {
+		if (b) dgpool::put(b);
+		return 0;
+	}
+	rx_dgrams[i]++;
+	arr[i].add(ns);
+	if (!b && !dg[i].is_open() && !atsc[i].has_taps()) {
+		// nothing keeps it past dmx_dgram(): demux it where it is, in the io_uring or AF_PACKET ring or the
+		// UDP_GRO buffer. rxseq copies it only if it has to hold it
+		dgbuf tmp;
+		tmp.ref = 1;
+		tmp.len = len;
+		tmp.ms = now;
+		tmp.gen = dmx_gen[i];
+		tmp.pool = 0;
+		tmp.next = 0;
+		tmp.buf = buf;
+		return dmx_dgram(i, &tmp);
+	}
+	if (!b) {
+		// out of the UDP_GRO buffer, the io_uring buffer or the AF_PACKET ring: the only copy
+		b = pool.get();
+		if (!b) {
+			host_drops[i]++;	// rxseq will count it lost too
 			return 0;
 		}
+		memcpy(b->buf, buf, len);
+	}
+	b->len = len;
+	b->ms = now;
+	b->gen = dmx_gen[i];
+	if (!dg[i].is_open()) {
+		int r = dmx_dgram(i, b);
+		dgpool::put(b);
+		return r;
+	}
 
-		unsigned i;
-		for (i = 0; i < 2; i++) if (want_reset[i]) {
-			want_reset[i] = 0;
-			if (atsc[i].init()) return 0;
+	// dmx_main() takes it from here. A full ring drops it: rxseq will count it lost too
+	if (dg[i].push(b)) {
+		host_drops[i]++;
+		dgpool::put(b);
+	}
+	return 0;
+}
+
+// dmx_dgram() is everything after rx_datagram() that touches atsc[i]. It runs on dmx_main() with
+// dmx_mtx[i] held, or straight from rx_datagram() with set_ring_depth(0)
+int mpgts::dmx_dgram(u8 i, dgbuf * b)
+{
+	if (b->gen != dmx_gen[i]) return 0;	// received before the last reset, from the old channel
+	if (zap[i].is_armed()) zap[i].mark(zaplat::udp);
+	atsc[i].qual.tick(b->ms);
+	return atsc[i].seq.push(b, demux_dgram, &atsc[i]);
+}
+
+// demux_dgram() gets the datagrams from rxseq, back in order
+int mpgts::demux_dgram(void * ctx, dgbuf * b)
+{
+	mpgatsc * a = (mpgatsc *) ctx;
+	// 32 bit sequence number at buf[0], see rxseq
+	// 32 bits of 0 at buf[4]
+	// 32 bits of 0 at buf[8]
+	// 7 x 188-byte TS packets start at buf[12]
+	u32 ofs = 12;
+	u8 * p = b->buf + ofs;
+	for (; ofs < b->len; ofs += 188 /*size of a TS packet*/, p += 188)
+		if (a->thread_demux(p)) return 1;
+	a->run_taps(b);
+	return 0;
+}
+
+// rx_fill() points each iov at a dgbuf so recvmmsg() fills it and rx_datagram() passes it on as is
+// if pool is empty it points into rx->buf instead, and rx_datagram() drops what lands there
+void mpgts::rx_fill()
+{
+	for (unsigned k = 0; k < RX_BATCH; k++) {
+		if (rx->b[k]) continue;
+		rx->b[k] = pool.get();
+		rx->iov[k].iov_base = rx->b[k] ? rx->b[k]->buf : rx->buf + k*RX_MAX;
+		rx->iov[k].iov_len = rx->b[k] ? (unsigned) dgbuf::DGRAM : (unsigned) RX_MAX;
+	}
+}
+
+// rx_drain() reads everything queued on udp_sock[i], RX_BATCH datagrams per syscall
+// or RX_GRO_BATCH buffers of coalesced datagrams with UDP_GRO
+// returns nonzero if thread_main() should stop
+int mpgts::rx_drain(u8 i)
+{
+	int n_msg = rx_gro ? RX_GRO_BATCH : RX_BATCH;
+	for (;;) {
+		if (!rx_gro) rx_fill();
+		for (int k = 0; k < n_msg; k++) rx->msg[k].msg_hdr.msg_controllen = sizeof(rx->ctrl[k]);
+		int n = recvmmsg(udp_sock[i], rx->msg, n_msg, MSG_DONTWAIT, 0 /*timeout*/);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+			fprintf(stderr, "mpegts: recvmmsg%u failed: %d %s\n", i, errno, strerror(errno));
+			return 1;
+		}
+
+		// one clock read per batch: the whole batch was already queued when recvmmsg() returned
+		unsigned long now = mono_ms();
+		for (int k = 0; k < n; k++) {
+			struct msghdr * h = &rx->msg[k].msg_hdr;
+			u8 * buf = (u8 *) rx->iov[k].iov_base;
+			unsigned len = rx->msg[k].msg_len;
+			unsigned long long ns = 0;
+			unsigned seg = rx_cmsg(h, len, &rx_ovfl[i], &ns);
+			if (!ns) ns = real_ns();
+			if (!rx_gro) {
+				if (h->msg_flags & MSG_TRUNC) len = RX_MAX + 1;	// just "too long"
+				dgbuf * b = rx->b[k];
+				rx->b[k] = 0;
+				if (rx_datagram(i, buf, len, now, ns, b)) return 1;
+				continue;
+			}
+
+			// split the UDP_GRO buffer back into datagrams. If it was truncated the last one is short
+			unsigned ofs = 0;
+			if (!seg) seg = len;
+			do {
+				unsigned l = len - ofs < seg ? len - ofs : seg;
+				if (rx_datagram(i, buf + ofs, l, now, ns)) return 1;
+				ofs += l;
+			} while (ofs < len);
 		}
+		if (n < n_msg) return 0;	// short batch: the socket is empty
+	}
+}
+
+void mpgts::dmx_lock(u8 i) const
+{
+	if (dmx_mtx[i]) pthread_mutex_lock((pthread_mutex_t *) dmx_mtx[i]);
+}
 
-		if (!r) continue;
+void mpgts::dmx_unlock(u8 i) const
+{
+	if (dmx_mtx[i]) pthread_mutex_unlock((pthread_mutex_t *) dmx_mtx[i]);
+}
 
-		for (i = 0; i < 2; i++) if (FD_ISSET(udp_sock[i], &rfds)) {
-			u8 rx[4096];
+// dmx_main() empties dg[i] into atsc[i] until close() sets dmx_stop
+void * mpgts::dmx_main(u8 i)
+{
+	for (;;) {
+		dgbuf * b = dg[i].peek();
+		if (!b) {
+			if (dmx_stop) return 0;
+			dg[i].wait();
+			continue;
+		}
 
-			struct sockaddr_in sin;
-			memset(&sin, 0, sizeof(sin));
-			socklen_t sinlen = sizeof(sin);
-			r = recvfrom(udp_sock[i], rx, sizeof(rx), 0 /*flags*/, (struct sockaddr *) &sin, &sinlen);
-			if (r < 0) {
-				fprintf(stderr, "mpegts: recvfrom%u failed: %d %s\n", i, errno, strerror(errno));
+		dmx_lock(i);
+		unsigned n = 0;
+		do {
+			int err = dmx_dgram(i, b);
+			dg[i].release();
+			dgpool::put(b);
+			if (err) {
+				dmx_unlock(i);
+				fprintf(stderr, "mpegts%u: demux failed, stopping\n", i);
 				return 0;
 			}
-			if (r == 0) {
-				fprintf(stderr, "mpegts: recvfrom%u got 0 bytes\n", i);
+		} while (++n < DMX_BATCH && (b = dg[i].peek()));
+		dmx_unlock(i);
+	}
+}
+
+// dmx_sync() waits until dmx_main() has demuxed everything already in dg[i]. receive thread only
+void mpgts::dmx_sync(u8 i)
+{
+	if (!dg[i].is_open() || !dmxth[i]) return;
+	u32 p = dg[i].pos();
+	unsigned long t0 = mono_ms();
+	while (!dg[i].passed(p)) {
+		if (mono_ms() - t0 > DMX_SYNC_MS) {
+			fprintf(stderr, "mpegts%u: demux thread did not catch up in %ums, not waiting\n", i, (unsigned) DMX_SYNC_MS);
+			return;
+		}
+		usleep(1000);
+	}
+}
+
+void * mpgts::dmx_wrapper(void * p)
+{
+	dmxarg * a = (dmxarg *) p;
+	return a->self->dmx_main(a->ch);
+}
+
+// rx_flush() takes what is already queued for udp_sock[i] (or in pkt) before a command resets atsc[i], so
+// none of the old channel's datagrams are seen after zap[i].arm(): they are demuxed right away, or with dg[i]
+// they are tagged with the old dmx_gen[i] and dmx_dgram() drops them. Not with rx_uring: run_command() runs inside
+// ring.reap() there, and the datagrams that came in before the command are the completions ahead of it
+void mpgts::rx_flush(u8 i)
+{
+	if (rx_uring) return;
+	int err;
+	if (rx_packet) {
+		ring_ms = mono_ms();
+		err = pkt.reap(pkt_cb, this);
+	} else err = rx_drain(i);
+	if (err) fprintf(stderr, "mpegts%u: could not flush the receive queue\n", i);
+}
+
+// seq_flush() demuxes what rxseq is still holding back behind a gap before atsc[i] is reset, so it
+// still reaches the dump file. Called with dmx_mtx[i] held, or once the demux threads are gone
+void mpgts::seq_flush(u8 i)
+{
+	if (atsc[i].seq.flush(demux_dgram, &atsc[i])) fprintf(stderr, "mpegts%u: demux failed on flush\n", i);
+}
+
+// run_command() does what c asks, returns nonzero if thread_main() should stop
+// *rv is what command() returns to its caller
+int mpgts::run_command(ts_cmd c, u8 ch, u8 to, int * rv)
+{
+	*rv = 0;
+	switch (c) {
+	case cmd_none:
+		break;
+	case cmd_reset:
+		rx_flush(ch);
+		dmx_lock(ch);
+		seq_flush(ch);
+		dmx_gen[ch]++;
+		host_drops[ch] = 0;
+		if (atsc[ch].init()) *rv = 1;
+		zap[ch].arm();
+		dmx_unlock(ch);
+		break;
+	case cmd_zap:
+		rx_flush(ch);
+		dmx_lock(ch);
+		seq_flush(ch);
+		dmx_gen[ch]++;
+		host_drops[ch] = 0;
+		atsc[ch].reset_stream();
+		zap[ch].arm();
+		dmx_unlock(ch);
+		break;
+	case cmd_swap:
+		// what dg[ch] holds came in before the swap, so it belongs in the dump file being moved
+		dmx_sync(ch);
+		// always 0 then 1 so this can never deadlock
+		dmx_lock(0);
+		dmx_lock(1);
+		atsc[to].move_dump(atsc[ch]);
+		dmx_unlock(1);
+		dmx_unlock(0);
+		break;
+	case cmd_stop:
+		return 1;
+	}
+	return 0;
+}
+
+void * mpgts::thread_main()
+{
+	if (rx_uring) return thread_uring();
+	for (;;) {
+		struct epoll_event ev[4];
+		int n = epoll_wait(ep_fd, ev, sizeof(ev)/sizeof(ev[0]), -1 /*no timeout*/);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			fprintf(stderr, "mpegts: epoll_wait() failed: %d %s\n", errno, strerror(errno));
+			return 0;
+		}
+
+		for (int k = 0; k < n; k++) {
+			u32 i = ev[k].data.u32;
+			if (i < 2) {
+				if (rx_drain(i)) return 0;
 				continue;
 			}
-
-			if (r != 1328) {
-				fprintf(stderr, "Warn: mpegts%u: %u byte packet (not 1328)\n", i, (unsigned) r);
+			if (i == 3) {
+				ring_ms = mono_ms();
+				if (pkt.reap(pkt_cb, this)) return 0;
 				continue;
 			}
 
-			//u32 rx_seq = ((u32) rx[0] << 24) + ((u32) rx[1] << 16) + ((u32) rx[2] << 8) + rx[3];
-			// 32 bits of 0 at rx[4]
-			// 32 bits of 0 at rx[8]
-			// 7 x 188-byte TS packets start at rx[12]
-			u32 ofs = 12;
-			u8 * p = rx + ofs;
-			for (; ofs < r; ofs += 188 /*size of a TS packet*/, p += 188)
-				if (atsc[i].thread_demux(p)) return 0;
+			if (take_command()) return 0;
 		}
 	}
 
 	return 0;
 }
 
+// thread_uring() is thread_main() with rx_uring: datagrams are demuxed straight out of the ring buffers
+// and the only syscall is ring.wait() when there is nothing left to reap
+void * mpgts::thread_uring()
+{
+	for (;;) {
+		if (ring.wait()) return 0;
+		ring_ms = mono_ms();
+		ring_ns = real_ns();
+		if (ring.reap(ring_cb, this)) return 0;
+	}
+}
+
+int mpgts::ring_cb(void * ctx, unsigned long long user_data, u8 * buf, unsigned len)
+{
+	mpgts * self = (mpgts *) ctx;
+	if (user_data >= 2) return self->take_command();
+	return self->rx_datagram((u8) user_data, buf, len, self->ring_ms, self->ring_ns);
+}
+
+int mpgts::pkt_cb(void * ctx, u16 dst_port, u8 * buf, unsigned len, unsigned long long ns)
+{
+	mpgts * self = (mpgts *) ctx;
+	for (u8 i = 0; i < 2; i++) if (dst_port == self->udp_port[i]) return self->rx_datagram(i, buf, len, self->ring_ms, ns);
+	return 0;
+}
+
+// rx_mute() makes udp_sock[] drop everything with a BPF filter: with pkt they only hold the ports open,
+// and the kernel would otherwise queue every datagram on them too until the receive buffer is full
+int mpgts::rx_mute()
+{
+	struct sock_filter drop = BPF_STMT(BPF_RET | BPF_K, 0);
+	struct sock_fprog fp;
+	fp.len = 1;
+	fp.filter = &drop;
+	for (unsigned i = 0; i < 2; i++) if (setsockopt(udp_sock[i], SOL_SOCKET, SO_ATTACH_FILTER, &fp, sizeof(fp))) {
+		fprintf(stderr, "mpgts::open(%u): SO_ATTACH_FILTER failed: %d %s\n", i, errno, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+// take_command() runs the command waiting on cmd_fd and acks it, returns nonzero if thread_main() should stop
+int mpgts::take_command()
+{
+	unsigned long long v;
+	if (read(cmd_fd, &v, sizeof(v)) != sizeof(v)) return 0;	// EAGAIN: already done
+	// copy it out first: once a command times out, command() may store the next one while this one runs
+	unsigned long long w = __atomic_load_n(&cmd_word, __ATOMIC_ACQUIRE);
+	int rv;
+	int stop = run_command((ts_cmd) (w & 0xff), (u8) (w >> 8), (u8) (w >> 16), &rv);
+	__atomic_store_n(&cmd_ack, (w >> 32) << 32 | (u32) rv, __ATOMIC_RELEASE);
+	v = 1;
+	if (write(ack_fd, &v, sizeof(v)) != sizeof(v))
+		fprintf(stderr, "mpegts: write(ack_fd) failed: %d %s\n", errno, strerror(errno));
+	return stop;
+}
+
+// command() returns nonzero if thread_main() is not running, did not answer within
+// CMD_ACK_MS or could not do it. It must not be called from thread_main() or dmx_main() (i.e. from a tbl_cb)
+int mpgts::command(ts_cmd c, u8 ch, u8 to /*= 0*/)
+{
+	if (!tsth || !cmd_mtx) {
+		fprintf(stderr, "mpgts::command(%d, %u): not open\n", c, ch);
+		return 1;
+	}
+	if (pthread_equal(pthread_self(), tsth)) {
+		fprintf(stderr, "mpgts::command(%d, %u): called from thread_main\n", c, ch);
+		return 1;
+	}
+	for (unsigned i = 0; i < 2; i++) if (dmxth[i] && pthread_equal(pthread_self(), dmxth[i])) {
+		fprintf(stderr, "mpgts::command(%d, %u): called from dmx_main\n", c, ch);
+		return 1;
+	}
+
+	pthread_mutex_lock((pthread_mutex_t *) cmd_mtx);
+	u32 seq = ++cmd_seq;
+	__atomic_store_n(&cmd_word, (unsigned long long) seq << 32 | (u32) to << 16 | (u32) ch << 8 | (u32) c,
+		__ATOMIC_RELEASE);
+
+	int rv = 1;
+	unsigned long long v = 1;
+	if (write(cmd_fd, &v, sizeof(v)) != sizeof(v)) {
+		fprintf(stderr, "mpgts::command(%d, %u): write(cmd_fd) failed: %d %s\n", c, ch, errno, strerror(errno));
+	} else {
+		// skip acks for commands that timed out: they are still counted in ack_fd
+		unsigned long until = mono_ms() + CMD_ACK_MS;
+		for (;;) {
+			unsigned long long a = __atomic_load_n(&cmd_ack, __ATOMIC_ACQUIRE);
+			if ((u32) (a >> 32) == seq) {
+				while (read(ack_fd, &v, sizeof(v)) == sizeof(v)) {}
+				rv = (int) (u32) a;
+				break;
+			}
+			long left = (long) (until - mono_ms());
+			struct pollfd pfd;
+			pfd.fd = ack_fd;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			int r = left > 0 ? poll(&pfd, 1, left) : 0;
+			if (r < 0 && errno == EINTR) continue;
+			if (r <= 0) {
+				fprintf(stderr, "mpgts::command(%d, %u): thread_main did not respond\n", c, ch);
+				break;
+			}
+			while (read(ack_fd, &v, sizeof(v)) == sizeof(v)) {}
+		}
+	}
+	pthread_mutex_unlock((pthread_mutex_t *) cmd_mtx);
+	return rv;
+}
+
 void * mpgts::thread_wrapper(void * p) { return static_cast<mpgts *>(p)->thread_main(); }
 int mpgts::open()
 {
@@ -97,8 +619,22 @@ int mpgts::open()
 	if (atsc[0].init()) return 1;
 	if (atsc[1].init()) return 1;
 
+	if (!rx) {
+		rx = (typeof(rx)) malloc(sizeof(*rx));
+		if (!rx) {
+			fprintf(stderr, "mpgts::open(): malloc(rxbatch) failed\n");
+			return 1;
+		}
+		memset(rx->b, 0, sizeof(rx->b));
+	}
+
 	unsigned i;
 	for (i = 0; i < 2; i++) {
+		// not in the constructor: find() moves mpgts objects around with realloc()
+		zap[i].hist = &zap_hist;
+		atsc[i].zap = &zap[i];
+		atsc[i].seq.pool = &pool;	// only borrowed datagrams use it, and those are only demuxed on thread_main()
+
 		udp_sock[i] = ::socket(AF_INET, SOCK_DGRAM, 0 /*protocol: not used*/);
 		if (udp_sock[i] == -1) {
 			fprintf(stderr, "mpgts::open(%u): UDP socket failed: %d %s\n", i, errno, strerror(errno));
@@ -123,7 +659,108 @@ int mpgts::open()
 			return 1;
 		}
 		udp_port[i] = ntohs(sin.sin_port);
+		if (rx_sockopt(i)) return 1;
+
+		atsc[i].ev_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (atsc[i].ev_fd == -1) {
+			fprintf(stderr, "mpgts::open(%u): eventfd failed: %d %s\n", i, errno, strerror(errno));
+			return 1;
+		}
+	}
+
+	if (!cmd_mtx) {
+		pthread_mutex_t * m = (typeof(m)) malloc(sizeof(*m));
+		if (!m) {
+			fprintf(stderr, "mpgts::open(): malloc(mutex) failed\n");
+			return 1;
+		}
+		pthread_mutex_init(m, 0);
+		cmd_mtx = m;
+	}
+	cmd_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	ack_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (cmd_fd == -1 || ack_fd == -1) {
+		fprintf(stderr, "mpgts::open(): command eventfd failed: %d %s\n", errno, strerror(errno));
+		return 1;
+	}
+	ep_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (ep_fd == -1) {
+		fprintf(stderr, "mpgts::open(): epoll_create1 failed: %d %s\n", errno, strerror(errno));
+		return 1;
+	}
+	// data.u32 is the udp_sock index, 2 for cmd_fd or 3 for pkt
+	int ep_add[3] = { udp_sock[0], udp_sock[1], cmd_fd };
+	for (i = 0; i < 3; i++) {
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u32 = i;
+		if (epoll_ctl(ep_fd, EPOLL_CTL_ADD, ep_add[i], &ev)) {
+			fprintf(stderr, "mpgts::open(%u): epoll_ctl failed: %d %s\n", i, errno, strerror(errno));
+			return 1;
+		}
+	}
+
+	rx_uring = 0;
+	if (want_uring) {
+		// the datagram buffers are ring's own, rx is only for the epoll fallback
+		if (ring.open(RX_RING_BUFS, RX_MAX) || ring.recv(udp_sock[0], 0) || ring.recv(udp_sock[1], 1) ||
+			ring.poll(cmd_fd, 2))
+		{
+			fprintf(stderr, "mpgts::open(): io_uring not available, using epoll\n");
+			ring.close();
+		} else rx_uring = 1;
+	}
+	rx_packet = 0;
+	pkt_drops = 0;
+	if (want_packet && !rx_uring) {
+		u16 ports[2] = { (u16) udp_port[0], (u16) udp_port[1] };
+		if (pkt.open(tun.get_myip(), tun.get_ip(), ports, 2) || rx_mute()) {
+			fprintf(stderr, "mpgts::open(): AF_PACKET ring not available, using UDP sockets\n");
+			pkt.close();
+		} else {
+			struct epoll_event ev;
+			memset(&ev, 0, sizeof(ev));
+			ev.events = EPOLLIN;
+			ev.data.u32 = 3;	// see thread_main()
+			if (epoll_ctl(ep_fd, EPOLL_CTL_ADD, pkt.get_fd(), &ev)) {
+				fprintf(stderr, "mpgts::open(): epoll_ctl(pkt) failed: %d %s\n", errno, strerror(errno));
+				return 1;
+			}
+			rx_packet = 1;
+		}
+	}
+	if (rx_setup()) return 1;
+
+	dmx_stop = 0;
+	if (want_depth) for (i = 0; i < 2; i++) {
+		if (!dmx_mtx[i]) {
+			pthread_mutex_t * m = (typeof(m)) malloc(sizeof(*m));
+			if (!m) {
+				fprintf(stderr, "mpgts::open(%u): malloc(mutex) failed\n", i);
+				return 1;
+			}
+			pthread_mutex_init(m, 0);
+			dmx_mtx[i] = m;
+		}
+		if (dg[i].open(want_depth)) return 1;
+		// not in the constructor: find() moves mpgts objects around with realloc()
+		dmx_arg[i].self = this;
+		dmx_arg[i].ch = i;
+		if (pthread_create(&dmxth[i], 0 /*attr*/, dmx_wrapper, &dmx_arg[i])) {
+			fprintf(stderr, "mpgts::open(%u): pthread_create(dmx) failed: %d %s\n", i, errno, strerror(errno));
+			dmxth[i] = 0;
+			return 1;
+		}
+	}
+	// not in the constructor either: every dgbuf points back at pool
+	unsigned n_pool = POOL_SPARE;
+	for (i = 0; i < 2; i++) if (dg[i].is_open()) {
+		dgring::counts dc;
+		dg[i].get_counts(&dc);
+		n_pool += dc.depth;
 	}
+	if (pool.open(n_pool)) return 1;
 
 	if (pthread_create(&tsth, 0 /*attr*/, thread_wrapper, this)) {
 		fprintf(stderr, "mpgts::open(): pthread_create failed: %d %s\n", errno, strerror(errno));
@@ -135,21 +772,75 @@ int mpgts::open()
 
 void mpgts::close()
 {
+	if (fz_list) {
+		free(fz_list);
+		fz_list = 0;
+		fz_n = 0;
+	}
+	mon.stop();
 	tun.close();
 	if (tsth) {
 		void * rv;
-		if (pthread_cancel(tsth)) {
+		// thread_main() may have already returned on an error, then cmd_stop gets no answer
+		if (command(cmd_stop, 0) && pthread_cancel(tsth)) {
 			fprintf(stderr, "mpgts::close(): pthread_cancel failed: %d %s\n", errno, strerror(errno));
 		} else if (pthread_join(tsth, &rv)) {
 			fprintf(stderr, "mpgts::close(): pthread_join failed: %d %s\n", errno, strerror(errno));
 		}
 		tsth = 0;
 	}
+	// thread_main() is gone so nothing more goes into dg[]: dmx_main() finishes what is there and returns
 	unsigned i;
+	dmx_stop = 1;
+	for (i = 0; i < 2; i++) if (dmxth[i]) {
+		void * rv;
+		dg[i].wake();
+		if (pthread_join(dmxth[i], &rv))
+			fprintf(stderr, "mpgts::close(%u): pthread_join(dmx) failed: %d %s\n", i, errno, strerror(errno));
+		dmxth[i] = 0;
+	}
+	for (i = 0; i < 2; i++) {
+		dg[i].close();
+		if (dmx_mtx[i]) {
+			pthread_mutex_destroy((pthread_mutex_t *) dmx_mtx[i]);
+			free(dmx_mtx[i]);
+			dmx_mtx[i] = 0;
+		}
+	}
+	// everything that holds a dgbuf lets go of it before pool goes away
+	if (rx) for (i = 0; i < RX_BATCH; i++) if (rx->b[i]) {
+		dgpool::put(rx->b[i]);
+		rx->b[i] = 0;
+	}
+	for (i = 0; i < 2; i++) {
+		seq_flush(i);
+		atsc[i].seq.reset();
+	}
+	pool.close();
+	int * fds[3] = { &ep_fd, &cmd_fd, &ack_fd };
+	for (i = 0; i < 3; i++) if (*fds[i] != -1) {
+		::close(*fds[i]);
+		*fds[i] = -1;
+	}
+	ring.close();
+	pkt.close();
+	if (cmd_mtx) {
+		pthread_mutex_destroy((pthread_mutex_t *) cmd_mtx);
+		free(cmd_mtx);
+		cmd_mtx = 0;
+	}
 	for (i = 0; i < 2; i++) if (udp_sock[i] != -1) {
 		::close(udp_sock[i]);
 		udp_sock[i] = -1;
 	}
+	for (i = 0; i < 2; i++) if (atsc[i].ev_fd != -1) {
+		::close(atsc[i].ev_fd);
+		atsc[i].ev_fd = -1;
+	}
+	if (rx) {
+		free(rx);
+		rx = 0;
+	}
 }
 
 int mpgts::start_ts(u8 ch)
@@ -160,16 +851,8 @@ int mpgts::start_ts(u8 ch)
 	}
 
 	// reset all pkt state
-	want_reset[ch]++;
-	unsigned i;
-	for (i = 0; i < 3; i++) {
-		if (!want_reset[ch]) {	// wait for thread_main() to notice want_reset
-			break;
-		}
-		usleep(100000);
-	}
-	if (i >= 3) {
-		fprintf(stderr, "failed to signal want_reset%u\n", ch);
+	if (command(cmd_reset, ch)) {
+		fprintf(stderr, "mpgts::start_ts(%u): reset failed\n", ch);
 		return 1;
 	}
 
@@ -177,3 +860,120 @@ int mpgts::start_ts(u8 ch)
 
 	return tun.start_ts(ch, udp_port[ch]);
 }
+
+int mpgts::set_freq(u8 ch, unsigned tvch)
+{
+	if (ch >= tuner::NUM_CHANNELS || tvch == (unsigned) -1) return tun.set_freq(ch, tvch);
+
+	zap[ch].begin(tvch, mono_ms());
+	if (tun.set_freq(ch, tvch)) return 1;
+	return command(cmd_zap, ch);
+}
+
+int mpgts::get_mse(u8 ch, u8 * status, u32 * ptmse, u32 * eqmse)
+{
+	if (tun.get_mse(ch, status, ptmse, eqmse)) return 1;
+	if ((*status & 4) && ch < tuner::NUM_CHANNELS) zap[ch].mark(zaplat::lock);
+	return 0;
+}
+
+int mpgts::swap_output(u8 from, u8 to)
+{
+	if (command(cmd_swap, from, to)) {
+		fprintf(stderr, "mpgts::swap_output(%u, %u) failed\n", from, to);
+		return 1;
+	}
+	return 0;
+}
+
+unsigned mpgts::fz_predict() const
+{
+	unsigned cur = tun.get_freq(fz_live), i;
+	for (i = 0; i < fz_n; i++) if (fz_list[i] == cur) break;
+	if (i >= fz_n) return fz_prev != (unsigned) -1 ? fz_prev : fz_list[0];
+	if (fz_dir) return fz_list[(i + fz_n + fz_dir) % fz_n];
+	if (fz_prev != (unsigned) -1 && fz_prev != cur) return fz_prev;
+	return fz_list[(i + 1) % fz_n];
+}
+
+int mpgts::fz_start(unsigned n_ch, const unsigned * chlist, unsigned tvch, const char * dumpfilename)
+{
+	if (n_ch < 2) {
+		fprintf(stderr, "mpgts::fz_start(): needs at least 2 channels, found %u\n", n_ch);
+		return 1;
+	}
+	if (fz_list) free(fz_list);
+	fz_list = (typeof(fz_list)) malloc(sizeof(*fz_list) * n_ch);
+	if (!fz_list) {
+		fprintf(stderr, "mpgts::fz_start(): malloc failed\n");
+		return 1;
+	}
+	memcpy(fz_list, chlist, sizeof(*fz_list) * n_ch);
+	fz_n = n_ch;
+	fz_live = 0;
+	fz_prev = (unsigned) -1;
+	fz_dir = 0;
+
+	if (open_dump(fz_live, dumpfilename)) return 1;
+	for (u8 ch = 0; ch < tuner::NUM_CHANNELS; ch++) if (start_ts(ch)) return 1;
+	if (set_freq(fz_live, tvch)) return 1;
+	return set_freq(fz_live ^ 1, fz_predict());
+}
+
+int mpgts::fz_zap(unsigned tvch, unsigned * fast /*= 0*/)
+{
+	if (!fz_list) {
+		fprintf(stderr, "mpgts::fz_zap(%u): fz_start() was not called\n", tvch);
+		return 1;
+	}
+	unsigned cur = tun.get_freq(fz_live);
+	if (fast) *fast = 1;
+	if (tvch == cur) return 0;
+
+	unsigned long t0 = mono_ms();
+	u8 sb = fz_live ^ 1;
+	// a standby with a PAT but a bad error rate is not ready to be watched yet
+	unsigned warm = tun.get_freq(sb) == tvch && zap[sb].get(zaplat::pat) >= 0 && ts_lock(sb, 200);
+	if (!warm) {
+		if (tun.get_freq(sb) != tvch && set_freq(sb, tvch)) return 1;
+
+		// keep the old channel live until the new one has a PAT and a clean stream, or it is not going to lock
+		unsigned long wait_ms = tun.lock_timeout(tvch, locktime::sync, 1000) + 1000;
+		while ((zap[sb].get(zaplat::pat) < 0 || !ts_lock(sb, 200)) && mono_ms() - t0 < wait_ms) {
+			u8 status;
+			u32 ptmse, eqmse;
+			if (get_mse(sb, &status, &ptmse, &eqmse)) return 1;
+			usleep(5000);
+		}
+	}
+	if (fast) *fast = warm;
+
+	if (swap_output(fz_live, sb)) return 1;
+	u8 old = fz_live;
+	fz_live = sb;
+	fz_last_ms = mono_ms() - t0;
+
+	// remember how the viewer moved, then tune the old live DT3305 to the next prediction
+	fz_dir = 0;
+	for (unsigned i = 0; i < fz_n; i++) if (fz_list[i] == cur) {
+		if (fz_list[(i + 1) % fz_n] == tvch) fz_dir = 1;
+		else if (fz_list[(i + fz_n - 1) % fz_n] == tvch) fz_dir = -1;
+		break;
+	}
+	fz_prev = cur;
+	unsigned next = fz_predict();
+	if (tun.get_freq(old) != next && set_freq(old, next)) return 1;
+	return 0;
+}
+
+int mpgts::fz_step(int dir, unsigned * fast /*= 0*/)
+{
+	if (!fz_list) {
+		fprintf(stderr, "mpgts::fz_step(%d): fz_start() was not called\n", dir);
+		return 1;
+	}
+	unsigned cur = tun.get_freq(fz_live), i;
+	for (i = 0; i < fz_n; i++) if (fz_list[i] == cur) break;
+	if (i >= fz_n) i = 0;
+	return fz_zap(fz_list[(i + fz_n + (dir < 0 ? -1 : 1)) % fz_n], fast);
+}
@@ -13,10 +13,21 @@ this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "tuner.h"
+#include "zaplat.h"
+#include "tsqual.h"
+#include "dgpool.h"
+#include "rxseq.h"
+#include "arrival.h"
 #include "mpgatsc.h"
+#include "rxring.h"
+#include "pktring.h"
+#include "dgring.h"
 
 typedef unsigned long int pthread_t;
 
+#include "siglog.h"
+#include "sigmon.h"
+
 namespace tuner_ns {
 
 class mpgts {
@@ -25,21 +36,164 @@ protected:
 	mpgatsc atsc[2];
 	int udp_sock[2];
 	unsigned udp_port[2];
-	volatile int want_reset[2];
 	pthread_t tsth;
+	zapclock zap[2];
+	zaplat zap_hist;
+
+	// fast channel change, see fz_start()
+	unsigned * fz_list;
+	unsigned fz_n;
+	u8 fz_live;
+	unsigned fz_prev;	// the channel before the current one, (unsigned) -1 if none
+	int fz_dir;		// +1 or -1 if the last zap was to a neighbour in fz_list, else 0
+	unsigned long fz_last_ms;
+	int swap_output(u8 from, u8 to);
+	unsigned fz_predict() const;
+	sigmon mon;
 
 	static void * thread_wrapper(void * arg);
 	void * thread_main();
 
+	// thread_main() sleeps in epoll_wait() on both sockets and cmd_fd. It does not wake while idle
+	// command() hands it one ts_cmd at a time and waits on ack_fd until it is done
+	// a command that times out can still be running: each one gets a sequence number that comes back in
+	// cmd_ack, so a late ack is never taken for the next command's
+	enum ts_cmd {
+		cmd_none = 0,
+		cmd_reset,	// start_ts() asks thread_main() to forget all pkt state on ch
+		cmd_zap,	// set_freq() asks thread_main() to forget the old channel's tables
+		cmd_swap,	// swap_output() moves the dump file from ch to to
+		cmd_stop,	// close() asks thread_main() to return
+	};
+	enum ts_cmd_constants {
+		CMD_ACK_MS = 500,	// command() gives up if thread_main() takes longer than this
+	};
+	int ep_fd;
+	int cmd_fd;	// eventfd, command() adds 1
+	int ack_fd;	// eventfd, thread_main() adds 1 when the command is done
+	void * cmd_mtx;	// pthread_mutex_t: one command at a time
+	u32 cmd_seq;	// command() only, under cmd_mtx
+	unsigned long long cmd_word;	// seq << 32 | to << 16 | ch << 8 | ts_cmd, stored by command() in one go
+	unsigned long long cmd_ack;	// seq << 32 | rv, stored by thread_main() before it writes ack_fd
+	int command(ts_cmd c, u8 ch, u8 to = 0);
+	int run_command(ts_cmd c, u8 ch, u8 to, int * rv);
+	int take_command();
+
+	// thread_main() drains each socket with recvmmsg() instead of one recvfrom() per datagram
+	enum rx_constants {
+		RX_BATCH = 32,	// datagrams per recvmmsg(), about 18ms of one demod at 19.4 Mbit/s
+		RX_MAX = 2048,	// bigger than the 1328 byte datagram so a longer one shows up as long, not truncated
+		RX_GRO_BATCH = 4,	// with UDP_GRO: buffers per recvmmsg()
+		RX_GRO_MAX = 65536,	// with UDP_GRO: the kernel coalesces up to 64 KB of datagrams into one buffer
+		RX_RING_BUFS = 256,	// with io_uring: RX_MAX buffers in ring, about 70ms of both demods
+		RCVBUF_DEFAULT = 4 << 20,	// about 1.7s of one demod, enough to ride out a slow fwrite()
+	};
+	struct rxbatch;
+	rxbatch * rx;	// malloc()ed in open(), only thread_main() touches it
+	int want_gro;	// see set_rx_gro()
+	int rx_gro;	// 1 if UDP_GRO is on for both udp_sock[]
+	int rx_setup();
+	rxring ring;	// only used if rx_uring, see set_rx_uring()
+	int want_uring;
+	int rx_uring;
+	unsigned long ring_ms;	// mono_ms() before each ring.reap() or pkt.reap()
+	unsigned long long ring_ns;	// and the arrival time for ring.reap(), which has no kernel timestamps
+	void * thread_uring();
+	static int ring_cb(void * ctx, unsigned long long user_data, u8 * buf, unsigned len);
+	pktring pkt;	// only used if rx_packet, see set_rx_packet()
+	int want_packet;
+	int rx_packet;
+	static int pkt_cb(void * ctx, u16 dst_port, u8 * buf, unsigned len, unsigned long long ns);
+	int rx_mute();
+
+	// kernel drop accounting, see get_rx_stats()
+	unsigned want_rcvbuf;	// see set_rcvbuf()
+	unsigned rcvbuf[2];
+	unsigned long udp_inode[2];
+	volatile u32 rx_ovfl[2];	// the last SO_RXQ_OVFL count seen by rx_drain()
+	volatile unsigned long rx_dgrams[2];
+	volatile unsigned long host_drops[2];	// rx_datagram() dropped it: dg[] full or pool empty, run_command() resets it
+	unsigned long pkt_drops;	// pkt.get_drops() clears the kernel's count, this adds it up
+	arrival arr[2];	// rx_datagram() adds every datagram's arrival time, rx_sockopt() resets it
+	int rx_sockopt(u8 i);
+	int proc_udp(unsigned long drops[2], unsigned queue[2]) const;
+	int rx_drain(u8 i);
+	void rx_flush(u8 i);
+	void seq_flush(u8 i);
+	int rx_datagram(u8 i, u8 * buf, unsigned len, unsigned long now, unsigned long long ns, dgbuf * b = 0);
+	static int demux_dgram(void * ctx, dgbuf * b);
+	int dmx_dgram(u8 i, dgbuf * b);
+
+	// a datagram that dg[] or a tap() will keep goes into a dgbuf from pool, the only copy it gets after the
+	// kernel's: dg[], rxseq and any tap() just pass references around. Without UDP_GRO rx_drain() receives
+	// straight into them. With no dg[] and no taps the rest are demuxed where they are, see rx_datagram()
+	enum pool_constants {
+		POOL_SPARE = 512,	// dgbufs on top of the dg[] depth, for rx_drain(), rxseq and taps
+	};
+	dgpool pool;	// get() is only called by thread_main()
+	void rx_fill();
+
+	// with a ring depth (see set_ring_depth()) rx_datagram() only copies each datagram into dg[i], and
+	// dmx_main() on a thread of its own per demod does the demux and the fwrite() of the dump file
+	// dmx_mtx[i] keeps run_command() out of atsc[i] while dmx_main() is in it
+	// run_command() bumps dmx_gen[i] when it resets atsc[i]: dmx_dgram() drops what is still in dg[i] from before
+	unsigned want_depth;
+	volatile u32 dmx_gen[2];
+	dgring dg[2];
+	pthread_t dmxth[2];
+	void * dmx_mtx[2];	// pthread_mutex_t
+	volatile int dmx_stop;
+	struct dmxarg {
+		mpgts * self;
+		u8 ch;
+	} dmx_arg[2];
+	static void * dmx_wrapper(void * arg);
+	void * dmx_main(u8 i);
+	void dmx_sync(u8 i);
+	void dmx_lock(u8 i) const;
+	void dmx_unlock(u8 i) const;
+
 public:
 	mpgts(u32 ip_, const u8 * mac_, u32 myip_) : tun(ip_, mac_, myip_) {
 		udp_sock[0] = -1;
 		udp_sock[1] = -1;
 		udp_port[0] = 0;
 		udp_port[1] = 0;
-		want_reset[0] = 0;
-		want_reset[1] = 0;
 		tsth = 0;
+		ep_fd = -1;
+		cmd_fd = -1;
+		ack_fd = -1;
+		cmd_mtx = 0;
+		cmd_seq = 0;
+		cmd_word = 0;
+		cmd_ack = 0;
+		rx = 0;
+		want_gro = 1;
+		rx_gro = 0;
+		want_uring = 0;
+		rx_uring = 0;
+		want_packet = 0;
+		rx_packet = 0;
+		want_rcvbuf = RCVBUF_DEFAULT;
+		rcvbuf[0] = rcvbuf[1] = 0;
+		udp_inode[0] = udp_inode[1] = 0;
+		rx_ovfl[0] = rx_ovfl[1] = 0;
+		rx_dgrams[0] = rx_dgrams[1] = 0;
+		host_drops[0] = host_drops[1] = 0;
+		pkt_drops = 0;
+		want_depth = RING_DEPTH_DEFAULT;
+		dmxth[0] = dmxth[1] = 0;
+		dmx_mtx[0] = dmx_mtx[1] = 0;
+		dmx_stop = 0;
+		dmx_gen[0] = dmx_gen[1] = 0;
+		ring_ms = 0;
+		ring_ns = 0;
+		fz_list = 0;
+		fz_n = 0;
+		fz_live = 0;
+		fz_prev = (unsigned) -1;
+		fz_dir = 0;
+		fz_last_ms = 0;
 	}
 
 	const u8 * get_mac() const { return tun.get_mac(); }
@@ -47,20 +201,185 @@ public:
 	u32 get_myip() const { return tun.get_myip(); }
 	int open();
 	void close();
+
+	// set_rx_gro() before open() picks the receive mode. UDP_GRO is on by default: the kernel hands over
+	// up to 64 KB of datagrams at once and rx_drain() splits them. open() falls back to one datagram per
+	// buffer if the kernel does not have UDP_GRO. get_rx_gro() says which one open() got
+	void set_rx_gro(int on) { want_gro = on; }
+	int get_rx_gro() const { return rx_gro; }
+
+	// set_rx_uring(1) before open() receives with io_uring instead of epoll + recvmmsg: multishot recv on
+	// both sockets into a provided buffer ring, no syscalls while datagrams keep coming. It is off by
+	// default. open() falls back to epoll if the kernel does not have it, see get_rx_uring()
+	void set_rx_uring(int on) { want_uring = on; }
+	int get_rx_uring() const { return rx_uring; }
+
+	// set_rx_packet(1) before open() takes the TS off the NIC with an AF_PACKET TPACKET_V3 ring instead of
+	// the UDP sockets, see pktring. It needs CAP_NET_RAW, open() falls back to the UDP sockets without it.
+	// The UDP sockets stay open to hold the ports. set_rx_uring() wins if both are set
+	void set_rx_packet(int on) { want_packet = on; }
+	int get_rx_packet() const { return rx_packet; }
+
+	// set_rcvbuf() before open() sets SO_RCVBUF on both UDP sockets, 0 leaves the system default
+	// the kernel caps it at net.core.rmem_max unless this process has CAP_NET_ADMIN
+	void set_rcvbuf(unsigned bytes) { want_rcvbuf = bytes; }
+
+	// set_ring_depth() before open() sets how many datagrams each demod's demux thread may fall behind the
+	// receive thread (rounded up to a power of 2). Past that the receive thread drops them and counts them in
+	// get_ring_counts(). 0 demuxes on the receive thread like before, a slow fwrite() then holds up recvmmsg()
+	enum dmx_constants {
+		RING_DEPTH_DEFAULT = 512,	// about 280ms of one demod
+		DMX_BATCH = 64,	// dmx_main() lets go of dmx_mtx after this many datagrams
+		DMX_SYNC_MS = 250,	// dmx_sync() gives up after this, well inside CMD_ACK_MS
+	};
+	void set_ring_depth(unsigned n) { want_depth = n; }
+	int get_ring_counts(u8 ch, dgring::counts * out) const {
+		if (ch >= tuner::NUM_CHANNELS || !dg[ch].is_open()) return 1;
+		dg[ch].get_counts(out);
+		return 0;
+	}
+	// the dgbufs shared by both demods. empty going up means something (a tap) holds on to too many of them
+	// and datagrams are being dropped
+	int get_pool_counts(dgpool::counts * out) const {
+		if (!pool.is_open()) return 1;
+		pool.get_counts(out);
+		return 0;
+	}
+
+	// get_rx_stats() tells datagrams the kernel dropped on this host apart from TS errors (get_ts_errors()),
+	// which are RF loss or loss on the wire. Drop counts are since open()
+	struct rxstats {
+		unsigned long dgrams;	// datagrams demuxed
+		unsigned long ovfl;	// SO_RXQ_OVFL: dropped because the socket receive buffer was full
+				//     (only seen on the epoll path, and only once a datagram follows the drop)
+		unsigned long sock_drops;	// /proc/net/udp drops: ovfl plus anything else the socket dropped
+		unsigned long ring_drops;	// with set_rx_packet(): the AF_PACKET ring was full (both demods)
+		unsigned long host_drops;	// since set_freq() or start_ts(): received, then dropped because dg[ch] was full
+						// or the dgpool was empty (a slow dump file). rxseq counts these in lost too
+		unsigned rx_queue;	// bytes waiting in the socket right now
+		unsigned rcvbuf;	// SO_RCVBUF as the kernel set it
+	};
+	int get_rx_stats(u8 ch, rxstats * out);
+
+	// datagram sequence numbers of ch since set_freq() or start_ts(): loss, duplicates and reordering
+	// that happened between the tuner and here. get_seq_gaps() is the most recent loss events
+	int get_seq(u8 ch, rxseq::counts * out) const {
+		if (ch >= tuner::NUM_CHANNELS) return 1;
+		*out = atsc[ch].seq.get_counts();
+		return 0;
+	}
+	unsigned get_seq_gaps(u8 ch, seqgap * out, unsigned max) const {
+		if (ch >= tuner::NUM_CHANNELS) return 0;
+		return atsc[ch].seq.get_gaps(out, max);
+	}
+
+	// datagram arrival times on ch since open(), see arrival. The times are the kernel's (SO_TIMESTAMPNS, or the
+	// AF_PACKET ring's) except with set_rx_uring(), where every datagram in one reap gets the same time
+	int get_arrival(u8 ch, arrival::stats * out) const {
+		if (ch >= tuner::NUM_CHANNELS) return 1;
+		arr[ch].get(out);
+		return 0;
+	}
 	static mpgts * find(unsigned * num_tuners, unsigned debug = 0) { return tuner::find(num_tuners, debug); }
 	tuner::tuner_antennas get_antenna() const { return tun.get_antenna(); }
 	unsigned get_freq(u8 ch) const { return tun.get_freq(ch); }
 	int set_antenna(tuner::tuner_antennas ant) { return tun.set_antenna(ant); }
-	int scan(unsigned * n_ch, unsigned ** chlist, tuner::scan_cb cb = 0, void * ctx = 0, unsigned cr_ms = 20) {
-		return tun.scan(n_ch, chlist, cb, ctx, cr_ms);
+	int set_plan(tuner::tuner_plan p) { return tun.set_plan(p); }
+	tuner::tuner_plan get_plan() const { return tun.get_plan(); }
+	tuner::tuner_operating_mode get_ch_modulation(unsigned tvch) const { return tun.get_ch_modulation(tvch); }
+	int detect_antenna(tuner::tuner_antennas * best, unsigned cr_ms = 20) { return tun.detect_antenna(best, cr_ms); }
+	int scan(unsigned * n_ch, unsigned ** chlist, tuner::scan_cb cb = 0, void * ctx = 0, unsigned cr_ms = 20,
+		u32 ch_mask = tuner::SCAN_ALL)
+	{
+		return tun.scan(n_ch, chlist, cb, ctx, cr_ms, ch_mask);
+	}
+	int scan_antennas(unsigned * n_ch, unsigned ** chlist, tuner::scan_cb cb = 0, void * ctx = 0) {
+		return tun.scan_antennas(n_ch, chlist, cb, ctx);
+	}
+	tuner::tuner_antennas get_ch_antenna(unsigned tvch) const { return tun.get_ch_antenna(tvch); }
+	int set_freq(u8 ch, unsigned tvch);
+	// set_freq_ant() does not restart the table clocks like set_freq(): it is for probing, not watching
+	int set_freq_ant(u8 ch, unsigned tvch, tuner::tuner_antennas ant) { return tun.set_freq_ant(ch, tvch, ant); }
+	int get_mse(u8 ch, u8 * status, u32 * ptmse, u32 * eqmse);
+
+	// channel change latency: get_zap() is the ms from the last set_freq(ch) to stage st, -1 if not yet
+	// (the lock stage is only seen by calling get_mse())
+	long get_zap(u8 ch, zaplat::zap_stage st) const { if (ch >= tuner::NUM_CHANNELS) return -1; return zap[ch].get(st); }
+	const zaplat & get_zaplat() const { return zap_hist; }
+
+	// transport stream errors of ch over the last window_ms (max tsqual::MAX_WINDOW_MS), counted by the receive
+	//        thread so only while ch is streaming (start_ts()). set_freq() starts the count over
+	// ts_lock() uses them as a lock criterion: 1 if ch received at least min_pkts in window_ms with an error rate
+	//        below max_per_ppm. Unlike get_mse() it costs no control socket round trips
+	int get_ts_errors(u8 ch, unsigned window_ms, tserr * e) const {
+		if (ch >= tuner::NUM_CHANNELS) return 1;
+		return atsc[ch].qual.get(mono_ms(), window_ms, e);
+	}
+	int ts_lock(u8 ch, unsigned window_ms = 500, u32 max_per_ppm = 1000, u32 min_pkts = 100) const {
+		tserr e;
+		if (get_ts_errors(ch, window_ms, &e)) return 0;
+		return e.pkts >= min_pkts && e.per_ppm() < max_per_ppm;
 	}
-	int set_freq(u8 ch, unsigned tvch) { return tun.set_freq(ch, tvch); }
-	int get_mse(u8 ch, u8 * status, u32 * ptmse, u32 * eqmse) { return tun.get_mse(ch, status, ptmse, eqmse); }
+
+	// fast channel change (fz): both DT3305 stream all the time. The live one feeds the dump file and the
+	// other is a warm standby, tuned to the channel most likely to be next with its tables already parsed:
+	// the neighbour in chlist in the direction of the last zap, or the previous channel after a jump.
+	// fz_zap() to the standby's channel only swaps which DT3305 feeds the dump file.
+	// fz_zap() to any other channel tunes the standby and keeps the old channel live until the new one has a
+	// PAT, then swaps. Either way the DT3305 that was live becomes the standby for the next prediction.
+	int fz_start(unsigned n_ch, const unsigned * chlist, unsigned tvch, const char * dumpfilename);
+	int fz_zap(unsigned tvch, unsigned * fast = 0);
+	int fz_step(int dir, unsigned * fast = 0);	// zap to the neighbour in chlist, dir is +1 or -1
+	u8 fz_live_ch() const { return fz_live; }
+	unsigned long fz_last_zap_ms() const { return fz_last_ms; }	// how long the last fz_zap() took
+	int get_cr_offset(u8 ch, int * hz) { return tun.get_cr_offset(ch, hz); }
+
+	// background signal monitor: after start_monitor() the get_signal*() calls read the latest samples without
+	// any control socket I/O. The monitor steps aside while a tuning op is using the control socket.
+	// with a siglog every sample is also appended to it
+	int start_monitor(unsigned period_ms = 100, siglog * log = 0) {
+		int dev = -1;
+		if (log && (dev = log->add_dev(get_mac())) < 0) return 1;
+		return mon.start(&tun, period_ms, log, dev);
+	}
+	void stop_monitor() { mon.stop(); }
+	int get_signal(u8 ch, sigsample * s) const { return mon.get_latest(ch, s); }
+	int get_signal_window(u8 ch, unsigned window_ms, sigwindow * w) const { return mon.get_window(ch, window_ms, w); }
+	unsigned get_signal_history(u8 ch, sigsample * out, unsigned max) const { return mon.snapshot(ch, out, max); }
+	void set_afc(unsigned on) { tun.set_afc(on); }
+	int get_afc(unsigned tvch) const { return tun.get_afc(tvch); }
+	unsigned lock_timeout(unsigned tvch, locktime::lock_stage st, unsigned dflt_ms) const {
+		return tun.lock_timeout(tvch, st, dflt_ms);
+	}
+	void lock_gave_up(u8 ch) { tun.lock_gave_up(ch); }
+	int load_locktime(const char * filename) { return tun.load_locktime(filename); }
+	int save_locktime(const char * filename) const { return tun.save_locktime(filename); }
 	int start_ts(u8 ch);
 	int stop_ts(u8 ch) { return tun.stop_ts(ch); }
-	const char * get_vct(u8 ch) { if (ch >= tuner::NUM_CHANNELS) return 0; return atsc[ch].get_vct(); }
+
+	// table arrival, see mpgatsc::subscribe(). Instead of polling get_vct():
+	// - subscribe() a callback, it runs on the demux thread as soon as the table is parsed (the receive thread
+	//   with set_ring_depth(0)). It must not call set_freq(), start_ts() or fz_zap()
+	// - or poll() get_table_fd(): it is an eventfd that becomes readable on every table event of ch. read() it to
+	//   clear it, then take_table_events() says which tables arrived
+	// get_vct() returns a malloc()ed copy of the VCT lines that the caller must free(), 0 if none yet
+	int subscribe(u8 ch, unsigned mask, mpgatsc::tbl_cb cb, void * ctx) {
+		if (ch >= tuner::NUM_CHANNELS) return 1;
+		return atsc[ch].subscribe(mask, cb, ctx);
+	}
+	void unsubscribe(u8 ch, mpgatsc::tbl_cb cb, void * ctx) { if (ch < tuner::NUM_CHANNELS) atsc[ch].unsubscribe(cb, ctx); }
+	int get_table_fd(u8 ch) const { if (ch >= tuner::NUM_CHANNELS) return -1; return atsc[ch].ev_fd; }
+	unsigned take_table_events(u8 ch) { if (ch >= tuner::NUM_CHANNELS) return 0; return atsc[ch].take_events(); }
+	char * get_vct(u8 ch, u32 * ver = 0) const { if (ch >= tuner::NUM_CHANNELS) return 0; return atsc[ch].copy_vct(ver); }
 	int open_dump(u8 ch, const char * filename) { if (ch >= tuner::NUM_CHANNELS) return 1; return atsc[ch].open_dump(filename); }
 
+	// every datagram of ch without a copy, see mpgatsc::tap(). Anything a tap still holds must be put() before close()
+	int tap(u8 ch, mpgatsc::dgram_cb cb, void * ctx) {
+		if (ch >= tuner::NUM_CHANNELS) return 1;
+		return atsc[ch].tap(cb, ctx);
+	}
+	void untap(u8 ch, mpgatsc::dgram_cb cb, void * ctx) { if (ch < tuner::NUM_CHANNELS) atsc[ch].untap(cb, ctx); }
+
 #if 0
 	// TODO: these are private, exposed only for debugging. Delete this.
 	int get_demod8(u8 ch,  u32 addr, u8 * val)  { return tun.get_demod8(ch, addr, val); }
@@ -0,0 +1,225 @@
+/*
+Copyright (c) 2014 David Hubbard
+
+This program is free software: you can redistribute it and/or modify it under the terms of
+the GNU Affero General Public License version 3, as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License version 3 for more details.
+
+You should have received a copy of the GNU Affero General Public License version 3 along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+#include "iface.h"
+#include "pktring.h"
+
+using namespace tuner_ns;
+
+pktring::pktring()
+{
+	fd = -1;
+	map = (u8 *) MAP_FAILED;
+	cur = 0;
+	myip = 0;
+	src_ip = 0;
+	n_ports = 0;
+}
+
+struct pktring_if {
+	u32 ip;
+	char name[IF_NAMESIZE];
+};
+
+static int pktring_find_if(const char * if_name, u32 ip_addr, u32 netmask, void * ctx)
+{
+	(void) netmask;
+	pktring_if * p = (pktring_if *) ctx;
+	if (ip_addr == p->ip && !p->name[0]) snprintf(p->name, sizeof(p->name), "%s", if_name);
+	return 0;
+}
+
+// attach_filter() builds the BPF program. The socket is SOCK_DGRAM so it starts at the IPv4 header
+int pktring::attach_filter()
+{
+	enum { DROP = 0, PASS = 0xffff };
+	struct sock_filter prog[16 + MAX_PORTS];
+	unsigned n = 0;
+	prog[n++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9);		// protocol
+	prog[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 1, 0);
+	prog[n++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, DROP);
+	prog[n++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 6);		// flags + fragment offset
+	prog[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x3fff, 0, 1);	// MF or offset: a fragment
+	prog[n++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, DROP);
+	prog[n++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 12);		// source IP
+	prog[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohl(src_ip), 1, 0);
+	prog[n++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, DROP);
+	prog[n++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 16);		// destination IP
+	prog[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohl(myip), 1, 0);
+	prog[n++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, DROP);
+	prog[n++] = (struct sock_filter) BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0);		// x = IPv4 header length
+	prog[n++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_H | BPF_IND, 2);		// UDP destination port
+	for (unsigned i = 0; i < n_ports; i++) {
+		// a match jumps over the rest of the ports and the DROP to PASS
+		prog[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ports[i], (u8) (n_ports - i), 0);
+	}
+	prog[n++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, DROP);
+	prog[n++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, PASS);
+
+	struct sock_fprog fp;
+	fp.len = (unsigned short) n;
+	fp.filter = prog;
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fp, sizeof(fp))) {
+		fprintf(stderr, "pktring::open(): SO_ATTACH_FILTER failed: %d %s\n", errno, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+int pktring::open(u32 myip_, u32 src_ip_, const u16 * ports_, unsigned n_ports_)
+{
+	if (fd != -1) {
+		fprintf(stderr, "pktring::open(): already open\n");
+		return 1;
+	}
+	if (!n_ports_ || n_ports_ > MAX_PORTS) {
+		fprintf(stderr, "pktring::open(): %u ports, must be 1 - %u\n", n_ports_, MAX_PORTS);
+		return 1;
+	}
+	myip = myip_;
+	src_ip = src_ip_;
+	n_ports = n_ports_;
+	memcpy(ports, ports_, sizeof(ports[0]) * n_ports);
+
+	pktring_if pif;
+	pif.ip = myip;
+	pif.name[0] = 0;
+	int s = ::socket(AF_INET, SOCK_DGRAM, 0 /*protocol: not used*/);
+	if (s == -1) {
+		fprintf(stderr, "pktring::open(): socket failed: %d %s\n", errno, strerror(errno));
+		return 1;
+	}
+	int r = foreach_if(s, pktring_find_if, &pif);
+	::close(s);
+	if (r) return 1;
+	unsigned ifindex = pif.name[0] ? if_nametoindex(pif.name) : 0;
+	if (!ifindex) {
+		char dstr[256]; ip_printf(dstr, myip);
+		fprintf(stderr, "pktring::open(): no interface has %s\n", dstr);
+		return 1;
+	}
+
+	// the filter goes on before bind() so nothing unfiltered gets into the ring
+	fd = ::socket(AF_PACKET, SOCK_DGRAM, htons(ETH_P_IP));
+	if (fd == -1) {
+		if (errno != EPERM) fprintf(stderr, "pktring::open(): socket failed: %d %s\n", errno, strerror(errno));
+		return 1;
+	}
+	if (attach_filter()) {
+		close();
+		return 1;
+	}
+	int v = TPACKET_V3;
+	if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &v, sizeof(v))) {
+		fprintf(stderr, "pktring::open(): TPACKET_V3 failed: %d %s\n", errno, strerror(errno));
+		close();
+		return 1;
+	}
+	struct tpacket_req3 req;
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = BLOCK_SIZE;
+	req.tp_block_nr = NUM_BLOCKS;
+	req.tp_frame_size = FRAME_SIZE;
+	req.tp_frame_nr = BLOCK_SIZE / FRAME_SIZE * NUM_BLOCKS;
+	req.tp_retire_blk_tov = RETIRE_MS;
+	if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req))) {
+		fprintf(stderr, "pktring::open(): PACKET_RX_RING failed: %d %s\n", errno, strerror(errno));
+		close();
+		return 1;
+	}
+	map = (u8 *) mmap(0, (unsigned long) BLOCK_SIZE*NUM_BLOCKS, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "pktring::open(): mmap failed: %d %s\n", errno, strerror(errno));
+		close();
+		return 1;
+	}
+	cur = 0;
+
+	struct sockaddr_ll sll;
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_IP);
+	sll.sll_ifindex = ifindex;
+	if (bind(fd, (struct sockaddr *) &sll, sizeof(sll))) {
+		fprintf(stderr, "pktring::open(): bind(%s) failed: %d %s\n", pif.name, errno, strerror(errno));
+		close();
+		return 1;
+	}
+	get_drops();	// start counting from here
+	return 0;
+}
+
+void pktring::close()
+{
+	if (map != MAP_FAILED) munmap(map, (unsigned long) BLOCK_SIZE*NUM_BLOCKS);
+	map = (u8 *) MAP_FAILED;
+	if (fd != -1) ::close(fd);
+	fd = -1;
+}
+
+int pktring::reap(dgram_cb cb, void * ctx)
+{
+	int stop = 0;
+	while (!stop) {
+		struct tpacket_block_desc * bd = (struct tpacket_block_desc *) (map + (unsigned long) cur*BLOCK_SIZE);
+		if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) break;
+
+		unsigned n = bd->hdr.bh1.num_pkts;
+		struct tpacket3_hdr * h = (struct tpacket3_hdr *) ((u8 *) bd + bd->hdr.bh1.offset_to_first_pkt);
+		for (unsigned k = 0; k < n && !stop; k++) {
+			u8 * ip = (u8 *) h + h->tp_net;
+			unsigned caplen = h->tp_snaplen;
+			unsigned long long ns = (unsigned long long) h->tp_sec*1000000000 + h->tp_nsec;
+			struct sockaddr_ll * sll = (struct sockaddr_ll *) ((u8 *) h + TPACKET_ALIGN(sizeof(*h)));
+			h = (struct tpacket3_hdr *) ((u8 *) h + h->tp_next_offset);
+			if (sll->sll_pkttype == PACKET_OUTGOING) continue;	// only seen on lo: src_ip is not this host
+
+			// the BPF filter already checked protocol, IPs and port. This only makes sure the lengths are sane
+			unsigned ihl = (ip[0] & 0xf)*4;
+			if (caplen < ihl + 8 || ip[9] != IPPROTO_UDP) continue;
+			u8 * udp = ip + ihl;
+			unsigned len = ((unsigned) udp[4] << 8) + udp[5];
+			if (len < 8) continue;
+			len -= 8;
+			if (len > caplen - ihl - 8) len = caplen - ihl - 8;	// uncertain: snaplen cut it short
+			if (cb(ctx, (u16) (((unsigned) udp[2] << 8) + udp[3]), udp + 8, len, ns)) stop = 1;
+		}
+
+		__atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+		cur = (cur + 1) % NUM_BLOCKS;
+	}
+	return stop;
+}
+
+unsigned pktring::get_drops()
+{
+	if (fd == -1) return 0;
+	struct tpacket_stats_v3 st;
+	socklen_t len = sizeof(st);
+	if (getsockopt(fd, SOL_PACKET, PACKET_STATISTICS, &st, &len)) return 0;
+	return st.tp_drops;	// the kernel clears the counters on every read
+}
@@ -0,0 +1,349 @@
+/*
+Copyright (c) 2014 David Hubbard
+
+This program is free software: you can redistribute it and/or modify it under the terms of
+the GNU Affero General Public License version 3, as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License version 3 for more details.
+
+You should have received a copy of the GNU Affero General Public License version 3 along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "mpgts.h"
+#include "rxbench.h"
+
+using namespace tuner_ns;
+
+const char * const rxbench::mode_name[NUM_MODES] = {
+	"pselect", "recvmmsg", "io_uring",
+};
+
+static unsigned long mono_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long) ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+static unsigned long thread_cpu_us()
+{
+	struct rusage ru;
+	if (getrusage(RUSAGE_THREAD, &ru)) return 0;
+	return (unsigned long) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec)*1000000 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+int rxbench::open_socks()
+{
+	unsigned i;
+	for (i = 0; i < n_sock; i++) socks[i] = -1;
+	for (i = 0; i < n_sock; i++) {
+		socks[i] = ::socket(AF_INET, SOCK_DGRAM, 0 /*protocol: not used*/);
+		if (socks[i] == -1) {
+			fprintf(stderr, "rxbench::open_socks(%u): socket failed: %d %s\n", i, errno, strerror(errno));
+			return 1;
+		}
+		struct sockaddr_in sin;
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t sinlen = sizeof(sin);
+		if (bind(socks[i], (struct sockaddr *) &sin, sizeof(sin)) ||
+			getsockname(socks[i], (struct sockaddr *) &sin, &sinlen))
+		{
+			fprintf(stderr, "rxbench::open_socks(%u): bind failed: %d %s\n", i, errno, strerror(errno));
+			return 1;
+		}
+		ports[i] = ntohs(sin.sin_port);
+	}
+	send_fd = ::socket(AF_INET, SOCK_DGRAM, 0 /*protocol: not used*/);
+	stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (send_fd == -1 || stop_fd == -1) {
+		fprintf(stderr, "rxbench::open_socks(): socket or eventfd failed: %d %s\n", errno, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+void rxbench::close_socks()
+{
+	for (unsigned i = 0; i < n_sock; i++) if (socks[i] != -1) {
+		::close(socks[i]);
+		socks[i] = -1;
+	}
+	if (send_fd != -1) ::close(send_fd);
+	if (stop_fd != -1) ::close(stop_fd);
+	send_fd = stop_fd = -1;
+}
+
+void * rxbench::sender_wrapper(void * p)
+{
+	static_cast<rxbench *>(p)->sender();
+	return 0;
+}
+
+// sender() sends whatever is due once per ms, round robin over the sockets, then sets stop_fd
+void rxbench::sender()
+{
+	enum { CHUNK = 64 };
+	u8 pkt[DGRAM];
+	memset(pkt, 0xff, sizeof(pkt));
+	for (unsigned ofs = 12; ofs < DGRAM; ofs += 188) pkt[ofs] = 0x47;
+
+	struct sockaddr_in to[MAX_SOCKS];
+	for (unsigned i = 0; i < n_sock; i++) {
+		memset(&to[i], 0, sizeof(to[i]));
+		to[i].sin_family = AF_INET;
+		to[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		to[i].sin_port = htons(ports[i]);
+	}
+	struct iovec iov;
+	iov.iov_base = pkt;
+	iov.iov_len = sizeof(pkt);
+	struct mmsghdr m[CHUNK];
+	memset(m, 0, sizeof(m));
+	for (unsigned k = 0; k < CHUNK; k++) {
+		m[k].msg_hdr.msg_iov = &iov;
+		m[k].msg_hdr.msg_iovlen = 1;
+		m[k].msg_hdr.msg_namelen = sizeof(to[0]);
+	}
+
+	unsigned long sent = 0, t0 = mono_us();
+	for (;;) {
+		unsigned long t = mono_us() - t0;
+		if (t >= ms*1000UL) break;
+		unsigned long due = (unsigned long) ((unsigned long long) t*pps*n_sock/1000000);
+		while (sent < due) {
+			unsigned n = due - sent > (unsigned long) CHUNK ? (unsigned) CHUNK : due - sent;
+			for (unsigned k = 0; k < n; k++) m[k].msg_hdr.msg_name = &to[(sent + k) % n_sock];
+			int r = sendmmsg(send_fd, m, n, 0);
+			if (r <= 0) {
+				fprintf(stderr, "rxbench::sender(): sendmmsg failed: %d %s\n", errno, strerror(errno));
+				break;
+			}
+			sent += r;
+		}
+		usleep(1000);
+	}
+	cur->sent = sent;
+
+	usleep(20000);	// loopback has already queued everything, give the receiver time to read it
+	unsigned long long one = 1;
+	if (write(stop_fd, &one, sizeof(one)) != sizeof(one))
+		fprintf(stderr, "rxbench::sender(): write(eventfd) failed: %d %s\n", errno, strerror(errno));
+}
+
+int rxbench::rx_pselect(result * r)
+{
+	for (;;) {
+		fd_set rfds;
+		FD_ZERO(&rfds);
+		int max_sock = stop_fd;
+		FD_SET(stop_fd, &rfds);
+		unsigned i;
+		for (i = 0; i < n_sock; i++) {
+			FD_SET(socks[i], &rfds);
+			if (socks[i] > max_sock) max_sock = socks[i];
+		}
+		r->syscalls++;
+		if (pselect(max_sock + 1, &rfds, 0, 0, 0 /*no timeout*/, 0 /*sigmask*/) < 0) {
+			if (errno == EINTR) continue;
+			fprintf(stderr, "rxbench::rx_pselect(): pselect failed: %d %s\n", errno, strerror(errno));
+			return 1;
+		}
+		for (i = 0; i < n_sock; i++) if (FD_ISSET(socks[i], &rfds)) {
+			u8 rx[4096];
+			r->syscalls++;
+			if (recvfrom(socks[i], rx, sizeof(rx), 0 /*flags*/, 0, 0) == DGRAM) r->got++;
+		}
+		if (FD_ISSET(stop_fd, &rfds)) return 0;
+	}
+}
+
+int rxbench::rx_recvmmsg(result * r)
+{
+	struct batch {
+		struct mmsghdr m[BATCH];
+		struct iovec iov[BATCH];
+		u8 buf[BATCH][2048];
+	};
+	batch * b = (typeof(b)) malloc(sizeof(*b));
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	if (!b || ep == -1) {
+		fprintf(stderr, "rxbench::rx_recvmmsg(): malloc or epoll_create1 failed: %d %s\n", errno, strerror(errno));
+		free(b);
+		if (ep != -1) ::close(ep);
+		return 1;
+	}
+	memset(b->m, 0, sizeof(b->m));
+	for (unsigned k = 0; k < BATCH; k++) {
+		b->iov[k].iov_base = b->buf[k];
+		b->iov[k].iov_len = sizeof(b->buf[k]);
+		b->m[k].msg_hdr.msg_iov = &b->iov[k];
+		b->m[k].msg_hdr.msg_iovlen = 1;
+	}
+	for (unsigned i = 0; i <= n_sock; i++) {
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u32 = i;	// n_sock is stop_fd
+		epoll_ctl(ep, EPOLL_CTL_ADD, i < n_sock ? socks[i] : stop_fd, &ev);
+	}
+
+	int rv = 0, done = 0;
+	while (!done) {
+		struct epoll_event ev[MAX_SOCKS + 1];
+		r->syscalls++;
+		int n = epoll_wait(ep, ev, n_sock + 1, -1 /*no timeout*/);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			fprintf(stderr, "rxbench::rx_recvmmsg(): epoll_wait failed: %d %s\n", errno, strerror(errno));
+			rv = 1;
+			break;
+		}
+		for (int e = 0; e < n; e++) {
+			unsigned i = ev[e].data.u32;
+			if (i >= n_sock) {
+				done = 1;
+				continue;
+			}
+			// same as mpgts::rx_drain(): a short batch means the socket is empty
+			for (;;) {
+				r->syscalls++;
+				int k = recvmmsg(socks[i], b->m, BATCH, MSG_DONTWAIT, 0 /*timeout*/);
+				if (k < 0) break;
+				for (int j = 0; j < k; j++) if (b->m[j].msg_len == DGRAM) r->got++;
+				if (k < BATCH) break;
+			}
+		}
+	}
+	::close(ep);
+	free(b);
+	return rv;
+}
+
+struct rxbench_uring_ctx {
+	unsigned n_sock;
+	rxbench::result * r;
+	int stopped;
+};
+
+static int rxbench_uring_cb(void * ctx, unsigned long long user_data, u8 * buf, unsigned len)
+{
+	rxbench_uring_ctx * c = (rxbench_uring_ctx *) ctx;
+	(void) buf;
+	if (user_data >= c->n_sock) {
+		c->stopped = 1;
+		return 1;
+	}
+	if (len == rxbench::DGRAM) c->r->got++;
+	return 0;
+}
+
+int rxbench::rx_uring(result * r)
+{
+	rxring ring;
+	if (ring.open(RING_BUFS, 2048)) {
+		r->skipped = 1;
+		return 0;
+	}
+	unsigned i;
+	for (i = 0; i < n_sock; i++) if (ring.recv(socks[i], i)) break;
+	if (i < n_sock || ring.poll(stop_fd, n_sock)) {
+		ring.close();
+		return 1;
+	}
+
+	rxbench_uring_ctx c;
+	c.n_sock = n_sock;
+	c.r = r;
+	c.stopped = 0;
+	while (!c.stopped) {
+		if (ring.wait()) break;
+		if (ring.reap(rxbench_uring_cb, &c) && !c.stopped) {
+			r->skipped = !r->got;	// uncertain: most likely a kernel without multishot recv
+			break;
+		}
+	}
+	r->syscalls = ring.get_enters();
+	ring.close();
+	return 0;
+}
+
+int rxbench::run(unsigned n_sock_, unsigned pps_ /*= 1800*/, unsigned ms_ /*= 3000*/)
+{
+	if (!n_sock_ || n_sock_ > MAX_SOCKS || !pps_ || !ms_) {
+		fprintf(stderr, "rxbench::run(%u, %u, %u): need 1 - %u sockets\n", n_sock_, pps_, ms_, MAX_SOCKS);
+		return 1;
+	}
+	n_sock = n_sock_;
+	pps = pps_;
+	ms = ms_;
+	memset(res, 0, sizeof(res));
+
+	for (unsigned m = 0; m < NUM_MODES; m++) {
+		fprintf(stderr, "\r\e[Krxbench %s: %u sockets for %ums", mode_name[m], n_sock, ms);
+		// new sockets for every mode so nothing left over from the last one is counted
+		int rv = open_socks();
+		pthread_t th = 0;
+		cur = &res[m];
+		unsigned long cpu0 = thread_cpu_us();
+		if (!rv && pthread_create(&th, 0 /*attr*/, sender_wrapper, this)) {
+			fprintf(stderr, "rxbench::run(): pthread_create failed: %d %s\n", errno, strerror(errno));
+			th = 0;
+			rv = 1;
+		}
+		if (!rv) {
+			switch (m) {
+			case m_pselect: rv = rx_pselect(&res[m]); break;
+			case m_recvmmsg: rv = rx_recvmmsg(&res[m]); break;
+			case m_uring: rv = rx_uring(&res[m]); break;
+			}
+		}
+		res[m].cpu_us = thread_cpu_us() - cpu0;
+		void * th_rv;
+		if (th && pthread_join(th, &th_rv))
+			fprintf(stderr, "rxbench::run(): pthread_join failed: %d %s\n", errno, strerror(errno));
+		close_socks();
+		if (rv) {
+			fprintf(stderr, "\n");
+			return 1;
+		}
+	}
+	fprintf(stderr, "\r\e[K");
+	return 0;
+}
+
+void rxbench::print(FILE * f) const
+{
+	fprintf(f, "%u sockets x %u datagrams/s for %ums, all received by one thread\n", n_sock, pps, ms);
+	fprintf(f, "mode         sent      got   lost  syscalls  per dgram  cpu us/dgram\n");
+	for (unsigned m = 0; m < NUM_MODES; m++) {
+		const result & r = res[m];
+		if (r.skipped) {
+			fprintf(f, "%-9s  not available on this kernel\n", mode_name[m]);
+			continue;
+		}
+		fprintf(f, "%-9s %8lu %8lu %6lu %9lu %10.3f %13.3f\n", mode_name[m], r.sent, r.got,
+			r.sent > r.got ? r.sent - r.got : 0, r.syscalls, r.got ? (double) r.syscalls/r.got : 0,
+			r.got ? (double) r.cpu_us/r.got : 0);
+	}
+}
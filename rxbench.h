@@ -0,0 +1,72 @@
+/*
+Copyright (c) 2014 David Hubbard
+
+This program is free software: you can redistribute it and/or modify it under the terms of
+the GNU Affero General Public License version 3, as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License version 3 for more details.
+
+You should have received a copy of the GNU Affero General Public License version 3 along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+namespace tuner_ns {
+
+// rxbench compares ways to receive TS datagrams, without a tuner: a sender thread paces 1328 byte
+// datagrams to n_sock loopback UDP sockets and one thread receives all of them, once for each rx_mode.
+// It counts receive syscalls and the receiving thread's CPU time per datagram
+class rxbench {
+public:
+	enum rx_mode {
+		m_pselect = 0,	// what mpgts::thread_main() used to do: pselect() then one recvfrom() per datagram
+		m_recvmmsg,	// epoll_wait() then recvmmsg() until the socket is empty
+		m_uring,	// rxring: multishot recv into a provided buffer ring
+		NUM_MODES
+	};
+	static const char * const mode_name[NUM_MODES];
+
+	enum rxbench_constants {
+		MAX_SOCKS = 64,
+		DGRAM = 1328,
+		BATCH = 32,	// recvmmsg() batch, same as mpgts::RX_BATCH
+		RING_BUFS = 1024,
+	};
+
+	struct result {
+		unsigned long sent, got;
+		unsigned long syscalls;	// by the receiving thread
+		unsigned long cpu_us;	// user + system time of the receiving thread
+		int skipped;		// the mode is not available on this kernel
+	};
+
+	rxbench() : n_sock(0), pps(0), ms(0), stop_fd(-1), send_fd(-1), cur(0) { memset(res, 0, sizeof(res)); }
+
+	// run() needs n_sock <= MAX_SOCKS (2 per tuner), pps is datagrams per second per socket
+	// 1800 pps is one demod at 19.4 Mbit/s
+	int run(unsigned n_sock, unsigned pps = 1800, unsigned ms = 3000);
+	void print(FILE * f) const;
+
+	const result & get(rx_mode m) const { return res[m]; }
+
+protected:
+	unsigned n_sock, pps, ms;
+	int socks[MAX_SOCKS];
+	unsigned short ports[MAX_SOCKS];
+	int stop_fd;	// eventfd, the sender adds 1 when it is done
+	int send_fd;
+	result res[NUM_MODES];
+	result * cur;	// the mode sender() is sending for
+
+	static void * sender_wrapper(void * arg);
+	void sender();
+	int open_socks();
+	void close_socks();
+	int rx_pselect(result * r);
+	int rx_recvmmsg(result * r);
+	int rx_uring(result * r);
+};
+
+}
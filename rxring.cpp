@@ -0,0 +1,295 @@
+/*
+Copyright (c) 2014 David Hubbard
+
+This program is free software: you can redistribute it and/or modify it under the terms of
+the GNU Affero General Public License version 3, as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License version 3 for more details.
+
+You should have received a copy of the GNU Affero General Public License version 3 along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "iface.h"
+#include "rxring.h"
+
+using namespace tuner_ns;
+
+static int uring_setup(unsigned entries, struct io_uring_params * p)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, 0 /*sig*/, 0 /*sigsz*/);
+}
+
+static int uring_register(int fd, unsigned opcode, void * arg, unsigned nr_args)
+{
+	return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+rxring::rxring()
+{
+	ring_fd = -1;
+	sq_map = cq_map = sqe_map = MAP_FAILED;
+	sq_map_len = cq_map_len = sqe_map_len = 0;
+	sq_head = sq_tail = sq_mask = sq_array = sq_flags = 0;
+	cq_head = cq_tail = cq_mask = 0;
+	sqes = cqes = 0;
+	to_submit = 0;
+	br = MAP_FAILED;
+	br_len = 0;
+	bufs = 0;
+	n_bufs = buf_len = 0;
+	br_tail = 0;
+	n_arms = 0;
+	enters = 0;
+}
+
+int rxring::open(unsigned n_bufs_, unsigned buf_len_, unsigned entries /*= 64*/)
+{
+	if (ring_fd != -1) {
+		fprintf(stderr, "rxring::open(): already open\n");
+		return 1;
+	}
+	if (!n_bufs_ || (n_bufs_ & (n_bufs_ - 1)) || n_bufs_ > 32768 || !buf_len_) {
+		fprintf(stderr, "rxring::open(%u, %u): n_bufs must be a power of 2 up to 32768\n", n_bufs_, buf_len_);
+		return 1;
+	}
+
+	// every buffer can be a completion waiting to be reaped, so the CQ must hold them all
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = n_bufs_ + MAX_ARMS;
+	ring_fd = uring_setup(entries, &p);
+	if (ring_fd < 0) {
+		ring_fd = -1;
+		if (errno != ENOSYS && errno != EPERM)
+			fprintf(stderr, "rxring::open(): io_uring_setup failed: %d %s\n", errno, strerror(errno));
+		return 1;
+	}
+
+	sq_map_len = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+	cq_map_len = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (cq_map_len > sq_map_len) sq_map_len = cq_map_len;
+		cq_map_len = 0;
+	}
+	sq_map = mmap(0, sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (sq_map == MAP_FAILED) {
+		fprintf(stderr, "rxring::open(): mmap(sq) failed: %d %s\n", errno, strerror(errno));
+		close();
+		return 1;
+	}
+	if (cq_map_len) {
+		cq_map = mmap(0, cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+		if (cq_map == MAP_FAILED) {
+			fprintf(stderr, "rxring::open(): mmap(cq) failed: %d %s\n", errno, strerror(errno));
+			close();
+			return 1;
+		}
+	}
+	sqe_map_len = p.sq_entries*sizeof(struct io_uring_sqe);
+	sqe_map = mmap(0, sqe_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if (sqe_map == MAP_FAILED) {
+		fprintf(stderr, "rxring::open(): mmap(sqes) failed: %d %s\n", errno, strerror(errno));
+		close();
+		return 1;
+	}
+
+	u8 * sq = (u8 *) sq_map;
+	u8 * cq = cq_map_len ? (u8 *) cq_map : sq;
+	sq_head = (unsigned *) (sq + p.sq_off.head);
+	sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+	sq_array = (unsigned *) (sq + p.sq_off.array);
+	sq_flags = (unsigned *) (sq + p.sq_off.flags);
+	cq_head = (unsigned *) (cq + p.cq_off.head);
+	cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+	cqes = cq + p.cq_off.cqes;
+	sqes = sqe_map;
+
+	// the provided buffer ring: the kernel takes a buffer from it for every datagram
+	n_bufs = n_bufs_;
+	buf_len = buf_len_;
+	bufs = (typeof(bufs)) malloc((unsigned long) n_bufs*buf_len);
+	if (!bufs) {
+		fprintf(stderr, "rxring::open(): malloc(%u x %u) failed\n", n_bufs, buf_len);
+		close();
+		return 1;
+	}
+	br_len = n_bufs*sizeof(struct io_uring_buf);
+	br = mmap(0, br_len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (br == MAP_FAILED) {
+		fprintf(stderr, "rxring::open(): mmap(buf ring) failed: %d %s\n", errno, strerror(errno));
+		close();
+		return 1;
+	}
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long) br;
+	reg.ring_entries = n_bufs;
+	reg.bgid = BGID;
+	if (uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+		fprintf(stderr, "rxring::open(): register buf ring failed: %d %s\n", errno, strerror(errno));
+		close();
+		return 1;
+	}
+	br_tail = 0;
+	for (unsigned i = 0; i < n_bufs; i++) give_buf((u16) i);
+	__atomic_store_n(&((struct io_uring_buf_ring *) br)->tail, br_tail, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void rxring::close()
+{
+	if (ring_fd != -1) {
+		::close(ring_fd);	// also cancels everything still armed
+		ring_fd = -1;
+	}
+	if (sq_map != MAP_FAILED) munmap(sq_map, sq_map_len);
+	if (cq_map != MAP_FAILED) munmap(cq_map, cq_map_len);
+	if (sqe_map != MAP_FAILED) munmap(sqe_map, sqe_map_len);
+	if (br != MAP_FAILED) munmap(br, br_len);
+	sq_map = cq_map = sqe_map = br = MAP_FAILED;
+	free(bufs);
+	bufs = 0;
+	to_submit = 0;
+	n_arms = 0;
+}
+
+// give_buf() puts buffer bid back in the ring. The kernel does not see it until the tail is stored
+void rxring::give_buf(u16 bid)
+{
+	// not io_uring_buf_ring::bufs: in C++ __DECLARE_FLEX_ARRAY puts an empty struct (1 byte) in front of it
+	struct io_uring_buf * b = &((struct io_uring_buf *) br)[br_tail & (n_bufs - 1)];
+	b->addr = (unsigned long) (bufs + (unsigned long) bid*buf_len);
+	b->len = buf_len;
+	b->bid = bid;
+	br_tail++;
+}
+
+int rxring::queue(const arm_req & a)
+{
+	unsigned tail = *sq_tail;
+	if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) > *sq_mask) {
+		// more sockets than entries: submit what is queued so far, without waiting
+		enters++;
+		int r = uring_enter(ring_fd, to_submit, 0 /*min_complete*/, 0 /*flags*/);
+		if (r > 0) to_submit -= (unsigned) r < to_submit ? (unsigned) r : to_submit;
+		if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) > *sq_mask) {
+			fprintf(stderr, "rxring::queue(%d): submission queue full\n", a.fd);
+			return 1;
+		}
+	}
+	unsigned idx = tail & *sq_mask;
+	struct io_uring_sqe * sqe = &((struct io_uring_sqe *) sqes)[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd = a.fd;
+	sqe->user_data = a.user_data;
+	if (a.is_poll) {
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->poll32_events = POLLIN;
+		sqe->len = IORING_POLL_ADD_MULTI;
+	} else {
+		sqe->opcode = IORING_OP_RECV;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = BGID;
+	}
+	sq_array[idx] = idx;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+	to_submit++;
+	return 0;
+}
+
+int rxring::arm(u8 is_poll, int fd, unsigned long long user_data)
+{
+	if (ring_fd == -1 || n_arms >= MAX_ARMS) {
+		fprintf(stderr, "rxring::arm(%d): %s\n", fd, ring_fd == -1 ? "not open" : "too many");
+		return 1;
+	}
+	arm_req & a = arms[n_arms];
+	a.fd = fd;
+	a.is_poll = is_poll;
+	a.user_data = user_data;
+	if (queue(a)) return 1;
+	n_arms++;
+	return 0;
+}
+
+int rxring::wait()
+{
+	unsigned flags = IORING_ENTER_GETEVENTS, min_complete = 1;
+	if (__atomic_load_n(sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW) {
+		// the overflowed completions only come back into the CQ with GETEVENTS, even when the CQ is empty
+		min_complete = 0;
+	} else if (*cq_tail != *cq_head) {
+		if (!to_submit) return 0;	// nothing to do before reap()
+		min_complete = 0;
+	}
+	for (;;) {
+		enters++;
+		int r = uring_enter(ring_fd, to_submit, min_complete, flags);
+		if (r >= 0) {
+			to_submit -= (unsigned) r < to_submit ? (unsigned) r : to_submit;
+			return 0;
+		}
+		if (errno == EINTR) continue;
+		fprintf(stderr, "rxring::wait(): io_uring_enter failed: %d %s\n", errno, strerror(errno));
+		return 1;
+	}
+}
+
+int rxring::reap(rx_cb cb, void * ctx)
+{
+	int stop = 0;
+	unsigned head = *cq_head, gave = 0;
+	for (;;) {
+		unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+		if (head == tail || stop) break;
+		struct io_uring_cqe c = ((struct io_uring_cqe *) cqes)[head & *cq_mask];
+		head++;
+		__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+		// user_data is usually the order things were armed in, so try that first
+		unsigned i = c.user_data < n_arms ? (unsigned) c.user_data : 0;
+		if (arms[i].user_data != c.user_data)
+			for (i = 0; i < n_arms; i++) if (arms[i].user_data == c.user_data) break;
+		if (i >= n_arms) continue;	// uncertain: a completion for something not armed
+
+		if (c.flags & IORING_CQE_F_BUFFER) {
+			u16 bid = (u16) (c.flags >> IORING_CQE_BUFFER_SHIFT);
+			if (c.res >= 0 && cb(ctx, c.user_data, bufs + (unsigned long) bid*buf_len, (unsigned) c.res)) stop = 1;
+			give_buf(bid);
+			gave++;
+		} else if (c.res >= 0 && arms[i].is_poll) {
+			if (cb(ctx, c.user_data, 0, (unsigned) c.res)) stop = 1;
+		}
+
+		// ENOBUFS means the kernel ran out of buffers and ended the multishot: re-arm it, the
+		// buffers are back now. Any other error is not going to go away by re-arming
+		if (c.res < 0 && c.res != -ENOBUFS) {
+			fprintf(stderr, "rxring::reap(): fd %d failed: %d %s\n", arms[i].fd, -c.res, strerror(-c.res));
+			stop = 1;
+		} else if (!(c.flags & IORING_CQE_F_MORE) && queue(arms[i])) stop = 1;
+	}
+	if (gave) __atomic_store_n(&((struct io_uring_buf_ring *) br)->tail, br_tail, __ATOMIC_RELEASE);
+	return stop;
+}
@@ -0,0 +1,85 @@
+/*
+Copyright (c) 2014 David Hubbard
+
+This program is free software: you can redistribute it and/or modify it under the terms of
+the GNU Affero General Public License version 3, as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License version 3 for more details.
+
+You should have received a copy of the GNU Affero General Public License version 3 along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+namespace tuner_ns {
+
+// rxring is an io_uring set up with raw syscalls (no liburing) that keeps multishot receives armed on
+// UDP sockets. Datagrams land in a provided buffer ring, reap() hands them to a callback straight out of
+// those buffers and gives each buffer back to the kernel without a syscall. One rxring can hold the
+// sockets of many tuners: user_data says which socket a completion is for
+class rxring {
+public:
+	enum rxring_constants {
+		MAX_ARMS = 128,	// multishot requests, re-armed by reap() if the kernel ends one
+		BGID = 0,	// provided buffer group
+	};
+
+	// rx_cb gets one datagram. buf is only valid until rx_cb returns. A nonzero return stops reap()
+	// for a poll() request buf is 0 and len is the poll mask
+	typedef int (*rx_cb)(void * ctx, unsigned long long user_data, u8 * buf, unsigned len);
+
+	rxring();
+
+	// open() returns nonzero if the kernel does not have io_uring with provided buffer rings (5.19)
+	// multishot recv is 6.0: on 5.19 open() works but the first reap() fails
+	// n_bufs must be a power of 2, each buffer is buf_len bytes
+	int open(unsigned n_bufs, unsigned buf_len, unsigned entries = 64);
+	void close();
+	int is_open() const { return ring_fd != -1; }
+
+	// recv() arms a multishot recv on fd, poll() a multishot POLLIN on fd. They are submitted by wait()
+	int recv(int fd, unsigned long long user_data) { return arm(0, fd, user_data); }
+	int poll(int fd, unsigned long long user_data) { return arm(1, fd, user_data); }
+
+	// wait() submits anything queued and sleeps until at least one completion is ready
+	// it does not make a syscall if completions are already waiting
+	int wait();
+
+	// reap() calls cb for every completion that is ready, returns nonzero if cb did or on error
+	int reap(rx_cb cb, void * ctx);
+
+	unsigned long get_enters() const { return enters; }	// io_uring_enter() syscalls so far
+
+protected:
+	int ring_fd;
+	void * sq_map, * cq_map, * sqe_map;
+	unsigned long sq_map_len, cq_map_len, sqe_map_len;
+	unsigned * sq_head, * sq_tail, * sq_mask, * sq_array, * sq_flags;
+	unsigned * cq_head, * cq_tail, * cq_mask;
+	void * sqes;	// struct io_uring_sqe[]
+	void * cqes;	// struct io_uring_cqe[]
+	unsigned to_submit;
+
+	void * br;	// struct io_uring_buf_ring, shared with the kernel
+	unsigned long br_len;
+	u8 * bufs;
+	unsigned n_bufs, buf_len;
+	u16 br_tail;
+
+	struct arm_req {
+		int fd;
+		u8 is_poll;
+		unsigned long long user_data;
+	};
+	arm_req arms[MAX_ARMS];
+	unsigned n_arms;
+	unsigned long enters;
+
+	int arm(u8 is_poll, int fd, unsigned long long user_data);
+	int queue(const arm_req & a);
+	void give_buf(u16 bid);
+};
+
+}
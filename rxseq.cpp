@@ -0,0 +1,153 @@
+/*
+Copyright (c) 2014 David Hubbard
+
+This program is free software: you can redistribute it and/or modify it under the terms of
+the GNU Affero General Public License version 3, as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License version 3 for more details.
+
+You should have received a copy of the GNU Affero General Public License version 3 along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+#include "iface.h"
+#include "dgpool.h"
+#include "rxseq.h"
+
+using namespace tuner_ns;
+
+void rxseq::reset()
+{
+	started = 0;
+	next = 0;
+	seen = 0;
+	for (unsigned i = 0; i < WINDOW; i++) if (held_ok[i]) {
+		held_ok[i] = 0;
+		dgpool::put(held[i]);
+	}
+	n_held = 0;
+	memset(&c, 0, sizeof(c));
+	n_gaps = 0;
+}
+
+void rxseq::lost(u32 seq)
+{
+	c.lost++;
+	u32 n = n_gaps;
+	if (n) {
+		seqgap & g = gaps[(n - 1) % MAX_GAPS];
+		if (g.seq + g.n == seq) {
+			g.n++;
+			return;
+		}
+	}
+	seqgap & g = gaps[n % MAX_GAPS];
+	g.wall = wall_ms();
+	g.seq = seq;
+	g.n = 1;
+	n_gaps = n + 1;	// after g is filled in, for get_gaps() on another thread
+}
+
+// step() delivers next if it is held, else gives up on it
+int rxseq::step(deliver_cb cb, void * ctx, int count_lost /*= 1*/)
+{
+	unsigned slot = next % WINDOW;
+	int r = 0;
+	if (held_ok[slot] && held_seq[slot] == next) {
+		held_ok[slot] = 0;
+		n_held--;
+		seen = (seen << 1) | 1;
+		next++;
+		r = cb(ctx, held[slot]);
+		dgpool::put(held[slot]);
+	} else {
+		if (count_lost) lost(next);
+		seen <<= 1;
+		next++;
+	}
+	return r;
+}
+
+int rxseq::push(dgbuf * b, deliver_cb cb, void * ctx)
+{
+	const u8 * buf = b->buf;
+	u32 seq = ((u32) buf[0] << 24) + ((u32) buf[1] << 16) + ((u32) buf[2] << 8) + buf[3];
+	c.dgrams++;
+	if (!started) {
+		started = 1;
+		next = seq;
+	}
+
+	int d = (int) (seq - next);
+	if (d > RESYNC || d < -RESYNC) {
+		// deliver what is held, in order, without counting the holes: the old sequence is over
+		c.resync++;
+		while (n_held) if (step(cb, ctx, 0)) return 1;
+		next = seq;
+		seen = 0;
+		d = 0;
+	}
+
+	if (d < 0) {
+		if (d >= -64 && ((seen >> (-d - 1)) & 1)) c.dup++;
+		else c.late++;
+		return 0;
+	}
+
+	// too far ahead to hold: give up on everything WINDOW or more behind it
+	while (seq - next >= WINDOW) if (step(cb, ctx)) return 1;
+	// and let go of what the given up one was holding back, or the rest of the stream stays WINDOW behind
+	while (n_held && held_ok[next % WINDOW] && held_seq[next % WINDOW] == next) if (step(cb, ctx)) return 1;
+
+	if (seq != next) {
+		unsigned slot = seq % WINDOW;
+		if (held_ok[slot]) {
+			c.dup++;	// held_seq[slot] is seq: anything else in the slot was stepped out above
+			return 0;
+		}
+		if (!b->pool) {
+			dgbuf * h = pool ? pool->get() : 0;
+			if (!h) {
+				c.nobuf++;	// counted lost too once it is given up on
+				return 0;
+			}
+			memcpy(h->buf, b->buf, b->len);
+			h->len = b->len;
+			h->ms = b->ms;
+			h->gen = b->gen;
+			b = h;
+		} else dgpool::hold(b);
+		held[slot] = b;
+		held_seq[slot] = seq;
+		held_ok[slot] = 1;
+		n_held++;
+		return 0;
+	}
+
+	if (n_held) c.reordered++;	// the one that was missing came after all
+	seen = (seen << 1) | 1;
+	next++;
+	if (cb(ctx, b)) return 1;
+	while (n_held && held_ok[next % WINDOW] && held_seq[next % WINDOW] == next) if (step(cb, ctx)) return 1;
+	return 0;
+}
+
+int rxseq::flush(deliver_cb cb, void * ctx)
+{
+	while (n_held) if (step(cb, ctx)) return 1;
+	return 0;
+}
+
+unsigned rxseq::get_gaps(seqgap * out, unsigned max) const
+{
+	u32 n = n_gaps;
+	unsigned k = n < (u32) MAX_GAPS ? n : (u32) MAX_GAPS;
+	if (k > max) k = max;
+	for (unsigned i = 0; i < k; i++) out[i] = gaps[(n - k + i) % MAX_GAPS];
+	return k;
+}
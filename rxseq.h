@@ -0,0 +1,94 @@
+/*
+Copyright (c) 2014 David Hubbard
+
+This program is free software: you can redistribute it and/or modify it under the terms of
+the GNU Affero General Public License version 3, as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License version 3 for more details.
+
+You should have received a copy of the GNU Affero General Public License version 3 along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+namespace tuner_ns {
+
+// seqgap is one loss event: n datagrams starting at seq never arrived. Each one was 7 TS packets
+struct seqgap {
+	unsigned long long wall;	// wall_ms() when the gap was given up on
+	u32 seq;
+	u32 n;
+};
+
+// rxseq checks the 32 bit sequence number at the start of every datagram from the tuner (uncertain: it
+// looks like it counts up by 1 per datagram on each demod) and puts datagrams back in order before the
+// demux. A datagram that is early is held for up to WINDOW datagrams waiting for the missing one, then
+// the missing one is counted lost. Like tsqual the demux thread is the only writer and takes no lock
+class rxseq {
+public:
+	enum rxseq_constants {
+		WINDOW = 8,	// about 4ms of one demod at 19.4 Mbit/s
+		MAX_GAPS = 32,
+		RESYNC = 1024,	// a jump bigger than this either way is the tuner starting over, not loss
+	};
+
+	struct counts {
+		u32 dgrams;	// every datagram pushed
+		u32 lost;	// never arrived: lost * 7 TS packets are missing from the stream
+		u32 dup;	// already delivered or already held, dropped
+		u32 reordered;	// arrived after a later one, but within WINDOW: put back in order
+		u32 late;	// arrived after WINDOW had given up on it, dropped (and counted in lost too)
+		u32 nobuf;	// borrowed, had to be held but pool was empty: dropped (and counted in lost too)
+		u32 resync;	// the sequence number jumped more than RESYNC
+	};
+
+	// deliver_cb gets the datagrams in order. A nonzero return stops push()
+	// cb has to dgpool::hold() b if it wants it after it returns
+	typedef int (*deliver_cb)(void * ctx, dgbuf * b);
+
+	rxseq() {
+		pool = 0;
+		n_held = 0;
+		for (unsigned i = 0; i < WINDOW; i++) held_ok[i] = 0;
+		reset();
+	}
+
+	// reset() forgets everything, and put()s the datagrams still held. demux thread only
+	// call flush() first unless the held datagrams are not wanted anymore
+	void reset();
+
+	// flush() delivers the datagrams still held, in order, and counts the holes between them lost:
+	// a held datagram is otherwise only let go of when a later one arrives. demux thread only
+	int flush(deliver_cb cb, void * ctx);
+
+	// push() calls cb for every datagram that is now in order, which can be none. Returns nonzero if cb did.
+	// A datagram that has to wait is held with dgpool::hold(), not copied. demux thread only
+	// a borrowed one (see dgbuf) is copied into a dgbuf from pool instead, so push() must then be called
+	// on the thread that owns pool
+	int push(dgbuf * b, deliver_cb cb, void * ctx);
+	dgpool * pool;	// set before any borrowed push()
+
+	const counts & get_counts() const { return c; }	// since reset()
+
+	// get_gaps() copies up to max of the most recent loss events, oldest first, and returns how many
+	unsigned get_gaps(seqgap * out, unsigned max) const;
+
+protected:
+	int started;
+	u32 next;	// the sequence number to deliver next
+	unsigned long long seen;	// bit k: next - 1 - k was delivered, for telling dup from late
+	dgbuf * held[WINDOW];
+	u32 held_seq[WINDOW];
+	u8 held_ok[WINDOW];
+	u8 n_held;
+	counts c;
+	seqgap gaps[MAX_GAPS];
+	volatile u32 n_gaps;
+
+	int step(deliver_cb cb, void * ctx, int count_lost = 1);
+	void lost(u32 seq);
+};
+
+}
@@ -0,0 +1,303 @@
+/*
+Copyright (c) 2014 David Hubbard
+
+This program is free software: you can redistribute it and/or modify it under the terms of
+the GNU Affero General Public License version 3, as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License version 3 for more details.
+
+You should have received a copy of the GNU Affero General Public License version 3 along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mpgts.h"
+
+using namespace tuner_ns;
+
+static const char siglog_magic[8] = { 'S', 'E', 'Z', 'S', 'I', 'G', '0', '2' };
+
+int siglog::open(const char * dir_)
+{
+	close();
+	if (strlen(dir_) >= sizeof(dir) - 32) {
+		fprintf(stderr, "siglog::open(%s): name too long\n", dir_);
+		return 1;
+	}
+	strcpy(dir, dir_);
+	if (mkdir(dir, 0755) && errno != EEXIST) {
+		fprintf(stderr, "siglog::open(%s): mkdir failed: %d %s\n", dir, errno, strerror(errno));
+		return 1;
+	}
+
+	pthread_mutex_t * m = (typeof(m)) malloc(sizeof(*m));
+	if (!m) {
+		fprintf(stderr, "siglog::open(%s): malloc failed\n", dir);
+		return 1;
+	}
+	pthread_mutex_init(m, 0);
+	mtx = m;
+	mono_to_wall = (long long) wall_ms() - (long long) mono_ms();
+
+	{
+		// this will trigger a compiler error if the on-disk structs are not the expected size
+		u32 rec_size_check1[(int) (sizeof(rec) - 12)];
+		u32 rec_size_check2[(int) (12 - sizeof(rec))];
+		u32 hdr_size_check1[(int) (sizeof(hdr) - 256)];
+		u32 hdr_size_check2[(int) (256 - sizeof(hdr))];
+		(void) rec_size_check1; (void) rec_size_check2; (void) hdr_size_check1; (void) hdr_size_check2;
+	}
+	return 0;
+}
+
+void siglog::close()
+{
+	close_segment();
+	if (mtx) {
+		pthread_mutex_destroy((pthread_mutex_t *) mtx);
+		free(mtx);
+		mtx = 0;
+	}
+	ndev = 0;
+}
+
+int siglog::add_dev(const u8 * mac)
+{
+	if (!mtx) return -1;
+	pthread_mutex_lock((pthread_mutex_t *) mtx);
+	unsigned i;
+	for (i = 0; i < ndev; i++) if (!memcmp(macs[i], mac, 6)) break;
+	if (i == ndev) {
+		if (ndev >= MAX_DEV) {
+			pthread_mutex_unlock((pthread_mutex_t *) mtx);
+			fprintf(stderr, "siglog::add_dev(): too many\n");
+			return -1;
+		}
+		memcpy(macs[ndev], mac, 6);
+		ndev++;
+		if (seg) {
+			memcpy(seg->mac[i], mac, 6);
+			seg->ndev = ndev;
+		}
+	}
+	pthread_mutex_unlock((pthread_mutex_t *) mtx);
+	return (int) i;
+}
+
+int siglog::new_segment(unsigned long long ms)
+{
+	char fn[sizeof(dir) + 32];
+	snprintf(fn, sizeof(fn), "%s/sig-%013llu.dat", dir, ms);
+	fd = ::open(fn, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "siglog::new_segment(%s): open failed: %d %s\n", fn, errno, strerror(errno));
+		return 1;
+	}
+	if (ftruncate(fd, SEG_BYTES)) {
+		fprintf(stderr, "siglog::new_segment(%s): ftruncate failed: %d %s\n", fn, errno, strerror(errno));
+		::close(fd);
+		fd = -1;
+		return 1;
+	}
+	void * p = mmap(0, SEG_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "siglog::new_segment(%s): mmap failed: %d %s\n", fn, errno, strerror(errno));
+		::close(fd);
+		fd = -1;
+		return 1;
+	}
+	seg = (hdr *) p;
+	recs = (rec *) &seg[1];
+	memcpy(seg->magic, siglog_magic, sizeof(seg->magic));
+	seg->rec_size = sizeof(rec);
+	seg->capacity = (SEG_BYTES - sizeof(hdr)) / sizeof(rec);
+	seg->count = 0;
+	seg->ndev = ndev;
+	seg->first_ms = ms;
+	seg->last_ms = ms;
+	memcpy(seg->mac, macs, sizeof(seg->mac));
+	return 0;
+}
+
+void siglog::close_segment()
+{
+	if (!seg) return;
+	size_t used = sizeof(hdr) + (size_t) seg->count * sizeof(rec);
+	munmap(seg, SEG_BYTES);
+	seg = 0;
+	recs = 0;
+	// give back the unused part of the segment
+	if (ftruncate(fd, used)) {
+		fprintf(stderr, "siglog::close_segment(): ftruncate failed: %d %s\n", errno, strerror(errno));
+	}
+	::close(fd);
+	fd = -1;
+}
+
+int siglog::append(u8 dev, u8 demod, const sigsample & s)
+{
+	if (!mtx || dev >= ndev) return 1;
+	unsigned long long ms = (unsigned long long) ((long long) s.ms + mono_to_wall);
+	pthread_mutex_lock((pthread_mutex_t *) mtx);
+
+	// room for a timebase and a sample
+	if (seg && seg->count + 2 > seg->capacity) close_segment();
+	if (!seg && new_segment(ms)) {
+		pthread_mutex_unlock((pthread_mutex_t *) mtx);
+		return 1;
+	}
+
+	u32 n = seg->count;
+	if (!n || ms < prev_ms || ms - prev_ms > 0xffff) {
+		rec & t = recs[n++];
+		memset(&t, 0, sizeof(t));
+		t.kind = REC_TIMEBASE;
+		t.ptmse = (u16) (ms >> 32);
+		t.eqmse = (u16) (ms >> 16);
+		t.cr = (u16) ms;
+		prev_ms = ms;
+	}
+	rec & r = recs[n++];
+	r.dt = (u16) (ms - prev_ms);
+	r.dev = (u8) ((demod << 7) | dev);
+	r.tvch = (u8) s.tvch;
+	r.status = s.status;
+	r.kind = REC_SAMPLE;
+	r.ptmse = (u16) (s.ptmse >> 4);
+	r.eqmse = (u16) (s.eqmse >> 4);
+	r.cr = (u16) (short) (s.cr_hz / 100);
+	prev_ms = ms;
+	seg->last_ms = ms;
+	// a reader of a live segment sees count only after the records it covers
+	__atomic_store_n(&seg->count, n, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock((pthread_mutex_t *) mtx);
+	return 0;
+}
+
+int siglog::query_segment(const char * fn, unsigned long long from_ms, unsigned long long to_ms,
+	query_cb cb, void * ctx)
+{
+	int f = ::open(fn, O_RDONLY);
+	if (f < 0) {
+		fprintf(stderr, "siglog::query(%s): open failed: %d %s\n", fn, errno, strerror(errno));
+		return 1;
+	}
+	struct stat st;
+	if (fstat(f, &st)) {
+		fprintf(stderr, "siglog::query(%s): fstat failed: %d %s\n", fn, errno, strerror(errno));
+		::close(f);
+		return 1;
+	}
+	if ((size_t) st.st_size < sizeof(hdr)) {
+		::close(f);
+		return 0;	// being created right now
+	}
+	void * p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, f, 0);
+	::close(f);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "siglog::query(%s): mmap failed: %d %s\n", fn, errno, strerror(errno));
+		return 1;
+	}
+
+	const hdr * h = (const hdr *) p;
+	u32 count = __atomic_load_n(&h->count, __ATOMIC_ACQUIRE);
+	if (memcmp(h->magic, siglog_magic, sizeof(h->magic)) || h->rec_size != sizeof(rec) ||
+		sizeof(hdr) + (size_t) count * sizeof(rec) > (size_t) st.st_size)
+	{
+		fprintf(stderr, "siglog::query(%s): not a valid siglog segment, ignored\n", fn);
+		munmap(p, st.st_size);
+		return 0;
+	}
+	if (h->last_ms < from_ms || h->first_ms > to_ms) {
+		munmap(p, st.st_size);
+		return 0;
+	}
+	madvise(p, st.st_size, MADV_SEQUENTIAL);
+
+	const rec * r = (const rec *) &h[1];
+	unsigned long long ms = 0;
+	siglog_entry e;
+	for (u32 i = 0; i < count; i++) {
+		if (r[i].kind == REC_TIMEBASE) {
+			ms = ((unsigned long long) r[i].ptmse << 32) | ((u32) r[i].eqmse << 16) | r[i].cr;
+			continue;
+		}
+		ms += r[i].dt;
+		if (ms < from_ms) continue;
+		if (ms > to_ms) break;
+		u8 dev = r[i].dev & 0x7f;
+		if (dev >= h->ndev || dev >= MAX_DEV) continue;
+		e.ms = ms;
+		e.mac = h->mac[dev];
+		e.demod = r[i].dev >> 7;
+		e.tvch = r[i].tvch;
+		e.status = r[i].status;
+		e.ptmse = (u32) r[i].ptmse << 4;
+		e.eqmse = (u32) r[i].eqmse << 4;
+		e.cr_hz = (short) r[i].cr * 100;
+		cb(ctx, e);
+	}
+	munmap(p, st.st_size);
+	return 0;
+}
+
+static int cmp_ull(const void * a, const void * b)
+{
+	unsigned long long x = *(const unsigned long long *) a, y = *(const unsigned long long *) b;
+	return x < y ? -1 : x > y;
+}
+
+int siglog::query(const char * dir, unsigned long long from_ms, unsigned long long to_ms, query_cb cb, void * ctx)
+{
+	DIR * d = opendir(dir);
+	if (!d) {
+		fprintf(stderr, "siglog::query(%s): opendir failed: %d %s\n", dir, errno, strerror(errno));
+		return 1;
+	}
+
+	// segment names are the wall_ms() of their first record, so sorting them sorts the samples
+	size_t n = 0, max = 0;
+	unsigned long long * start = 0;
+	struct dirent * de;
+	while ((de = readdir(d))) {
+		unsigned long long ms;
+		int len = 0;
+		if (sscanf(de->d_name, "sig-%llu.dat%n", &ms, &len) != 1 || !len || de->d_name[len]) continue;
+		if (n >= max) {
+			max = max ? max*2 : 64;
+			unsigned long long * p = (typeof(p)) realloc(start, sizeof(*p) * max);
+			if (!p) {
+				fprintf(stderr, "siglog::query(%s): realloc failed\n", dir);
+				free(start);
+				closedir(d);
+				return 1;
+			}
+			start = p;
+		}
+		start[n++] = ms;
+	}
+	closedir(d);
+	qsort(start, n, sizeof(*start), cmp_ull);
+
+	int r = 0;
+	for (size_t i = 0; i < n && !r; i++) {
+		if (start[i] > to_ms) break;
+		char fn[1024];
+		snprintf(fn, sizeof(fn), "%s/sig-%013llu.dat", dir, start[i]);
+		r = query_segment(fn, from_ms, to_ms, cb, ctx);
+	}
+	free(start);
+	return r;
+}
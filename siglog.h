@@ -0,0 +1,98 @@
+/*
+Copyright (c) 2014 David Hubbard
+
+This program is free software: you can redistribute it and/or modify it under the terms of
+the GNU Affero General Public License version 3, as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License version 3 for more details.
+
+You should have received a copy of the GNU Affero General Public License version 3 along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+namespace tuner_ns {
+
+// siglog_entry is one sample read back by siglog::query()
+struct siglog_entry {
+	unsigned long long ms;	// wall_ms() when the sample was taken
+	const u8 * mac;		// which tuner
+	u8 demod, tvch, status;
+	u32 ptmse, eqmse;	// the low 4 bits are not stored
+	int cr_hz;		// stored in 100Hz units
+};
+
+// siglog is a long term history of sigsamples: a directory of fixed size segment files that are mmap()ed,
+// so append() is a 12 byte store into the page cache and there are no syscalls until the segment is full
+// a new segment is started for every open() and whenever the current one fills up
+class siglog {
+public:
+	enum siglog_constants {
+		MAX_DEV = 16,			// tuners per segment
+		SEG_BYTES = 4 << 20,		// 4MB = 350k records = 4.8 hours of 2 demods at 10Hz
+		REC_SAMPLE = 0,
+		REC_TIMEBASE = 1,
+	};
+
+	// each record stores the time as the ms since the previous record in the segment. When that does not fit
+	// (and at the start of each segment) a REC_TIMEBASE record comes first, with the 48-bit wall_ms() in
+	// ptmse:eqmse:cr
+	struct rec {
+		u16 dt;		// ms since the previous record
+		u8 dev;		// demod << 7 | index into hdr::mac
+		u8 tvch;	// all 8 bits: cable channels go up to 135
+		u8 status;	// get_mse() status
+		u8 kind;	// REC_SAMPLE or REC_TIMEBASE
+		u16 ptmse;	// get_mse() ptmse >> 4
+		u16 eqmse;	// get_mse() eqmse >> 4
+		u16 cr;		// carrier offset in 100Hz units, two's complement
+	};
+
+	struct hdr {
+		char magic[8];
+		u32 rec_size;		// sizeof(rec)
+		u32 capacity;		// records that fit in the segment
+		u32 count;		// records written so far, a reader must not look past this
+		u32 ndev;
+		unsigned long long first_ms, last_ms;	// wall_ms() of the first and last record
+		u8 mac[MAX_DEV][6];
+		u8 pad[256 - 8 - 4*4 - 8*2 - MAX_DEV*6];
+	};
+
+	siglog() : fd(-1), seg(0), recs(0), prev_ms(0), mono_to_wall(0), ndev(0), mtx(0) { dir[0] = 0; }
+	~siglog() { close(); }
+
+	// open() creates the directory if needed
+	int open(const char * dir_);
+	void close();
+
+	// add_dev() returns the dev number to use with append(), or -1
+	int add_dev(const u8 * mac);
+
+	// append() is thread safe, so every sigmon can log to the same siglog
+	int append(u8 dev, u8 demod, const sigsample & s);
+
+	// query() calls cb for every sample from from_ms to to_ms (wall_ms()), segments in the order they were
+	// started, so the samples are in time order unless more than one process logged to dir at the same time
+	typedef void (* query_cb)(void * ctx, const siglog_entry & e);
+	static int query(const char * dir, unsigned long long from_ms, unsigned long long to_ms, query_cb cb, void * ctx);
+
+protected:
+	char dir[256];
+	int fd;
+	hdr * seg;
+	rec * recs;
+	unsigned long long prev_ms;
+	long long mono_to_wall;		// add to a mono_ms() to get wall_ms()
+	u8 macs[MAX_DEV][6];
+	unsigned ndev;
+	void * mtx;	// pthread_mutex_t *
+
+	int new_segment(unsigned long long ms);
+	void close_segment();
+	static int query_segment(const char * filename, unsigned long long from_ms, unsigned long long to_ms,
+		query_cb cb, void * ctx);
+};
+
+}
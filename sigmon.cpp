@@ -0,0 +1,158 @@
+/*
+Copyright (c) 2014 David Hubbard
+
+This program is free software: you can redistribute it and/or modify it under the terms of
+the GNU Affero General Public License version 3, as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License version 3 for more details.
+
+You should have received a copy of the GNU Affero General Public License version 3 along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "mpgts.h"
+
+using namespace tuner_ns;
+
+void sigring::push(const sigsample & x)
+{
+	unsigned long h = head;	// only this thread writes head
+	s[h % SIZE] = x;
+	__atomic_store_n(&head, h + 1, __ATOMIC_RELEASE);
+}
+
+unsigned sigring::snapshot(sigsample * out, unsigned max) const
+{
+	unsigned long h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+	unsigned n = max;
+	if (n > SIZE) n = SIZE;
+	if (n > h) n = h;
+	unsigned long first = h - n;
+	for (unsigned i = 0; i < n; i++) out[i] = s[(first + i) % SIZE];
+
+	// if the writer moved on while copying, the oldest entries may have been overwritten. With head == h2 the
+	// writer may be in the middle of writing entry h2 - SIZE, so only entries after that one are good
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	unsigned long h2 = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+	unsigned long good = h2 + 1 > SIZE ? h2 + 1 - SIZE : 0;
+	if (first < good) {
+		unsigned long drop = good - first;
+		if (drop >= n) return 0;
+		memmove(out, out + drop, (n - drop)*sizeof(out[0]));
+		n -= drop;
+	}
+	return n;
+}
+
+int sigmon::get_latest(u8 ch, sigsample * s) const
+{
+	if (ch >= tuner::NUM_CHANNELS) return 1;
+	return ring[ch].snapshot(s, 1) ? 0 : 1;
+}
+
+int sigmon::get_window(u8 ch, unsigned window_ms, sigwindow * w) const
+{
+	memset(w, 0, sizeof(*w));
+	if (ch >= tuner::NUM_CHANNELS) return 1;
+	sigsample all[sigring::SIZE];
+	unsigned n = ring[ch].snapshot(all, sigring::SIZE);
+	if (!n) return 1;
+
+	unsigned long now = mono_ms();
+	unsigned tvch = all[n - 1].tvch;
+	unsigned long long ptsum = 0, eqsum = 0;
+	long long crsum = 0;
+	for (unsigned i = n; i-- > 0; ) {
+		const sigsample & s = all[i];
+		if (now - s.ms > window_ms || s.tvch != tvch) break;
+		w->n++;
+		if (!(s.status & 1)) continue;
+		if (!w->locked++) {
+			w->status_min = w->status_max = s.status;
+			w->ptmse_min = w->ptmse_max = s.ptmse;
+			w->eqmse_min = w->eqmse_max = s.eqmse;
+			w->cr_hz_min = w->cr_hz_max = s.cr_hz;
+		}
+		if (s.status < w->status_min) w->status_min = s.status;
+		if (s.status > w->status_max) w->status_max = s.status;
+		if (s.ptmse < w->ptmse_min) w->ptmse_min = s.ptmse;
+		if (s.ptmse > w->ptmse_max) w->ptmse_max = s.ptmse;
+		if (s.eqmse < w->eqmse_min) w->eqmse_min = s.eqmse;
+		if (s.eqmse > w->eqmse_max) w->eqmse_max = s.eqmse;
+		if (s.cr_hz < w->cr_hz_min) w->cr_hz_min = s.cr_hz;
+		if (s.cr_hz > w->cr_hz_max) w->cr_hz_max = s.cr_hz;
+		ptsum += s.ptmse;
+		eqsum += s.eqmse;
+		crsum += s.cr_hz;
+	}
+	if (w->locked) {
+		w->ptmse_mean = (u32) (ptsum / w->locked);
+		w->eqmse_mean = (u32) (eqsum / w->locked);
+		w->cr_hz_mean = (int) (crsum / (long long) w->locked);
+	}
+	return w->n ? 0 : 1;
+}
+
+void * sigmon::thread_wrapper(void * p) { return static_cast<sigmon *>(p)->thread_main(); }
+
+void * sigmon::thread_main()
+{
+	while (!want_stop) {
+		unsigned long t0 = mono_ms();
+		for (u8 ch = 0; ch < tuner::NUM_CHANNELS && !want_stop; ch++) {
+			if (tun->get_freq(ch) == (unsigned) -1) continue;	// amp is off
+			sigsample s;
+			int r = tun->sample(ch, &s);
+			if (r == 2) __atomic_add_fetch(&skipped, 1, __ATOMIC_RELAXED);
+			else if (!r) {
+				ring[ch].push(s);
+				if (log) log->append(log_dev, ch, s);
+			}
+		}
+		unsigned long dt = mono_ms() - t0;
+		if (dt < period_ms) usleep((period_ms - dt)*1000);
+	}
+	return 0;
+}
+
+int sigmon::start(tuner * t, unsigned period_ms_, siglog * log_ /*= 0*/, int dev /*= 0*/)
+{
+	if (th) {
+		fprintf(stderr, "sigmon::start(): already running\n");
+		return 1;
+	}
+	if (!period_ms_) {
+		fprintf(stderr, "sigmon::start(): period_ms must not be 0\n");
+		return 1;
+	}
+	tun = t;
+	period_ms = period_ms_;
+	log = log_;
+	log_dev = (u8) dev;
+	want_stop = 0;
+	if (pthread_create(&th, 0 /*attr*/, thread_wrapper, this)) {
+		fprintf(stderr, "sigmon::start(): pthread_create failed: %d %s\n", errno, strerror(errno));
+		th = 0;
+		return 1;
+	}
+	return 0;
+}
+
+void sigmon::stop()
+{
+	if (!th) return;
+	// not pthread_cancel(): the thread may be holding the control socket lock
+	want_stop = 1;
+	void * rv;
+	if (pthread_join(th, &rv)) {
+		fprintf(stderr, "sigmon::stop(): pthread_join failed: %d %s\n", errno, strerror(errno));
+	}
+	th = 0;
+}
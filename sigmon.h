@@ -0,0 +1,87 @@
+/*
+Copyright (c) 2014 David Hubbard
+
+This program is free software: you can redistribute it and/or modify it under the terms of
+the GNU Affero General Public License version 3, as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License version 3 for more details.
+
+You should have received a copy of the GNU Affero General Public License version 3 along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+namespace tuner_ns {
+
+// sigring is a lock-free ring of samples: one writer (the sigmon thread) and any number of readers
+// a reader copies what it wants then checks the writer did not lap it while copying
+class sigring {
+public:
+	enum sigring_constants {
+		SIZE = 512,	// must be a power of 2
+	};
+
+	sigring() : head(0) {}
+	void push(const sigsample & s);
+
+	// snapshot() copies up to max of the newest samples to out, oldest first, and returns how many it copied
+	unsigned snapshot(sigsample * out, unsigned max) const;
+
+protected:
+	sigsample s[SIZE];
+	unsigned long head;	// number of samples ever pushed, s[head % SIZE] is written next
+};
+
+// sigwindow summarizes the samples in a time window
+struct sigwindow {
+	unsigned n;		// number of samples
+	unsigned locked;	// number of samples with carrier lock, the rest are not in the min/max/mean below
+	u8 status_min, status_max;
+	u32 ptmse_min, ptmse_max, ptmse_mean;
+	u32 eqmse_min, eqmse_max, eqmse_mean;
+	int cr_hz_min, cr_hz_max, cr_hz_mean;
+};
+
+// sigmon samples both DT3305 of a tuner in the background
+// sigmon only uses background transactions (tuner::sample()) so tuning ops never wait for it: a sample that
+// would have to wait is skipped and counted in get_skipped()
+class sigmon {
+public:
+	sigmon() : tun(0), th(0), want_stop(0), period_ms(0), skipped(0), log(0), log_dev(0) {}
+	~sigmon() { stop(); }
+
+	// start() the sampling thread, one sample of each DT3305 that has its amp on every period_ms
+	// if log is not 0 the samples are also appended to it as dev (see siglog::add_dev())
+	int start(tuner * t, unsigned period_ms_, siglog * log_ = 0, int dev = 0);
+	void stop();
+	unsigned get_period() const { return th ? period_ms : 0; }
+	unsigned long get_skipped() const { return __atomic_load_n(&skipped, __ATOMIC_RELAXED); }
+
+	// get_latest() returns 1 if there is no sample of ch yet
+	int get_latest(u8 ch, sigsample * s) const;
+
+	// get_window() summarizes the last window_ms of samples of ch, returns 1 if there are none
+	// samples from before the last set_freq() are left out
+	int get_window(u8 ch, unsigned window_ms, sigwindow * w) const;
+
+	unsigned snapshot(u8 ch, sigsample * out, unsigned max) const {
+		if (ch >= tuner::NUM_CHANNELS) return 0;
+		return ring[ch].snapshot(out, max);
+	}
+
+protected:
+	tuner * tun;
+	pthread_t th;
+	volatile int want_stop;
+	unsigned period_ms;
+	unsigned long skipped;
+	sigring ring[tuner::NUM_CHANNELS];
+	siglog * log;
+	u8 log_dev;
+
+	static void * thread_wrapper(void * arg);
+	void * thread_main();
+};
+
+}
@@ -23,6 +23,7 @@ this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <string.h>
 #include <errno.h>
 #include <stdio.h>
+#include <pthread.h>
 #include <new>
 #include "mpgts.h"
 
@@ -307,6 +308,16 @@ int socket::open()
 {
 	ip_printf(ipstr, get_ip());
 
+	if (!xlock) {
+		pthread_mutex_t * m = (typeof(m)) malloc(sizeof(*m));
+		if (!m) {
+			fprintf(stderr, "socket::open(%s): malloc failed\n", ipstr);
+			return 1;
+		}
+		pthread_mutex_init(m, 0);
+		xlock = m;
+	}
+
 	sock = ::socket(AF_INET, SOCK_STREAM, 0);
 	if (sock < 0) {
 		fprintf(stderr, "socket::open(%s): socket failed: %d %s\n", ipstr, errno, strerror(errno));
@@ -397,12 +408,54 @@ int socket::read(u8 * pkt, size_t * pktlen)
 
 void socket::close()
 {
+	if (xlock) {
+		pthread_mutex_destroy((pthread_mutex_t *) xlock);
+		free(xlock);
+		xlock = 0;
+	}
 	if (sock == -1) return;
 	::close(sock);
 	sock = -1;
 }
 
-u8 * socket::write_then_read(u8 * pkt, size_t pktlen, size_t * rxlen)
+void socket::fg_lock()
+{
+	if (!xlock) return;
+	__atomic_add_fetch(&fg_waiting, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock((pthread_mutex_t *) xlock);
+	__atomic_sub_fetch(&fg_waiting, 1, __ATOMIC_SEQ_CST);
+}
+
+void socket::xunlock()
+{
+	if (!xlock) return;
+	pthread_mutex_unlock((pthread_mutex_t *) xlock);
+}
+
+int socket::bg_trylock()
+{
+	if (!xlock) return 1;
+	if (__atomic_load_n(&fg_waiting, __ATOMIC_SEQ_CST)) return 1;
+	if (mono_ms() - __atomic_load_n(&fg_last_ms, __ATOMIC_RELAXED) < FG_QUIET_MS) return 1;
+	if (pthread_mutex_trylock((pthread_mutex_t *) xlock)) return 1;
+	// a foreground transaction may have started between the checks and the trylock
+	if (__atomic_load_n(&fg_waiting, __ATOMIC_SEQ_CST)) {
+		xunlock();
+		return 1;
+	}
+	return 0;
+}
+
+u8 * socket::write_then_read(u8 * pkt, size_t pktlen, size_t * rxlen, unsigned bg /*= 0*/)
+{
+	if (!bg) fg_lock();
+	u8 * rx = xact(pkt, pktlen, rxlen);
+	if (!bg) __atomic_store_n(&fg_last_ms, mono_ms(), __ATOMIC_RELAXED);
+	xunlock();
+	return rx;
+}
+
+u8 * socket::xact(u8 * pkt, size_t pktlen, size_t * rxlen)
 {
 	if (write(pkt, pktlen, 0x0c /*tuner request*/)) return 0;
 
@@ -728,12 +781,13 @@ int socket::set_demod32(u8 ch, u32 addr, u32 val)
 	return 0;
 }
 
-int socket::get_demodN(u8 ch, u32 addr, u8 * arr, u8 len)
+int socket::get_demodN(u8 ch, u32 addr, u8 * arr, u8 len, unsigned bg /*= 0*/)
 {
 	if ((addr & ~0xffff) || ch > 2 || !len) {
 		fprintf(stderr, "get_demodN(%u, %04x, %u) invalid\n", ch, addr, len);
 		return 1;
 	}
+	if (bg && bg_trylock()) return 2;
 
 	// talking to an LG DT3305
 	u8 pkt[] = {
@@ -744,7 +798,7 @@ int socket::get_demodN(u8 ch, u32 addr, u8 * arr, u8 len)
 			0,0,0,0,	// CRC
 		};
 	size_t n = 4;
-	u8 * rx = write_then_read(pkt, sizeof(pkt), &n);
+	u8 * rx = write_then_read(pkt, sizeof(pkt), &n, bg);
 	if (!rx) return 1;
 	if (n != (size_t) (4 + len)) {
 		fprintf(stderr, "get_demodN(%u, %04x, %u) fault: %zu\n", ch, addr, len, n);
@@ -755,7 +809,7 @@ int socket::get_demodN(u8 ch, u32 addr, u8 * arr, u8 len)
 	return 0;
 }
 
-int socket::set_demodN(u8 ch, u32 addr, u8 * arr, u8 len)
+int socket::set_demodN(u8 ch, u32 addr, const u8 * arr, u8 len)
 {
 	if ((addr & ~0xffff) || ch > 2 || !len) {
 		fprintf(stderr, "set_demodN(%u, %04x, %u) invalid\n", ch, addr, len);
@@ -24,6 +24,19 @@ protected:
 	int sock;
 	char ipstr[128 - sizeof(sock) - sizeof(ip) - sizeof(mac)];
 
+	// write_then_read() can be called from more than one thread (see sigmon), xlock makes each
+	// transaction atomic. Foreground transactions always win: a background transaction only runs if no
+	// foreground transaction is waiting and none has run for FG_QUIET_MS
+	void * xlock;	// pthread_mutex_t *, void * so this header does not need pthread.h
+	unsigned fg_waiting;
+	unsigned long fg_last_ms;
+	enum socket_constants {
+		FG_QUIET_MS = 50,	// longer than the gaps inside tuner ops (reset_demod() sleeps 20ms)
+	};
+	void fg_lock();
+	void xunlock();
+	u8 * xact(u8 * pkt, size_t pktlen, size_t * rxlen);
+
 	inline void maccopy4(u32 * dst, const u32 * src) { *dst = *src; }
 public:
 	socket(u32 ip_, const u8 * mac_, u32 myip_)
@@ -35,6 +48,9 @@ public:
 		myip = myip_;
 		sock = -1;
 		ipstr[0] = 0;
+		xlock = 0;
+		fg_waiting = 0;
+		fg_last_ms = 0;
 	}
 
 	const u8 * get_mac() const { return mac; }
@@ -45,7 +61,12 @@ public:
 	int read(u8 * pkt, size_t * pktlen);
 	int write(u8 * pkt, size_t pktlen, u8 pkt_type);
 	void close();
-	u8 * write_then_read(u8 * pkt, size_t pktlen, size_t * rxlen);
+	// bg=1 is a background transaction: the caller must already hold the lock from bg_trylock()
+	u8 * write_then_read(u8 * pkt, size_t pktlen, size_t * rxlen, unsigned bg = 0);
+
+	// bg_trylock() returns 0 if the caller now holds the lock for one background transaction,
+	// or 1 if it should be skipped because the foreground wants the socket
+	int bg_trylock();
 
 	int get_gpio(u32 * val);
 	int set_gpio(u32 val);
@@ -57,8 +78,9 @@ public:
 	int set_demod24(u8 ch, u32 addr, u32   val);
 	int get_demod32(u8 ch, u32 addr, u32 * val);
 	int set_demod32(u8 ch, u32 addr, u32   val);
-	int get_demodN(u8 ch, u32 addr, u8 * arr, u8 len);
-	int set_demodN(u8 ch, u32 addr, u8 * arr, u8 len);
+	// get_demodN() with bg=1 returns 2 if the read was skipped, see bg_trylock()
+	int get_demodN(u8 ch, u32 addr, u8 * arr, u8 len, unsigned bg = 0);
+	int set_demodN(u8 ch, u32 addr, const u8 * arr, u8 len);
 	int reset_demod(u8 ch, unsigned reset_ms);	// a good choice for reset_ms is 20
 
 	static mpgts * find(unsigned * num_tumers, unsigned debug = 0);
@@ -0,0 +1,178 @@
+/*
+Copyright (c) 2014 David Hubbard
+
+This program is free software: you can redistribute it and/or modify it under the terms of
+the GNU Affero General Public License version 3, as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License version 3 for more details.
+
+You should have received a copy of the GNU Affero General Public License version 3 along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "mpgts.h"
+#include "survey.h"
+
+using namespace tuner_ns;
+
+const tuner::tuner_antennas survey::input[NUM_INPUTS] = { tuner::ant1, tuner::ant2, tuner::coax };
+
+struct survey::worker {
+	survey * s;
+	mpgts * itm;
+	pthread_t th;
+	int r;
+};
+
+unsigned survey::claim(unsigned * item, unsigned max)
+{
+	unsigned n = 0;
+	pthread_mutex_lock((pthread_mutex_t *) mtx);
+	while (n < max && next < NUM_INPUTS*NUM_CH) {
+		unsigned m = next++;
+		if (!tuner::ch_freq[m % NUM_CH]) continue;
+		item[n++] = m;
+	}
+	if (n) fprintf(stderr, "\r\e[Ksurvey: %u/%u", next, NUM_INPUTS*NUM_CH);
+	pthread_mutex_unlock((pthread_mutex_t *) mtx);
+	return n;
+}
+
+int survey::work(mpgts * itm)
+{
+	for (;;) {
+		unsigned item[tuner::NUM_CHANNELS], n = claim(item, tuner::NUM_CHANNELS), d;
+		if (!n) break;
+
+		unsigned long t0[tuner::NUM_CHANNELS], deadline[tuner::NUM_CHANNELS];
+		unsigned n_avg[tuner::NUM_CHANNELS], pending = 0;
+		u32 eqsum[tuner::NUM_CHANNELS];
+		for (d = 0; d < n; d++) {
+			if (itm->set_freq_ant(d, item[d] % NUM_CH + tuner::TVCH_MIN, input[item[d] / NUM_CH])) return 1;
+			t0[d] = mono_ms();
+			deadline[d] = t0[d] + cr_ms;	// moved out to lock_ms at carrier lock
+			n_avg[d] = 0;
+			eqsum[d] = 0;
+			pending |= 1 << d;
+		}
+		for (; d < tuner::NUM_CHANNELS; d++) if (itm->set_freq(d, (unsigned) -1)) return 1;
+
+		while (pending) {
+			for (d = 0; d < n; d++) if (pending & (1 << d)) {
+				cell & c = cells[item[d] / NUM_CH][item[d] % NUM_CH];
+				u8 status;
+				u32 ptmse, eqmse;
+				if (itm->get_mse(d, &status, &ptmse, &eqmse)) return 1;
+				unsigned long now = mono_ms();
+				if ((status & 1) && !(c.status & 1)) deadline[d] = now + lock_ms;
+				if ((status & 4) && !(c.status & 4)) c.sync_ms = (u16) (now - t0[d]);
+				c.status |= status;
+				if (status & 4) {
+					eqsum[d] += eqmse;
+					if (++n_avg[d] >= AVG) pending &= ~(1 << d);
+				}
+				if (now >= deadline[d]) pending &= ~(1 << d);
+				if (!(pending & (1 << d))) c.eqmse = n_avg[d] ? eqsum[d] / n_avg[d] : 0xfffff;
+			}
+			if (pending) usleep(5000);
+		}
+	}
+	for (u8 d = 0; d < tuner::NUM_CHANNELS; d++) if (itm->set_freq(d, (unsigned) -1)) return 1;
+	return 0;
+}
+
+void * survey::thread_wrapper(void * arg)
+{
+	worker * w = (worker *) arg;
+	w->r = w->s->work(w->itm);
+	return 0;
+}
+
+int survey::run(mpgts * list, unsigned n, unsigned cr_ms_ /*= 100*/, unsigned lock_ms_ /*= 600*/)
+{
+	for (unsigned i = 0; i < n; i++) if (list[i].get_plan() != tuner::air) {
+		fprintf(stderr, "survey::run(): only for the broadcast plan, cable is always coax\n");
+		return 1;
+	}
+	worker * w = (typeof(w)) malloc(sizeof(*w) * n);
+	pthread_mutex_t m;
+	if (!w) {
+		fprintf(stderr, "survey::run(): malloc failed\n");
+		return 1;
+	}
+	pthread_mutex_init(&m, 0);
+	mtx = &m;
+	memset(cells, 0, sizeof(cells));
+	next = 0;
+	n_tuners = n;
+	cr_ms = cr_ms_;
+	lock_ms = lock_ms_;
+
+	unsigned long t0 = mono_ms();
+	unsigned started, r = 0;
+	for (started = 0; started < n; started++) {
+		w[started].s = this;
+		w[started].itm = &list[started];
+		w[started].r = 0;
+		if (pthread_create(&w[started].th, 0 /*attr*/, thread_wrapper, &w[started])) {
+			fprintf(stderr, "survey::run(): pthread_create failed: %d %s\n", errno, strerror(errno));
+			r = 1;
+			// the threads already started finish the survey without this tuner
+			break;
+		}
+	}
+	for (unsigned i = 0; i < started; i++) {
+		void * rv;
+		if (pthread_join(w[i].th, &rv)) {
+			fprintf(stderr, "survey::run(): pthread_join failed: %d %s\n", errno, strerror(errno));
+			r = 1;
+		}
+		if (w[i].r) r = 1;
+	}
+	elapsed_ms = mono_ms() - t0;
+	fprintf(stderr, "\r\e[K");
+	pthread_mutex_destroy(&m);
+	mtx = 0;
+	free(w);
+	return r;
+}
+
+void survey::print(FILE * f) const
+{
+	static const char * const in_name[NUM_INPUTS] = { "ant1", "ant2", "coax" };
+	fprintf(f, "# survey: %u channels x %u inputs on %u tuner%s in %.1fs\n", NUM_CH, NUM_INPUTS, n_tuners,
+		n_tuners == 1 ? "" : "s", elapsed_ms / 1000.0);
+	fprintf(f, "# stage: - no carrier, c carrier, l inlock, s sync, S sync + snr above tov, F fec ok. "
+		"then eq_mse >> 4 (lower is better) and ms to sync\n");
+	fprintf(f, " ch  MHz");
+	for (unsigned in = 0; in < NUM_INPUTS; in++) fprintf(f, "  %-14s", in_name[in]);
+	fprintf(f, "  best\n");
+
+	for (unsigned ch = 0; ch < NUM_CH; ch++) {
+		if (!tuner::ch_freq[ch]) continue;
+		fprintf(f, "%3u %4u", ch + tuner::TVCH_MIN, tuner::ch_freq[ch]);
+		unsigned best = 0;
+		for (unsigned in = 0; in < NUM_INPUTS; in++) {
+			const cell & c = cells[in][ch];
+			if (score(c) > score(cells[best][ch])) best = in;
+			char stage = '-';
+			if (c.status & 0x10) stage = 'F';
+			else if ((c.status & 0x0c) == 0x0c) stage = 'S';
+			else if (c.status & 4) stage = 's';
+			else if (c.status & 2) stage = 'l';
+			else if (c.status & 1) stage = 'c';
+			if (c.status & 4) fprintf(f, "  %c %4x %5ums", stage, c.eqmse >> 4, c.sync_ms);
+			else fprintf(f, "  %c%13s", stage, "");
+		}
+		fprintf(f, "  %s\n", score(cells[best][ch]) ? in_name[best] : "-");
+	}
+}
@@ -0,0 +1,64 @@
+/*
+Copyright (c) 2014 David Hubbard
+
+This program is free software: you can redistribute it and/or modify it under the terms of
+the GNU Affero General Public License version 3, as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License version 3 for more details.
+
+You should have received a copy of the GNU Affero General Public License version 3 along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+namespace tuner_ns {
+
+// survey is a site survey: the lock stage and MSE of every broadcast channel on every input
+// the channel x input matrix is shared out to both DT3305 of every tuner at once, one thread per tuner.
+// Work is handed out input by input, so a tuner only switches amps when its input runs out of channels
+class survey {
+public:
+	enum survey_constants {
+		NUM_INPUTS = 3,
+		NUM_CH = tuner::TVCH_MAX - tuner::TVCH_MIN + 1,
+		AVG = 4,	// get_mse() reads averaged after sync lock
+	};
+	static const tuner::tuner_antennas input[NUM_INPUTS];
+
+	struct cell {
+		u8 status;	// every get_mse() status bit seen, 0 if never probed or no carrier
+		u32 eqmse;	// mean of AVG reads after sync lock, 0xfffff without sync
+		u16 sync_ms;	// ms from set_freq() to sync lock
+	};
+
+	survey() : mtx(0), next(0), n_tuners(0), cr_ms(0), lock_ms(0), elapsed_ms(0) { memset(cells, 0, sizeof(cells)); }
+
+	// run() uses both DT3305 of n tuners, which must already be open(). They are left with their amps off.
+	// cr_ms is how long to wait for carrier lock, lock_ms how long after that to wait for sync lock
+	int run(mpgts * list, unsigned n, unsigned cr_ms = 100, unsigned lock_ms = 600);
+
+	// print() is one line per channel, one column per input, and which input is best
+	void print(FILE * f) const;
+
+	const cell & get(unsigned tvch, unsigned in) const { return cells[in][tvch - tuner::TVCH_MIN]; }
+
+protected:
+	cell cells[NUM_INPUTS][NUM_CH];
+	void * mtx;		// protects next
+	unsigned next;		// next work item: item m is input m / NUM_CH, channel m % NUM_CH
+	unsigned n_tuners;
+	unsigned cr_ms, lock_ms;
+	unsigned long elapsed_ms;
+
+	struct worker;
+	static void * thread_wrapper(void * arg);
+	int work(mpgts * itm);
+	unsigned claim(unsigned * item, unsigned max);
+
+	// ranks cells like tuner::scan_antennas(): a later lock stage wins, then a lower eqmse. 0 if no carrier
+	static u32 score(const cell & c) { return c.status ? ((u32) c.status << 20) | (0xfffff - (c.eqmse & 0xfffff)) : 0; }
+};
+
+}
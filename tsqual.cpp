@@ -0,0 +1,67 @@
+/*
+Copyright (c) 2014 David Hubbard
+
+This program is free software: you can redistribute it and/or modify it under the terms of
+the GNU Affero General Public License version 3, as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License version 3 for more details.
+
+You should have received a copy of the GNU Affero General Public License version 3 along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+#include "iface.h"
+#include "tsqual.h"
+
+using namespace tuner_ns;
+
+void tsqual::reset()
+{
+	memset(b, 0, sizeof(b));
+	memset(&total, 0, sizeof(total));
+	memset(last_cc, CC_UNKNOWN, sizeof(last_cc));
+	tei_open = 0;
+	cur_id = 0;
+}
+
+void tsqual::roll(unsigned long id)
+{
+	// clear every bucket skipped over, a gap in the stream is a run of empty buckets
+	unsigned long n = id - cur_id;
+	if (id < cur_id || n > NUM_BUCKETS) n = NUM_BUCKETS;
+	// a pid that has not had a packet since the bucket before last is not going to match a TEI error to it.
+	// Null packets and packets with no payload never do
+	if (n > 1) tei_open = 0;
+	else if (tei_open > b[cur_id % NUM_BUCKETS].tei) tei_open = b[cur_id % NUM_BUCKETS].tei;
+	for (unsigned long i = 1; i <= n; i++) memset(&b[(id - n + i) % NUM_BUCKETS], 0, sizeof(b[0]));
+	cur_id = id;
+}
+
+int tsqual::get(unsigned long now, unsigned window_ms, tserr * out) const
+{
+	memset(out, 0, sizeof(*out));
+	if (window_ms > MAX_WINDOW_MS) {
+		fprintf(stderr, "tsqual::get(%u): max window is %u ms\n", window_ms, (unsigned) MAX_WINDOW_MS);
+		return 1;
+	}
+	unsigned long now_id = now/BUCKET_MS, id = cur_id;
+	unsigned long n = (window_ms + BUCKET_MS - 1)/BUCKET_MS;
+	if (!n) n = 1;
+
+	// buckets after id were never counted: nothing arrived
+	for (unsigned long i = 0; i < n; i++) {
+		if (now_id < i || now_id - i > id) continue;
+		if (id - (now_id - i) >= NUM_BUCKETS) break;
+		const tserr & e = b[(now_id - i) % NUM_BUCKETS];
+		out->pkts += e.pkts;
+		out->tei += e.tei;
+		out->cc += e.cc;
+		out->sync += e.sync;
+	}
+	return 0;
+}
@@ -0,0 +1,95 @@
+/*
+Copyright (c) 2014 David Hubbard
+
+This program is free software: you can redistribute it and/or modify it under the terms of
+the GNU Affero General Public License version 3, as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License version 3 for more details.
+
+You should have received a copy of the GNU Affero General Public License version 3 along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+namespace tuner_ns {
+
+// tserr counts transport stream errors
+struct tserr {
+	u32 pkts;	// every 188-byte packet received, including the bad ones
+	u32 tei;	// transport error indicator: the DT3305 could not correct the packet
+	u32 cc;		// continuity counter gaps: packets lost on the way or dropped by the DT3305
+			// (not a gap that only covers packets already counted in tei, see tsqual::pkt())
+	u32 sync;	// no 0x47 sync byte
+
+	u32 bad() const { return tei + cc + sync; }
+	// per_ppm() is an estimate of the packet error rate in parts per million: a cc gap may be several packets
+	u32 per_ppm() const { return pkts ? (u32) ((unsigned long long) bad()*1000000/pkts) : 1000000; }
+};
+
+// tsqual keeps tserr in BUCKET_MS buckets so any window up to MAX_WINDOW_MS can be read back. The demux thread
+// is the only writer and it never takes a lock: a reader on another thread may see a bucket that is being
+// counted or cleared, so a window can be off by part of a bucket
+class tsqual {
+public:
+	enum tsqual_constants {
+		BUCKET_MS = 100,
+		NUM_BUCKETS = 32,
+		MAX_WINDOW_MS = (NUM_BUCKETS - 1)*BUCKET_MS,	// the current bucket is still filling
+		NUM_PID = 0x2000,
+		CC_UNKNOWN = 0x10,
+	};
+
+	tsqual() { reset(); }
+
+	// reset() forgets everything, for a new channel. demux thread only
+	void reset();
+
+	// tick() moves to the bucket for mono_ms() now, once per datagram is enough. demux thread only
+	void tick(unsigned long ms) {
+		unsigned long id = ms/BUCKET_MS;
+		if (id != cur_id) roll(id);
+	}
+
+	// demux thread only: one call per packet
+	void sync_loss() { b[cur_id % NUM_BUCKETS].pkts++; b[cur_id % NUM_BUCKETS].sync++; total.pkts++; total.sync++; }
+	void tei() { b[cur_id % NUM_BUCKETS].pkts++; b[cur_id % NUM_BUCKETS].tei++; total.pkts++; total.tei++; tei_open++; }
+	void pkt(u32 pid, const u8 * p) {
+		tserr & e = b[cur_id % NUM_BUCKETS];
+		e.pkts++;
+		total.pkts++;
+		if (pid == 0x1fff || !(p[3] & 0x10)) return;	// null packets and packets with no payload have no cc
+		u8 cc = p[3] & 0x0f, last = last_cc[pid];
+		last_cc[pid] = cc;
+		if (last == CC_UNKNOWN || cc == last) return;	// first packet on this pid, or one duplicate
+		if ((p[3] & 0x20) && p[4] && (p[5] & 0x80)) return;	// discontinuity indicator
+		if (cc != ((last + 1) & 0x0f)) {
+			// a tei() packet has no pid to put it on, so its pid shows a gap later: the packets it already
+			// counted make up the gap first, so one TEI error is not counted twice in bad()
+			u32 missing = (cc - last - 1) & 0x0f;
+			if (missing <= tei_open) {
+				tei_open -= missing;
+				return;
+			}
+			tei_open = 0;
+			e.cc++;
+			total.cc++;
+		}
+	}
+
+	// get() sums the last window_ms (rounded up to whole buckets) before now. Returns 1 if window_ms is too big
+	int get(unsigned long now, unsigned window_ms, tserr * out) const;
+	const tserr & get_total() const { return total; }	// since reset()
+
+protected:
+	tserr b[NUM_BUCKETS];
+	tserr total;
+	volatile unsigned long cur_id;	// ms/BUCKET_MS of the bucket being counted
+	u8 last_cc[NUM_PID];
+	u32 tei_open;	// tei() packets not yet matched to a cc gap, only kept from this bucket and the one before
+
+	void roll(unsigned long id);
+};
+
+}
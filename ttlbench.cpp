@@ -0,0 +1,169 @@
+/*
+Copyright (c) 2014 David Hubbard
+
+This program is free software: you can redistribute it and/or modify it under the terms of
+the GNU Affero General Public License version 3, as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License version 3 for more details.
+
+You should have received a copy of the GNU Affero General Public License version 3 along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "mpgts.h"
+#include "ttlbench.h"
+
+using namespace tuner_ns;
+
+const char * const ttlbench::stage_name[NUM_STAGES] = {
+	"tuned", "carrier", "inlock", "sync", "snr", "fec",
+};
+
+static unsigned long mono_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long) ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+int ttlbench::run(mpgts * itm, unsigned n_ch_, const unsigned * chlist_, unsigned reps_, unsigned timeout_ms /*= 2000*/)
+{
+	if (n_ch_ < 2 || !reps_) {
+		fprintf(stderr, "ttlbench::run(): needs at least 2 channels (found %u) and 1 rep\n", n_ch_);
+		return 1;
+	}
+	free(us);
+	free(chlist);
+	n_ch = n_ch_;
+	reps = reps_;
+	us = (typeof(us)) malloc(sizeof(*us) * tuner::NUM_CHANNELS * n_ch * reps * NUM_STAGES);
+	chlist = (typeof(chlist)) malloc(sizeof(*chlist) * n_ch);
+	if (!us || !chlist) {
+		fprintf(stderr, "ttlbench::run(): malloc failed\n");
+		return 1;
+	}
+	memcpy(chlist, chlist_, sizeof(*chlist) * n_ch);
+	const u8 * m = itm->get_mac();
+	snprintf(mac, sizeof(mac), "%02x%02x%02x%02x%02x%02x", m[0], m[1], m[2], m[3], m[4], m[5]);
+
+	static const u8 stage_bit[NUM_STAGES] = { 0, 1, 2, 4, 8, 0x10 };
+	for (u8 d = 0; d < tuner::NUM_CHANNELS; d++) {
+		// the other DT3305 stays off so it does not share the amp and the control socket
+		for (u8 o = 0; o < tuner::NUM_CHANNELS; o++) if (o != d && itm->set_freq(o, (unsigned) -1)) return 1;
+
+		// one untimed pass first: AFC corrects the PLL at the first lock, that should not be measured
+		for (unsigned c = 0; c < n_ch; c++) {
+			if (itm->set_freq(d, chlist[c])) return 1;
+			unsigned long t0 = mono_ms();
+			u8 status = 0;
+			u32 ptmse, eqmse;
+			while (!(status & 4) && mono_ms() - t0 < timeout_ms)
+				if (itm->get_mse(d, &status, &ptmse, &eqmse)) return 1;
+			if (!(status & 4)) itm->lock_gave_up(d);
+		}
+
+		for (unsigned r = 0; r < reps; r++) for (unsigned c = 0; c < n_ch; c++) {
+			// progress goes to stderr so stdout is just the results
+			fprintf(stderr, "\r\e[K%s ttlbench demod %u: %u/%u", mac, d, r*n_ch + c, reps*n_ch);
+			for (unsigned st = 0; st < NUM_STAGES; st++) at(d, c, r, st) = MISS;
+
+			unsigned long t0 = mono_us();
+			if (itm->set_freq(d, chlist[c])) return 1;
+			at(d, c, r, tuned) = (u32) (mono_us() - t0);
+
+			// poll as fast as the control socket allows, each get_mse() is 1 - 3 round trips
+			u8 seen = 0;
+			unsigned long dt;
+			do {
+				u8 status;
+				u32 ptmse, eqmse;
+				if (itm->get_mse(d, &status, &ptmse, &eqmse)) return 1;
+				dt = mono_us() - t0;
+				for (unsigned st = carrier; st < NUM_STAGES; st++)
+					if ((status & stage_bit[st]) && !(seen & stage_bit[st])) at(d, c, r, st) = (u32) dt;
+				seen |= status;
+			} while ((seen & 0x1f) != 0x1f && dt < timeout_ms*1000LU);
+			if (!(seen & 4)) itm->lock_gave_up(d);
+		}
+	}
+	fprintf(stderr, "\r\e[K");
+	return itm->set_freq(tuner::NUM_CHANNELS - 1, (unsigned) -1);
+}
+
+static int cmp_u32(const void * a, const void * b)
+{
+	u32 x = *(const u32 *) a, y = *(const u32 *) b;
+	return x < y ? -1 : x > y;
+}
+
+int ttlbench::get_pct(unsigned d, unsigned c, unsigned st, pct * p) const
+{
+	unsigned d0 = d, d1 = d + 1, c0 = c, c1 = c + 1;
+	if (d == tuner::NUM_CHANNELS) { d0 = 0; d1 = tuner::NUM_CHANNELS; }
+	if (c == n_ch) { c0 = 0; c1 = n_ch; }
+
+	u32 * v = (typeof(v)) malloc(sizeof(*v) * (d1 - d0) * (c1 - c0) * reps);
+	if (!v) {
+		fprintf(stderr, "ttlbench::get_pct(): malloc failed\n");
+		return 1;
+	}
+	memset(p, 0, sizeof(*p));
+	for (unsigned i = d0; i < d1; i++) for (unsigned j = c0; j < c1; j++) for (unsigned r = 0; r < reps; r++) {
+		u32 x = at(i, j, r, st);
+		if (x == MISS) p->miss++;
+		else v[p->n++] = x;
+	}
+	if (p->n) {
+		qsort(v, p->n, sizeof(*v), cmp_u32);
+		// nearest rank
+		p->p50 = v[(p->n*50 + 99)/100 - 1];
+		p->p90 = v[(p->n*90 + 99)/100 - 1];
+		p->p99 = v[(p->n*99 + 99)/100 - 1];
+		p->max = v[p->n - 1];
+	}
+	free(v);
+	return 0;
+}
+
+void ttlbench::foreach_line(FILE * f, unsigned json, unsigned * first) const
+{
+	for (unsigned d = 0; d <= tuner::NUM_CHANNELS; d++) for (unsigned c = 0; c <= n_ch; c++)
+		for (unsigned st = 0; st < NUM_STAGES; st++)
+	{
+		pct p;
+		if (get_pct(d, c, st, &p)) return;
+		char dstr[8], cstr[8];
+		if (d == tuner::NUM_CHANNELS) strcpy(dstr, "all"); else snprintf(dstr, sizeof(dstr), "%u", d);
+		if (c == n_ch) strcpy(cstr, "all"); else snprintf(cstr, sizeof(cstr), "%u", chlist[c]);
+		if (json) {
+			fprintf(f, "%s\n  {\"tuner\": \"%s\", \"demod\": \"%s\", \"tvch\": \"%s\", \"stage\": \"%s\", "
+				"\"n\": %u, \"miss\": %u", *first ? "" : ",", mac, dstr, cstr, stage_name[st], p.n, p.miss);
+			if (p.n) fprintf(f, ", \"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f",
+				p.p50/1000.0, p.p90/1000.0, p.p99/1000.0, p.max/1000.0);
+			fprintf(f, "}");
+		} else {
+			fprintf(f, "%s,%s,%s,%s,%u,%u", mac, dstr, cstr, stage_name[st], p.n, p.miss);
+			if (p.n) fprintf(f, ",%.3f,%.3f,%.3f,%.3f\n", p.p50/1000.0, p.p90/1000.0, p.p99/1000.0, p.max/1000.0);
+			else fprintf(f, ",,,,\n");
+		}
+		*first = 0;
+	}
+}
+
+void ttlbench::print_csv(FILE * f, unsigned header) const
+{
+	if (header) fprintf(f, "tuner,demod,tvch,stage,n,miss,p50_ms,p90_ms,p99_ms,max_ms\n");
+	unsigned first = 1;
+	foreach_line(f, 0, &first);
+}
+
+void ttlbench::print_json(FILE * f, unsigned * first) const
+{
+	foreach_line(f, 1, first);
+}
@@ -0,0 +1,69 @@
+/*
+Copyright (c) 2014 David Hubbard
+
+This program is free software: you can redistribute it and/or modify it under the terms of
+the GNU Affero General Public License version 3, as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License version 3 for more details.
+
+You should have received a copy of the GNU Affero General Public License version 3 along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+namespace tuner_ns {
+
+// ttlbench measures time-to-lock: how long from calling set_freq() until each get_mse() status bit is set
+// every channel is tuned reps times on each DT3305, always coming from a different channel, and the
+// results are exact percentiles over all the tunes (not lathist buckets) so they can be compared run to run
+class ttlbench {
+public:
+	enum ttl_stage {
+		tuned = 0,	// set_freq() returned
+		carrier,	// get_mse() status & 1
+		inlock,		// status & 2
+		sync,		// status & 4
+		snr,		// status & 8: snr above tov
+		fec,		// status & 0x10: fec ok
+		NUM_STAGES
+	};
+	static const char * const stage_name[NUM_STAGES];
+
+	enum ttlbench_constants {
+		MISS = 0xffffffff,
+	};
+
+	ttlbench() : us(0), n_ch(0), chlist(0), reps(0) { mac[0] = 0; }
+	~ttlbench() { free(us); free(chlist); }
+
+	// run() uses the antenna already set on itm, timeout_ms is how long to wait for all stages
+	int run(mpgts * itm, unsigned n_ch_, const unsigned * chlist_, unsigned reps_, unsigned timeout_ms = 2000);
+
+	// one line per demod + channel + stage, plus demod "all" / channel "all" lines for each stage
+	// print_json() prints objects for a JSON array: the caller prints the [ ] so several tuners can share it,
+	//        *first must be 1 before the first call
+	void print_csv(FILE * f, unsigned header) const;
+	void print_json(FILE * f, unsigned * first) const;
+
+protected:
+	u32 * us;	// [demod][ch idx][rep][stage] microseconds from set_freq() or MISS
+	unsigned n_ch;
+	unsigned * chlist;
+	unsigned reps;
+	char mac[16];
+
+	u32 & at(unsigned d, unsigned c, unsigned r, unsigned st) const {
+		return us[((d*n_ch + c)*reps + r)*NUM_STAGES + st];
+	}
+
+	struct pct {
+		unsigned n, miss;
+		u32 p50, p90, p99, max;
+	};
+	// compute the percentiles of stage st of demod d (NUM_CHANNELS = all) and channel c (n_ch = all)
+	int get_pct(unsigned d, unsigned c, unsigned st, pct * p) const;
+	void foreach_line(FILE * f, unsigned json, unsigned * first) const;
+};
+
+}
@@ -65,27 +65,19 @@ int tuner::init()
 		return 1;
 	}
 
-	// VSB modulation for North American ATSC broadcast
+	// VSB modulation for North American ATSC broadcast, or QAM256 for cable (see set_plan())
 	for (v = 0; v < NUM_CHANNELS; v++) {
 		ch_state[v].i = vhf1;	// fake a value of vhf1 so set_amp() thinks there was a change
 		if (set_amp(v, off)) return 1;
-		if (set_modulation(v, VSB)) return 1;
+		if (verify_demod(v)) return 1;
+		ch_state[v].mode_valid = 0;	// the DT3305 may have been reset: always write the tables
+		if (set_modulation(v, plan == cable ? QAM256 : VSB)) return 1;
 	}
 	return 0;
 }
 
-struct demod_init8 {
-	u32 addr;
-	u8 val;
-};
-
-int tuner::set_modulation(u8 ch, tuner_operating_mode mode)
+int tuner::verify_demod(u8 ch)
 {
-	if (ch >= NUM_CHANNELS) {
-		fprintf(stderr, "tuner::set_modulation(%u, %u) invalid channel\n", ch, (unsigned) mode);
-		return 1;
-	}
-
 	u8 b;
 	// from linux kernel: verify it is really an lgdt3305
 	if (sock.get_demod8(ch, 1, &b)) return 1;
@@ -100,70 +92,144 @@ int tuner::set_modulation(u8 ch, tuner_operating_mode mode)
 		return 1;
 	}
 	if (sock.set_demod8(ch, 0x808, 0)) return 1;	// some undocumented BERT register?
+	return 0;
+}
+
+// a run of consecutive DT3305 registers, written with a single set_demodN()
+struct tuner::demod_burst {
+	u16 addr;
+	u8 len;
+	u8 val[5];
+};
+
+int tuner::write_bursts(u8 ch, const demod_burst * b, unsigned n, const char * name)
+{
+	for (unsigned i = 0; i < n; i++) {
+		if (sock.set_demodN(ch, b[i].addr, b[i].val, b[i].len)) {
+			fprintf(stderr, "set_demodN failed for ch=%u %s[%u]\n", ch, name, i);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int tuner::set_modulation(u8 ch, tuner_operating_mode mode)
+{
+	if (ch >= NUM_CHANNELS) {
+		fprintf(stderr, "tuner::set_modulation(%u, %u) invalid channel\n", ch, (unsigned) mode);
+		return 1;
+	}
+	if (ch_state[ch].mode_valid && ch_state[ch].mode == mode) return 0;
+
+	// each table is the register writes from the LG DT3305 app notes grouped into runs of consecutive
+	// addresses, so a whole table is 5 - 11 round trips instead of 27
+	static const demod_burst vsb1[] = {
+			{  0x0d, 2, { 0x63,	// enable digital SAW filter
+				      0x02 } },	// sync CCR (confidential count register)
+			{  0x12, 2, { 0x32, 0xc4 } },	// DAGCREF
+			{ 0x106, 4, { 0, 0, 0, 0 } },	// set IF, linux uses 0x4f0cacba unconditionally
+							// but the default (0) apparently matches the TUA6034 - uncertain
+			{ 0x112, 5, { 0x17,	// EPHNTH output threshold for PED control (VSB carrier recovery)
+				      0x15,	// GCONTH1 ave PED low threshold for PED control
+				      0x18,	// GCONTH2 ave PED mid threshold for PED control
+				      0xff,	// GCONTH3 ave PED hi threshold for PED control
+				      0x3c } },	// DMSELOWTH set threshold for demod_snr_low_resolution to 11dB
+			{ 0x214, 1, { 0x27 } },	// GSAUTOSL aka TRBW: do timing recovery at 1/2 bandwidth
+			{ 0x424, 1, { 0x8d } },	// CST_THD
+			{ 0x427, 2, { 0x12, 0x4f } },	// EQCON_THD
+			{ 0x302, 2, { 0x04, 0xc0 } },	// REFD set RF AGC loop delay, 12 bit signed value
+			{ 0x306, 4, { 0x80, 0x00,	// RF AGC loop filter bw
+				      0x80, 0x00 } },	// IFBW since LOCKDTEN=0, only high 4 bits (0xf0) set AGC loop bandwidth (8: 2^8 gain)
+							// if LOCKDTEN were 1, AGC lock detector would cycle through 4 steps starting with hi 4 bits
+			{ 0x30c, 3, { 0x31,	// AGC loop bandwidth (8x, no change); auto AGC ref (no change); set DC remover bandwidth 1/4x
+				      0x00,	// **added** make sure AGC loops are enabled
+				      0x1c } },	// turn off IN_AGC_BY (enable inner AGC loop); disable NSEN (no signal detector for QAM)
+			{ 0x314, 1, { 0xe1 } },	// turn off LOCKDTEN to finally disable all QAM circuits
+		};
 
+	// QAM values are from the linux lgdt3305 driver, which has only been tested with other tuners - uncertain
+	static const demod_burst qam64_agc[] = {
+			{  0x12, 2, { 0x2a, 0x00 } },	// DAGCREF for QAM64
+		};
+	static const demod_burst qam256_agc[] = {
+			{  0x12, 2, { 0x2a, 0x80 } },	// DAGCREF for QAM256
+		};
+	static const demod_burst qam1[] = {
+			{ 0x106, 4, { 0, 0, 0, 0 } },	// set IF, same as VSB
+			{ 0x302, 2, { 0x04, 0x6b } },	// REFD RF AGC loop delay for QAM
+			{ 0x306, 4, { 0x88, 0x89,	// RF AGC loop filter bw
+				      0x88, 0x88 } },	// IFBW: with LOCKDTEN=1 the AGC lock detector steps through 4 bandwidths
+			{ 0x30c, 3, { 0x31, 0x00, 0x1c } },	// same AGC loop and DC remover setup as VSB
+			{ 0x314, 1, { 0xe3 } },	// 0xe1 | LOCKDTEN (bit 1), as the driver does: QAM circuits enabled
+		};
+
+	u8 b;
 	if (sock.get_demod8(ch, 0, &b)) return 1;
 	b &= ~3;
 	b |= (u8) mode;
 	if (sock.set_demod8(ch, 0, b)) return 1;
 
-	// TODO: optimize this
-	// writes to consecutive addresses can be grouped
-	static const demod_init8 vsb1[] = {
-			{  0x0d, 0x63 },	// enable digital SAW filter
-			{  0x0e, 0x02 },	// sync CCR (confidential count register)
-			{  0x12, 0x32 },	// DAGCREF (2 bytes)
-			{  0x13, 0xc4 },	//         (2 bytes)
-			{ 0x106, 0 },	// set IF, linux uses 0x4f0cacba unconditionally
-			{ 0x107, 0 },	// but the default (0) apparently matches the TUA6034 - uncertain
-			{ 0x108, 0 },	//
-			{ 0x109, 0 },	//
-			{ 0x112, 0x17 },	// EPHNTH output threshold for PED control (VSB carrier recovery)
-			{ 0x113, 0x15 },	// GCONTH1 ave PED low threshold for PED control
-			{ 0x114, 0x18 },	// GCONTH2 ave PED mid threshold for PED control
-			{ 0x115, 0xff },	// GCONTH3 ave PED hi threshold for PED control
-			{ 0x116, 0x3c },	// DMSELOWTH set threshold for demod_snr_low_resolution to 11dB
-			{ 0x214, 0x27 },	// GSAUTOSL aka TRBW: do timing recovery at 1/2 bandwidth
-			{ 0x424, 0x8d },	// CST_THD
-			{ 0x427, 0x12 },	// EQCON_THD (2 bytes)
-			{ 0x428, 0x4f },	//           (2 bytes)
-			{ 0x302, 0x04 },	// REFD (2 bytes) set RF AGC loop delay, 12 bit signed value
-			{ 0x303, 0xc0 },	//      (2 bytes)
-			{ 0x306, 0x80 },	// RF AGC loop filter bw
-			{ 0x307, 0x00 },	//
-			{ 0x308, 0x80 },	// IFBW (2 bytes) since LOCKDTEN=0, only high 4 bits (0xf0) set AGC loop bandwidth (8: 2^8 gain)
-			{ 0x309, 0x00 },	//      (2 bytes) if LOCKDTEN were 1, AGC lock detector would cycle through 4 steps starting with hi 4 bits
-			{ 0x30c, 0x31 },	// AGC loop bandwidth (8x, no change); auto AGC ref (no change); set DC remover bandwidth 1/4x
-			{ 0x30d, 0x00 },	// **added** make sure AGC loops are enabled
-			{ 0x30e, 0x1c },	// turn off IN_AGC_BY (enable inner AGC loop); disable NSEN (no signal detector for QAM)
-			{ 0x314, 0xe1 },	// turn off LOCKDTEN to finally disable all QAM circuits
-		};
-
-	unsigned i;
 	switch (mode) {
 	case VSB:
-		for (i = 0; i < sizeof(vsb1)/sizeof(vsb1[0]); i++) {
-			if (sock.set_demod8(ch, vsb1[i].addr, vsb1[i].val)) {
-				fprintf(stderr, "set_demod8 failed for ch=%u vsb1[%u]\n", ch, i);
-				return 1;
-			}
-		}
-		if (sock.reset_demod(ch, 20)) return 1;
-		if (sock.get_demod8(ch, 0x50e, &b)) {	// 0x50e: transport interface
-			fprintf(stderr, "get_demod8 failed for ch=%u MPEGserial\n", ch);
-			return 1;
-		}
-		b |= 0x20;	// configure serial output, bits are sent serially to Ubicom CPU on TPDATA0 line
-		if (sock.set_demod8(ch, 0x50e, b)) {
-			fprintf(stderr, "set_demod8 failed for ch=%u MPEGserial\n", ch);
-			return 1;
-		}
-		if (sock.reset_demod(ch, 20)) return 1;
+		if (write_bursts(ch, vsb1, sizeof(vsb1)/sizeof(vsb1[0]), "vsb1")) return 1;
+		break;
+
+	case QAM64:
+		if (write_bursts(ch, qam64_agc, sizeof(qam64_agc)/sizeof(qam64_agc[0]), "qam64_agc")) return 1;
+		if (write_bursts(ch, qam1, sizeof(qam1)/sizeof(qam1[0]), "qam1")) return 1;
+		break;
+
+	case QAM256:
+		if (write_bursts(ch, qam256_agc, sizeof(qam256_agc)/sizeof(qam256_agc[0]), "qam256_agc")) return 1;
+		if (write_bursts(ch, qam1, sizeof(qam1)/sizeof(qam1[0]), "qam1")) return 1;
 		break;
 
 	default:
 		fprintf(stderr, "tuner::set_modulation(%u) not implemented yet\n", (unsigned) mode);
-		break;
+		return 1;
 	}
+
+	if (sock.reset_demod(ch, 20)) return 1;
+	if (sock.get_demod8(ch, 0x50e, &b)) {	// 0x50e: transport interface
+		fprintf(stderr, "get_demod8 failed for ch=%u MPEGserial\n", ch);
+		return 1;
+	}
+	b |= 0x20;	// configure serial output, bits are sent serially to Ubicom CPU on TPDATA0 line
+	if (sock.set_demod8(ch, 0x50e, b)) {
+		fprintf(stderr, "set_demod8 failed for ch=%u MPEGserial\n", ch);
+		return 1;
+	}
+	if (sock.reset_demod(ch, 20)) return 1;
+	ch_state[ch].mode = mode;
+	ch_state[ch].mode_valid = 1;
+	return 0;
+}
+
+int tuner::set_plan(tuner_plan p)
+{
+	if (p != air && p != cable) {
+		fprintf(stderr, "tuner::set_plan(%u) invalid\n", (unsigned) p);
+		return 1;
+	}
+	if (p == plan) return 0;
+
+	unsigned i;
+	for (i = 0; i < NUM_CHANNELS; i++) {
+		if (set_amp(i, off)) return 1;
+		ch_state[i].tvch = (unsigned) -1;
+		lt_wait[i] = 0;
+		afc_state[i].wait = 0;
+	}
+	plan = p;
+
+	// per-channel state means something else in the other plan: channel 20 is 509 MHz over the air
+	// but 159 MHz on cable
+	for (i = 0; i < TVCH_SLOTS; i++) {
+		ch_ant[i] = nc;
+		afc[i] = 0;
+		ch_qam[i] = QAM256;
+	}
+	for (i = 0; i < NUM_CHANNELS; i++) if (set_modulation(i, p == cable ? QAM256 : VSB)) return 1;
 	return 0;
 }
 
@@ -194,7 +260,7 @@ int tuner::set_amp(u8 ch, tuner_amp_input state)
 			0,	// external
 		};
 	unsigned i;
-	for (i = 0; i < NUM_CHANNELS; i++) cur_gpio |= update[i];
+	for (i = 0; i < NUM_CHANNELS; i++) cur_gpio |= amp_gpio[update[i]];
 
 	// configure tuner filter
 	static const u32 filter_ch0[] = {
@@ -251,6 +317,7 @@ int tuner::set_antenna(tuner_antennas ant)
 			if (set_amp(ch, off)) return 1;
 			continue;
 		}
+		if (get_ch_antenna(ch_state[ch].tvch) != nc) continue;	// the channel's own antenna wins
 		if (ant == coax) {
 			if (set_amp(ch, external)) return 1;
 			continue;
@@ -263,7 +330,7 @@ int tuner::set_antenna(tuner_antennas ant)
 
 		if (ant == ant2) tai = (tuner_amp_input) ((u32) tai + 1);
 
-		if (ch_state[ch].tvch < TVCH_MIN || ch_state[ch].tvch > TVCH_MAX) {
+		if (ch_state[ch].tvch < TVCH_MIN || ch_state[ch].tvch > tvch_max()) {
 			fprintf(stderr, "tuner::set_antenna(%u) Warn: ch=%u has tvch=%x, amp cannot be set\n", ant, ch, ch_state[ch].tvch);
 		} else {
 			if (set_amp(ch, tai)) return 1;
@@ -274,44 +341,114 @@ int tuner::set_antenna(tuner_antennas ant)
 
 int tuner::set_freq(u8 ch, unsigned tvch, unsigned reset_ms /*= 20*/)
 {
-	if (ch >= NUM_CHANNELS || ((tvch < TVCH_MIN || tvch > TVCH_MAX) && tvch != (unsigned) -1)) {
-		fprintf(stderr, "tuner::set_freq(%u, %u) invalid\n", ch, tvch);
-		return 1;
+	if (tvch >= TVCH_MIN && tvch <= tvch_max() && ch_ant[tvch - TVCH_MIN] != nc) {
+		// this channel has its own antenna, see scan_antennas()
+		return set_freq_ant(ch, tvch, ch_ant[tvch - TVCH_MIN], reset_ms);
 	}
 	if (active_ant == nc) {
 		fprintf(stderr, "tuner::set_freq(%u, %u) cannot be called before set_antenna()\n", ch, tvch);
 		return 1;
 	}
+	return set_freq_ant(ch, tvch, active_ant, reset_ms);
+}
+
+// North American cable channel plan (EIA-542 STD), channel centers in MHz
+// channels 95 - 99 sit between broadcast 6 and FM, 14 - 22 between FM and broadcast 7
+static u32 catv_freq(unsigned tvch)
+{
+	if (tvch < 2) return 0;
+	if (tvch <= 4) return 57 + 6*(tvch - 2);
+	if (tvch <= 6) return 79 + 6*(tvch - 5);
+	if (tvch <= 13) return 177 + 6*(tvch - 7);
+	if (tvch <= 22) return 123 + 6*(tvch - 14);
+	if (tvch <= 36) return 219 + 6*(tvch - 23);
+	if (tvch <= 94) return 303 + 6*(tvch - 37);
+	if (tvch <= 99) return 93 + 6*(tvch - 95);
+	if (tvch <= 135) return 651 + 6*(tvch - 100);
+	return 0;
+}
+
+u32 tuner::get_ch_freq(unsigned tvch) const
+{
+	if (tvch < TVCH_MIN || tvch > tvch_max()) return 0;
+	if (plan == cable) return catv_freq(tvch);
+	return ch_freq[tvch - TVCH_MIN];
+}
+
+// TUA6034 band select, returns -1 if freq is out of range
+static int tua6034_band(u32 freq, u8 * bandswitch)
+{
+	if (freq < 158 /*MHz*/) {
+		*bandswitch = 1 << 0;	// vhf low band: P0 turns on a GPIO + vhf filter, see datasheet
+		return 0;
+	} else if (freq < 452 /*MHz*/) {
+		*bandswitch = 1 << 1;	// vhf hi band: P1 turns on a GPIO + vhf filter, see datasheet
+		return 0;
+	} else if (freq < 862 /*MHz*/) {
+		*bandswitch = 1 << 2;	// uhf band: P2 turns on a GPIO (choosing P3 kills all uhf reception)
+		return 1;
+	}
+	return -1;
+}
+
+int tuner::set_freq_ant(u8 ch, unsigned tvch, tuner_antennas ant, unsigned reset_ms)
+{
+	if (ch >= NUM_CHANNELS || ((tvch < TVCH_MIN || tvch > tvch_max()) && tvch != (unsigned) -1) || ant == nc) {
+		fprintf(stderr, "tuner::set_freq(%u, %u) invalid\n", ch, tvch);
+		return 1;
+	}
 	if (tvch == (unsigned) -1) return set_amp(ch, off);
-	if (!ch_freq[tvch - TVCH_MIN]) {
+	u32 freq = get_ch_freq(tvch);
+	if (!freq) {
 		fprintf(stderr, "tuner::set_freq(%u, %u) LOGIC ERROR: ch_freq=0\n", ch, tvch);
 		return 1;
 	}
-
-	u32 freq = ch_freq[tvch];
 	tuner_amp_input tai;
 	u8 bandswitch;
-	if (freq < 158 /*MHz*/) {
-		bandswitch = 1 << 0;	// vhf low band: P0 turns on a GPIO + vhf filter, see datasheet
-		tai = vhf1;
-	} else if (freq < 452 /*MHz*/) {
-		bandswitch = 1 << 1;	// vhf hi band: P1 turns on a GPIO + vhf filter, see datasheet
-		tai = vhf1;
-	} else if (freq < 862 /*MHz*/) {
-		bandswitch = 1 << 2;	// uhf band: P2 turns on a GPIO (choosing P3 kills all uhf reception)
-		tai = uhf1;
-	} else {
+	switch (tua6034_band(freq, &bandswitch)) {
+	case 0: tai = vhf1; break;
+	case 1: tai = uhf1; break;
+	default:
 		fprintf(stderr, "tuner::set_freq(%u, %u): %u MHz is out of range\n", ch, tvch, freq);
 		return 1;
 	}
-	if (active_ant == ant2) tai = (tuner_amp_input) ((u32) tai + 1);
-	else if (active_ant == coax) tai = external;
+	if (ant == ant2) tai = (tuner_amp_input) ((u32) tai + 1);
+	else if (ant == coax) tai = external;
 
 	if (set_amp(ch, tai)) return 1;
 
+	// cable channels are not all the same QAM: switch before tuning, set_modulation() resets the DT3305 anyway
+	if (plan == cable && set_modulation(ch, get_ch_modulation(tvch))) return 1;
+
+	lt_wait[ch] = 0;	// in case write_pll() or reset_demod() fails
+	afc_state[ch].wait = 0;
+	if (write_pll(ch, tvch)) {
+		if (set_amp(ch, off)) fprintf(stderr, "tuner::set_freq(%u, %u) failed to disable amp after fault\n", ch, tvch);
+		return 1;
+	}
+	t_tune[ch] = mono_ms();
+	if (reset_ms) {
+		if (sock.reset_demod(ch, reset_ms)) return 1;
+	}
+	ch_state[ch].tvch = tvch;
+	lt_wait[ch] = (1 << locktime::carrier) | (1 << locktime::sync);
+	afc_state[ch].wait = afc_on && plan == air ? 1 : 0;	// cable headends do not drift, and afc_check() is VSB only
+	return 0;
+}
+
+int tuner::write_pll(u8 ch, unsigned tvch)
+{
+	u32 freq = get_ch_freq(tvch);
+	u8 bandswitch;
+	if (tua6034_band(freq, &bandswitch) < 0) {
+		fprintf(stderr, "tuner::write_pll(%u, %u): %u MHz is out of range\n", ch, tvch, freq);
+		return 1;
+	}
+
 	// freq is in MHz - need a PLL setting in units of 62.5kHz (1/16 MHz)
 	// so multiply pll * 16 or d << 4 to get PLL setting
-	u32 pll = (freq << 4) + 704;
+	// afc[] moves it by whole 62.5kHz steps for a transmitter that is off frequency, see afc_check()
+	u32 pll = (freq << 4) + 704 + afc[tvch - TVCH_MIN];
 
 	// LG Infineon TUA6034 3-Band Digital TV Tuner IC "TAIFUN"
 	u8 pkt[] = {
@@ -326,17 +463,232 @@ int tuner::set_freq(u8 ch, unsigned tvch, unsigned reset_ms /*= 20*/)
 	size_t rxlen = 8;
 	u8 * rx = sock.write_then_read(pkt, sizeof(pkt), &rxlen);
 	if (!rx) return 1;
+	free(rx);
 	if (rxlen != 4) {
 		fprintf(stderr, "tuner::set_freq(%u, %u) write fault\n", ch, tvch);
-		if (set_amp(ch, off)) fprintf(stderr, "tuner::set_freq(%u, %u) failed to disable amp after fault\n", ch, tvch);
 		return 1;
 	}
+	return 0;
+}
+
+// carrier recovery frequency offset scale - uncertain:
+// register 0x118 appears to be 24-bit two's complement where full scale is the 25MHz sample clock
+#define CR_OFFSET_FULL_SCALE_HZ (25000000LL)
+#define PLL_STEP_HZ (62500)
+#define AFC_MAX_STEPS (4)	// never move the PLL more than +/- 250kHz from nominal
+
+int tuner::get_cr_offset(u8 ch, int * hz)
+{
+	if (ch >= NUM_CHANNELS) {
+		fprintf(stderr, "tuner::get_cr_offset(%u) invalid channel\n", ch);
+		return 1;
+	}
+	u32 v;
+	if (sock.get_demod24(ch, 0x118, &v)) return 1;
+	int ofs = (int) (v << 8) >> 8;	// sign extend
+	*hz = (int) (ofs * CR_OFFSET_FULL_SCALE_HZ / (1 << 24));
+	return 0;
+}
+
+int tuner::afc_check(u8 ch)
+{
+	afc_st & st = afc_state[ch];
+	unsigned tvch = ch_state[ch].tvch;
+	if (tvch < TVCH_MIN || tvch > tvch_max()) {
+		st.wait = 0;
+		return 0;
+	}
+	signed char & a = afc[tvch - TVCH_MIN];
+
+	int hz;
+	if (get_cr_offset(ch, &hz)) return 1;
+	int mag = hz < 0 ? -hz : hz;
+
+	if (st.wait == 2) {
+		// this is the first lock after a correction: keep it only if the offset got smaller
+		st.wait = 0;
+		int prev = st.hz < 0 ? -st.hz : st.hz;
+		if (mag < prev) return 0;
+
+		// the sign of 0x118 is not known for sure, so a correction that made things worse means
+		// afc_dir is backwards: undo the correction and flip afc_dir for next time
+		a -= st.steps;
+		afc_dir = -afc_dir;
+		if (write_pll(ch, tvch)) return 1;
+		return sock.reset_demod(ch, 20);
+	}
+	st.wait = 0;
+
+	// smaller offsets are left to the DT3305 carrier recovery
+	if (mag < PLL_STEP_HZ*3/4) return 0;
+
+	int steps = (mag + PLL_STEP_HZ/2)/PLL_STEP_HZ;
+	if (hz < 0) steps = -steps;
+	steps *= afc_dir;
+	int n = a + steps;
+	if (n > AFC_MAX_STEPS) n = AFC_MAX_STEPS;
+	else if (n < -AFC_MAX_STEPS) n = -AFC_MAX_STEPS;
+	if (n == a) return 0;
+
+	st.steps = n - a;
+	st.hz = hz;
+	st.wait = 2;
+	a = n;
+	if (write_pll(ch, tvch)) return 1;
+	return sock.reset_demod(ch, 20);
+}
+
+tuner::tuner_antennas tuner::cur_antenna(u8 ch) const
+{
+	switch (ch_state[ch].i) {
+	case vhf1: case uhf1: return ant1;
+	case vhf2: case uhf2: return ant2;
+	case external: return coax;
+	default: return nc;
+	}
+}
+
+void tuner::lt_observe(u8 ch, u8 status)
+{
+	if (ch >= NUM_CHANNELS || !lt_wait[ch]) return;
+	unsigned long ms = mono_ms() - t_tune[ch];
+	if (ms > 5000) {
+		// nobody was watching: a sample this late only says when someone looked
+		lt_wait[ch] = 0;
+		return;
+	}
+	if ((lt_wait[ch] & (1 << locktime::carrier)) && (status & 1)) {
+		lt.add(ch_state[ch].tvch, cur_antenna(ch), locktime::carrier, ms);
+		lt_wait[ch] &= ~(1 << locktime::carrier);
+	}
+	if ((lt_wait[ch] & (1 << locktime::sync)) && (status & 4)) {
+		lt.add(ch_state[ch].tvch, cur_antenna(ch), locktime::sync, ms);
+		lt_wait[ch] &= ~(1 << locktime::sync);
+	}
+}
+
+void tuner::lock_gave_up(u8 ch)
+{
+	if (ch >= NUM_CHANNELS) return;
+	for (unsigned st = 0; st < locktime::NUM_STAGES; st++) if (lt_wait[ch] & (1 << st))
+		lt.miss(ch_state[ch].tvch, cur_antenna(ch), (locktime::lock_stage) st);
+	lt_wait[ch] = 0;
+}
+
+unsigned tuner::lock_timeout(unsigned tvch, locktime::lock_stage st, unsigned dflt_ms) const
+{
+	tuner_antennas ant = get_ch_antenna(tvch);
+	if (ant == nc) ant = active_ant;
+	unsigned ms = lt.timeout(tvch, ant, st);
+	return ms ? ms : dflt_ms;
+}
+
+int tuner::get_tuner_status(u8 ch, u8 * status)
+{
+	if (ch >= NUM_CHANNELS) {
+		fprintf(stderr, "tuner::get_tuner_status(%u) invalid channel\n", ch);
+		return 1;
+	}
+
+	// LG Infineon TUA6034 status byte:
+	// 0x80 POR (power on reset), 0x40 FL (PLL locked), 0x08 AGC (RF AGC is active: strong signal at the input)
+	// 0x07 A2-A0 (ADC pin) - uncertain if the sezmi even connects the ADC pin
+	u8 pkt[] = {
+			0,0,0,0,	// header
+			ch, 0xc3,	// Tuner i2c address (ch*256 + 0xc2), read (| 1)
+			1,		// read 1 byte
+			0,0,0,0,	// CRC
+		};
+	size_t rxlen = 1;
+	u8 * rx = sock.write_then_read(pkt, sizeof(pkt), &rxlen);
+	if (!rx) return 1;
+	if (rxlen != 1 + 4) {
+		fprintf(stderr, "tuner::get_tuner_status(%u) fault: %zu\n", ch, rxlen);
+		free(rx);
+		return 1;
+	}
+	*status = rx[4];
 	free(rx);
-	if (reset_ms) {
-		if (sock.reset_demod(ch, reset_ms)) return 1;
+	return 0;
+}
+
+int tuner::detect_antenna(tuner_antennas * best, unsigned cr_ms /*= 20*/)
+{
+	// likely channels: after the 2009 transition and the 2017 repack most stations are VHF-hi or low UHF
+	static const unsigned probe[] = { 7, 9, 11, 13, 14, 17, 20, 23, 26, 29, 32, 35 };
+	static const unsigned n_probe = sizeof(probe)/sizeof(probe[0]);
+	static const tuner_antennas ant_list[] = { ant1, ant2, coax };
+	static const unsigned n_ant = sizeof(ant_list)/sizeof(ant_list[0]);
+
+	*best = nc;
+	if (plan != air) {
+		fprintf(stderr, "tuner::detect_antenna: only for the broadcast plan, cable is always coax\n");
+		return 1;
+	}
+	if (ch_state[0].i != off || ch_state[1].i != off) {
+		fprintf(stderr, "tuner::detect_antenna: channel amps are not off: %u %u\n", ch_state[0].i, ch_state[1].i);
+		return 1;
+	}
+	if (cr_ms < 20) cr_ms = 20;	// must spend at least 20ms to correctly detect antenna
+
+	struct {
+		unsigned locks, agc, tried;
+	} score[n_ant];
+	memset(score, 0, sizeof(score));
+
+	// each DT3305 has its own filter GPIOs, and the amp GPIOs are the union of what both need, so
+	// both DT3305 can be tuned to different antennas at the same time. Work item m probes
+	// ant_list[m % n_ant] so consecutive items (one per DT3305) always land on different antennas.
+	unsigned use_agc = 1;
+	unsigned m, j;
+	for (m = 0; m < n_probe*n_ant; m += NUM_CHANNELS) {
+		for (j = 0; j < NUM_CHANNELS && m + j < n_probe*n_ant; j++) {
+			if (set_freq_ant(j, probe[(m + j) / n_ant], ant_list[(m + j) % n_ant], cr_ms <= 20 ? cr_ms : 0)) goto fail;
+		}
+		if (cr_ms > 20) usleep((cr_ms - 20) * 1000);
+
+		for (j = 0; j < NUM_CHANNELS && m + j < n_probe*n_ant; j++) {
+			unsigned a = (m + j) % n_ant;
+			u8 b;
+			if (sock.get_demod8(j, 0x11d, &b)) goto fail;	// carrier recovery lock
+			score[a].tried++;
+			if (b & 0x80) score[a].locks++;
+			if (use_agc) {
+				// RF AGC only breaks ties, so a tuner that cannot read the TUA6034 just skips it
+				if (get_tuner_status(j, &b)) use_agc = 0;
+				else if (b & 0x08) score[a].agc++;
+			}
+		}
+
+		// stop early once no other antenna can catch up with the leader
+		unsigned lead = 0, a;
+		for (a = 1; a < n_ant; a++) if (score[a].locks > score[lead].locks) lead = a;
+		for (a = 0; a < n_ant; a++) {
+			if (a == lead) continue;
+			if (score[a].locks + (n_probe - score[a].tried) >= score[lead].locks) break;
+		}
+		if (a >= n_ant) break;
+	}
+
+	for (j = 0; j < NUM_CHANNELS; j++) if (set_amp(j, off)) return 1;
+
+	{
+		unsigned a, pick = 0;
+		for (a = 1; a < n_ant; a++) {
+			if (score[a].locks > score[pick].locks ||
+				(score[a].locks == score[pick].locks && score[a].agc > score[pick].agc))
+			{
+				pick = a;
+			}
+		}
+		// nc means nothing was found, the caller will have to fall back to a full scan on each antenna
+		if (score[pick].locks) *best = ant_list[pick];
 	}
-	ch_state[ch].tvch = tvch;
 	return 0;
+
+fail:
+	for (j = 0; j < NUM_CHANNELS; j++) set_amp(j, off);
+	return 1;
 }
 
 static int tuner_scan_cmp(const void * p1, const void * p2)
@@ -345,16 +697,20 @@ static int tuner_scan_cmp(const void * p1, const void * p2)
 }
 
 #define CH_STEP (2)
-static void tuner_scan_call_cb(tuner::scan_cb cb, void * ctx, unsigned i, tuner::tuner_antennas ant,
+static void tuner_scan_call_cb(tuner::scan_cb cb, void * ctx, unsigned i, unsigned step, tuner::tuner_antennas ant,
 	unsigned ant_valid, unsigned find_use, unsigned * find)
 {
 	if (!cb) return;
-	static const unsigned n_ch_freq = (sizeof(tuner::ch_freq)/sizeof(tuner::ch_freq[0]) + 1)/CH_STEP;
+	static const unsigned n_freq = sizeof(tuner::ch_freq)/sizeof(tuner::ch_freq[0]);
+
+	// step is CH_STEP * the number of DT3305 doing the scan
+	const unsigned n_even = (n_freq + step - 1)/step;
+	const unsigned n_ch_freq = n_even + (n_freq - 1 + step - 1)/step - 1;
 
 	// i goes 1,5,9 (odds) then 2,6,10 (evens) - convert that to a sequential count
 	if (i) {
 		i--;
-		i = i/(2*CH_STEP) + (i & 1)*((n_ch_freq + 1)/2);
+		i = i/step + (i & 1)*n_even;
 		i++;
 	}
 
@@ -364,7 +720,7 @@ static void tuner_scan_call_cb(tuner::scan_cb cb, void * ctx, unsigned i, tuner:
 		if (find_use >= 3) {
 			// found channels, interpolate progress for the rest of the scan
 			unsigned found_i = find[find_use - 1];
-			found_i = found_i/(2*CH_STEP) + (found_i & 1)*((n_ch_freq + 1)/2);
+			found_i = found_i/step + (found_i & 1)*n_even;
 
 			unsigned found_i3 = found_i;
 			if (ant == tuner::ant2) found_i3 += n_ch_freq;
@@ -380,69 +736,120 @@ static void tuner_scan_call_cb(tuner::scan_cb cb, void * ctx, unsigned i, tuner:
 	cb(ctx, i, max + 1);
 }
 
-int tuner::scan(unsigned * n_ch, unsigned ** chlist, scan_cb cb /*= 0*/, void * ctx /*= 0*/, unsigned cr_ms /*= 20*/)
+int tuner::scan(unsigned * n_ch, unsigned ** chlist, scan_cb cb /*= 0*/, void * ctx /*= 0*/, unsigned cr_ms /*= 20*/,
+	u32 ch_mask /*= SCAN_ALL*/)
 {
+	if (plan == cable) return scan_cable(n_ch, chlist, cb, ctx, cr_ms, ch_mask);
+
+	// dl[] lists the DT3305 that scan() may use, any others are left completely alone
+	u8 dl[NUM_CHANNELS];
+	unsigned dl_use = 0, j;
+	for (j = 0; j < NUM_CHANNELS; j++) if (ch_mask & (1 << j)) dl[dl_use++] = j;
+	if (!dl_use || (ch_mask & ~SCAN_ALL)) {
+		fprintf(stderr, "tuner::scan: ch_mask %x invalid\n", ch_mask);
+		return 1;
+	}
+
 	unsigned ant_valid;
 	if (get_antenna() == nc) {
+		// switching antennas would disturb any DT3305 not in ch_mask
+		if (dl_use != NUM_CHANNELS) {
+			fprintf(stderr, "tuner::scan(ch_mask=%x) must call set_antenna() first\n", ch_mask);
+			return 1;
+		}
 		ant_valid = 0;	// temporary antenna
 		if (ch_state[0].i != off || ch_state[1].i != off) {
 			fprintf(stderr, "tuner::scan: channel amps are not off: %u %u\n", ch_state[0].i, ch_state[1].i);
 			return 1;
 		}
-		if (set_antenna(ant1)) return 1;
 		if (cr_ms < 20) cr_ms = 20;	// must spen at least 20ms to correctly detect antenna
+
+		// probe a few likely channels on all antennas first, that is much faster than a full scan per antenna
+		tuner_antennas ant;
+		if (detect_antenna(&ant, cr_ms)) return 1;
+		if (ant != nc) {
+			ant_valid = 1;
+		} else {
+			ant = ant1;	// nothing found: fall back to trying each antenna in turn
+		}
+		if (set_antenna(ant)) return 1;
 	} else {
 		ant_valid = 1;	// do not change antennas
 	}
 
 	static const unsigned n_ch_freq = sizeof(ch_freq)/sizeof(ch_freq[0]);
+	const unsigned step = dl_use*CH_STEP;
 	unsigned find_use = 0;
 	unsigned * find = (typeof(find)) malloc(sizeof(*find) * n_ch_freq);
 	if (!find) {
 		fprintf(stderr, "tuner::scan: malloc failed\n");
 		return 1;
 	}
-	tuner_scan_call_cb(cb, ctx, 0, get_antenna(), ant_valid, find_use, find);
+	tuner_scan_call_cb(cb, ctx, 0, step, get_antenna(), ant_valid, find_use, find);
 
-	// register 0x12a is not documented but the LG DT3305 example and app notes both suggest
-	// clearing bit 0x20 to disable the DT3305 frequency modulation
-	// this isolates carrier recovery for a more accurate result
-	unsigned i, j;
+	unsigned i, k;
 	u8 old12a[NUM_CHANNELS];
-	for (j = 0; j < NUM_CHANNELS; j++) {
-		if (sock.get_demod8(j, 0x12a, &old12a[j]) ||
-			sock.set_demod8(j, 0x12a, old12a[j] & ~0x20))
-		{
-			free(find);
-			return 1;
-		}
+	if (cr_isolate(ch_mask, old12a)) {
+		free(find);
+		return 1;
 	}
 
 	for (;;) {
 		// scan in parallel
-		for (i = 0;; i += NUM_CHANNELS*2) {
+		for (i = 0;; i += step) {
 			if (i >= n_ch_freq) {		// scan channels interleaved (CH_STEP): first evens, then odds
 				if (i & 1) break;	// i is odd, done scanning ... but results still need to be sorted
 				i = 1;			// i is even, restart with odds
+				if (i >= n_ch_freq) break;
 			}
 
-			tuner_scan_call_cb(cb, ctx, i + 1, get_antenna(), ant_valid, find_use, find);
-			for (j = 0; j < NUM_CHANNELS; j++) if (i + j*CH_STEP < n_ch_freq) {
-				if (!ch_freq[i + j*CH_STEP]) {
-					fprintf(stderr, "tuner::scan() i=%u got freq=0\n", i + j*CH_STEP);
+			tuner_scan_call_cb(cb, ctx, i + 1, step, get_antenna(), ant_valid, find_use, find);
+			for (k = 0; k < dl_use; k++) if (i + k*CH_STEP < n_ch_freq) {
+				j = dl[k];
+				if (!ch_freq[i + k*CH_STEP]) {
+					fprintf(stderr, "tuner::scan() i=%u got freq=0\n", i + k*CH_STEP);
 					continue;
 				}
 
-				if (set_freq(j, i + j*CH_STEP + TVCH_MIN, cr_ms <= 20 ? cr_ms : 0)) goto fail;
+				if (set_freq(j, i + k*CH_STEP + TVCH_MIN, cr_ms <= 20 ? cr_ms : 0)) goto fail;
+			}
+
+			// wait for carrier lock, but move on as soon as every DT3305 has it. If every channel has
+			// a learned lock time, stop at the longest of those instead of waiting for all of cr_ms
+			unsigned long now = mono_ms();
+			unsigned long deadline = now + (cr_ms > 20 ? cr_ms - 20 : 0), learned = 0;
+			unsigned pending = 0;
+			for (k = 0; k < dl_use; k++) if (i + k*CH_STEP < n_ch_freq) {
+				j = dl[k];
+				pending |= 1 << j;
+				unsigned to = lt.timeout(ch_state[j].tvch, cur_antenna(j), locktime::carrier);
+				if (learned != (unsigned long) -1) {
+					if (!to) learned = (unsigned long) -1;
+					else if (t_tune[j] + to > learned) learned = t_tune[j] + to;
+				}
+			}
+			unsigned cut_short = learned < deadline;
+			if (cut_short) deadline = learned;
+
+			for (;;) {
+				u8 b;
+				for (j = 0; j < NUM_CHANNELS; j++) if (pending & (1 << j)) {
+					if (sock.get_demod8(j, 0x11d, &b)) goto fail;	// carrier recovery lock
+					if (!(b & 0x80)) continue;
+					pending &= ~(1 << j);
+					lt_observe(j, 1);
+					find[find_use++] = ch_state[j].tvch;
+				}
+				now = mono_ms();
+				if (!pending || now >= deadline) break;
+				usleep((deadline - now > 5 ? 5 : deadline - now) * 1000);
 			}
 
-			unsigned wait_tally = cr_ms;
-			if (wait_tally > 20) usleep((wait_tally - 20) * 1000);
-			u8 b[NUM_CHANNELS];
-			for (j = 0; j < NUM_CHANNELS; j++) if (i + j*CH_STEP < n_ch_freq) {
-				if (sock.get_demod8(j, 0x11d, &b[j])) goto fail;	// carrier recovery lock
-				if (!(b[j] & 0x80)) continue;
-				find[find_use++] = ch_state[j].tvch;
+			// only a learned timeout is evidence the channel changed: a channel that is not there at all
+			// also never locks within cr_ms, but that says nothing about its lock time
+			for (j = 0; j < NUM_CHANNELS; j++) if (pending & (1 << j)) {
+				if (cut_short) lock_gave_up(j);
+				else lt_wait[j] = 0;
 			}
 		}
 
@@ -451,19 +858,22 @@ int tuner::scan(unsigned * n_ch, unsigned ** chlist, scan_cb cb /*= 0*/, void *
 		if (ant_valid) break;		// cannot try switching antennas
 		if (get_antenna() == coax) break;	// already tried all antennas
 
-		for (j = 0; j < NUM_CHANNELS; j++) if (set_amp(j, off)) return 1;
-		if (set_antenna((tuner_antennas) (get_antenna() + 1))) {
-			free(find);
-			return 1;
-		}
+		for (j = 0; j < NUM_CHANNELS; j++) if (set_amp(j, off)) goto fail;
+		if (set_antenna((tuner_antennas) (get_antenna() + 1))) goto fail;
 		//fprintf(stderr, "try antenna %u\n", get_antenna());
 	}
 
-	for (j = 0; j < NUM_CHANNELS; j++)
-		if (sock.set_demod8(j, 0x12a, old12a[j])) {
-			free(find);
-			return 1;
-		}
+	// sync lock was never checked, and a get_mse() much later would record when it was called, not the lock
+	// AFC is skipped for the same reason: nobody is going to watch these channels
+	for (k = 0; k < dl_use; k++) {
+		lt_wait[dl[k]] = 0;
+		afc_state[dl[k]].wait = 0;
+	}
+
+	if (cr_restore(ch_mask, old12a)) {
+		free(find);
+		return 1;
+	}
 
 	qsort(find, find_use, sizeof(find[0]), tuner_scan_cmp);	// sort list
 	*n_ch = find_use;
@@ -472,14 +882,296 @@ int tuner::scan(unsigned * n_ch, unsigned ** chlist, scan_cb cb /*= 0*/, void *
 
 fail:
 	free(find);
-	for (j = 0; j < NUM_CHANNELS; j++) sock.set_demod8(j, 0x12a, old12a[j]);
+	cr_restore(ch_mask, old12a);
+	return 1;
+}
+
+int tuner::scan_cable(unsigned * n_ch, unsigned ** chlist, scan_cb cb, void * ctx, unsigned cr_ms, u32 ch_mask)
+{
+	static const tuner_operating_mode pass_mode[] = { QAM256, QAM64 };	// QAM256 is far more common
+	static const unsigned n_pass = sizeof(pass_mode)/sizeof(pass_mode[0]);
+	static const unsigned n_catv = CATV_MAX - TVCH_MIN + 1;
+
+	u8 dl[NUM_CHANNELS];
+	unsigned dl_use = 0, i, j, k, pass;
+	for (j = 0; j < NUM_CHANNELS; j++) if (ch_mask & (1 << j)) dl[dl_use++] = j;
+	if (!dl_use || (ch_mask & ~SCAN_ALL)) {
+		fprintf(stderr, "tuner::scan: ch_mask %x invalid\n", ch_mask);
+		return 1;
+	}
+	if (get_antenna() == nc) {
+		if (dl_use != NUM_CHANNELS) {
+			fprintf(stderr, "tuner::scan(ch_mask=%x) must call set_antenna() first\n", ch_mask);
+			return 1;
+		}
+		if (set_antenna(coax)) return 1;	// cable is never on the antenna inputs
+	}
+	if (cr_ms < 20) cr_ms = 20;
+
+	u8 * found = (typeof(found)) calloc(sizeof(*found), n_catv);
+	unsigned * find = (typeof(find)) malloc(sizeof(*find) * n_catv);
+	if (!found || !find) {
+		fprintf(stderr, "tuner::scan: malloc failed\n");
+		free(found);
+		free(find);
+		return 1;
+	}
+
+	// pass 1 tries every channel as QAM256, pass 2 tries the channels that were not found as QAM64
+	for (pass = 0; pass < n_pass; pass++) {
+		for (i = 0; i < n_catv;) {
+			if (cb) cb(ctx, pass*n_catv + i + 1, n_pass*n_catv + 1);
+			unsigned pending = 0, cur[NUM_CHANNELS];
+			for (k = 0; k < dl_use && i < n_catv; i++) {
+				if (found[i]) continue;
+				j = dl[k++];
+				ch_qam[i] = pass_mode[pass];
+				if (set_freq(j, i + TVCH_MIN, 20)) goto fail;
+				cur[j] = i;
+				pending |= 1 << j;
+			}
+			if (!pending) continue;
+
+			// wait for carrier lock, but move on as soon as every DT3305 has it
+			unsigned long now = mono_ms(), deadline = now + cr_ms - 20;
+			for (;;) {
+				u8 b;
+				for (j = 0; j < NUM_CHANNELS; j++) if (pending & (1 << j)) {
+					if (sock.get_demod8(j, 0x11d, &b)) goto fail;	// carrier recovery lock
+					if (!(b & 0x02)) continue;
+					pending &= ~(1 << j);
+					lt_observe(j, 1);
+					found[cur[j]] = 1;
+				}
+				now = mono_ms();
+				if (!pending || now >= deadline) break;
+				usleep((deadline - now > 5 ? 5 : deadline - now) * 1000);
+			}
+			for (j = 0; j < NUM_CHANNELS; j++) if (pending & (1 << j)) lt_wait[j] = 0;
+		}
+	}
+
+	// same as scan(): nobody is going to watch these channels
+	for (k = 0; k < dl_use; k++) {
+		lt_wait[dl[k]] = 0;
+		afc_state[dl[k]].wait = 0;
+	}
+
+	{
+		unsigned find_use = 0;
+		for (i = 0; i < n_catv; i++) {
+			if (found[i]) find[find_use++] = i + TVCH_MIN;
+			else ch_qam[i] = QAM256;
+		}
+		free(found);
+		*n_ch = find_use;
+		*chlist = find;
+	}
+	return 0;
+
+fail:
+	free(found);
+	free(find);
+	return 1;
+}
+
+int tuner::scan_antennas(unsigned * n_ch, unsigned ** chlist, scan_cb cb /*= 0*/, void * ctx /*= 0*/,
+	unsigned cr_ms /*= 20*/, unsigned lock_ms /*= 300*/, u32 ch_mask /*= SCAN_ALL*/)
+{
+	static const tuner_antennas ant_list[] = { ant1, ant2, coax };
+	static const unsigned n_ant = sizeof(ant_list)/sizeof(ant_list[0]);
+	static const unsigned n_ch_freq = sizeof(ch_freq)/sizeof(ch_freq[0]);
+	static const unsigned n_item = n_ch_freq*n_ant;	// item m is channel m / n_ant on ant_list[m % n_ant]
+
+	u8 dl[NUM_CHANNELS];
+	unsigned dl_use = 0, j, k, m;
+	for (j = 0; j < NUM_CHANNELS; j++) if (ch_mask & (1 << j)) dl[dl_use++] = j;
+	if (!dl_use || (ch_mask & ~SCAN_ALL)) {
+		fprintf(stderr, "tuner::scan_antennas: ch_mask %x invalid\n", ch_mask);
+		return 1;
+	}
+	if (plan != air) {
+		fprintf(stderr, "tuner::scan_antennas: only for the broadcast plan, cable is always coax\n");
+		return 1;
+	}
+	if (cr_ms < 20) cr_ms = 20;	// must spend at least 20ms to correctly detect antenna
+
+	u32 * score = (typeof(score)) calloc(sizeof(*score), n_item);	// 0 == no carrier
+	unsigned * find = (typeof(find)) malloc(sizeof(*find) * n_ch_freq);
+	if (!score || !find) {
+		fprintf(stderr, "tuner::scan_antennas: malloc failed\n");
+		free(score);
+		free(find);
+		return 1;
+	}
+
+	// pass 1: carrier detect on every channel on every antenna, same as scan()
+	// pass 2 is not known yet, but it is never more than pass 1: cb gets pass1*2 as the total for both
+	const unsigned pass1 = (n_item + dl_use - 1)/dl_use;
+	u8 old12a[NUM_CHANNELS];
+	if (cr_isolate(ch_mask, old12a)) goto fail_free;
+	for (m = 0; m < n_item; m += dl_use) {
+		if (cb) cb(ctx, m/dl_use + 1, pass1*2);
+		for (k = 0; k < dl_use && m + k < n_item; k++) {
+			if (set_freq_ant(dl[k], (m + k)/n_ant + TVCH_MIN, ant_list[(m + k) % n_ant], cr_ms <= 20 ? cr_ms : 0)) {
+				cr_restore(ch_mask, old12a);
+				goto fail_amp;
+			}
+		}
+		if (cr_ms > 20) usleep((cr_ms - 20) * 1000);
+		for (k = 0; k < dl_use && m + k < n_item; k++) {
+			u8 b;
+			lt_wait[dl[k]] = 0;	// a single read after a fixed wait is not a lock time
+			if (sock.get_demod8(dl[k], 0x11d, &b)) {	// carrier recovery lock
+				cr_restore(ch_mask, old12a);
+				goto fail_amp;
+			}
+			if (b & 0x80) score[m + k] = 1;
+		}
+	}
+	if (cr_restore(ch_mask, old12a)) goto fail_amp;
+
+	// pass 2: measure the MSE of only the items that had a carrier
+	{
+		unsigned todo[NUM_CHANNELS], done = 0;
+		for (m = 0;;) {
+			for (k = 0; k < dl_use; k++) {
+				while (m < n_item && !score[m]) m++;
+				if (m >= n_item) break;
+				todo[k] = m++;
+				if (set_freq_ant(dl[k], todo[k]/n_ant + TVCH_MIN, ant_list[todo[k] % n_ant], 20)) goto fail_amp;
+			}
+			if (!k) break;
+			if (cb) cb(ctx, pass1 + ++done, pass1*2);
+			usleep(lock_ms * 1000);
+
+			unsigned n_todo = k;
+			for (k = 0; k < n_todo; k++) {
+				u8 status;
+				u32 ptmse, eqmse;
+				lt_wait[dl[k]] = 0;	// a single read after lock_ms is not a lock time
+				if (get_mse(dl[k], &status, &ptmse, &eqmse)) goto fail_amp;
+				// a later lock stage always wins, then a lower eqmse. The score is never 0 (status & 1 is set)
+				if (status & 1) score[todo[k]] = ((u32) status << 20) | (0xfffff - (eqmse & 0xfffff));
+			}
+		}
+		if (cb && done < pass1) cb(ctx, pass1*2, pass1*2);	// fewer had a carrier: jump to the end
+	}
+
+	{
+		unsigned find_use = 0, votes[n_ant];
+		memset(votes, 0, sizeof(votes));
+		for (j = 0; j < n_ch_freq; j++) {
+			unsigned a, pick = 0;
+			for (a = 1; a < n_ant; a++) if (score[j*n_ant + a] > score[j*n_ant + pick]) pick = a;
+			if (!score[j*n_ant + pick]) {
+				ch_ant[j] = nc;
+				continue;
+			}
+			ch_ant[j] = ant_list[pick];
+			votes[pick]++;
+			find[find_use++] = j + TVCH_MIN;
+		}
+
+		for (k = 0; k < dl_use; k++) if (set_amp(dl[k], off)) goto fail_free;
+
+		// active_ant is the default for channels that were not found: use the most popular antenna
+		// but a partial ch_mask must not switch the antenna under a DT3305 that is still in use
+		if (find_use && (active_ant == nc || ch_mask == SCAN_ALL)) {
+			unsigned a, pick = 0;
+			for (a = 1; a < n_ant; a++) if (votes[a] > votes[pick]) pick = a;
+			if (set_antenna(ant_list[pick])) goto fail_free;
+		}
+
+		free(score);
+		*n_ch = find_use;
+		*chlist = find;
+	}
+	return 0;
+
+fail_amp:
+	// like set_freq_ant() on a fault: do not leave the amps on
+	for (k = 0; k < dl_use; k++) if (set_amp(dl[k], off))
+		fprintf(stderr, "tuner::scan_antennas: failed to disable amp %u after fault\n", dl[k]);
+fail_free:
+	free(score);
+	free(find);
 	return 1;
 }
 
+int tuner::cr_isolate(u32 ch_mask, u8 * old12a)
+{
+	// register 0x12a is not documented but the LG DT3305 example and app notes both suggest
+	// clearing bit 0x20 to disable the DT3305 frequency modulation
+	// this isolates carrier recovery for a more accurate result
+	for (u8 j = 0; j < NUM_CHANNELS; j++) if (ch_mask & (1 << j)) {
+		if (sock.get_demod8(j, 0x12a, &old12a[j]) ||
+			sock.set_demod8(j, 0x12a, old12a[j] & ~0x20))
+		{
+			// undo any that were already changed
+			cr_restore(ch_mask & ((1 << j) - 1), old12a);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int tuner::cr_restore(u32 ch_mask, const u8 * old12a)
+{
+	int r = 0;
+	for (u8 j = 0; j < NUM_CHANNELS; j++) if (ch_mask & (1 << j)) {
+		if (sock.set_demod8(j, 0x12a, old12a[j])) r = 1;
+	}
+	return r;
+}
+
+// convert register 3 (general status) to get_mse() status bits, assuming carrier recovery is locked
+static u8 mse_status(u8 gen)
+{
+	return 1 |
+		(((gen & 8) >> 2) ^ 2) |	// has lock (nlock=="inlock")
+		(gen & 4) |			// has sync lock
+		((gen & 1) << 3) |		// snr above tov
+		((gen & 2) << 3);		// has viterbi ("fec ok")
+}
+
+// QAM has no register 3 status: convert 0x50a (FEC status) to get_mse() status bits - from linux, uncertain
+static u8 qam_status(u8 fec)
+{
+	return 1 |
+		((fec & 0x07) ? 2 : 0) |	// viterbi lock, the closest thing to "inlock"
+		((fec & 0x80) >> 5) |		// mpeg lock: has sync lock
+		((fec & 0x40) >> 2);		// fec pass ("fec ok")
+}
+
+int tuner::get_qam_mse(u8 ch, u8 * status, u32 * mse, unsigned bg)
+{
+	// 0x50a: FEC status, 0x11a - 0x11b: carrier recovery MSE (16 bits)
+	u8 fec, buf[2];
+	int r = sock.get_demodN(ch, 0x50a, &fec, 1, bg);
+	if (r) return r;
+	if ((r = sock.get_demodN(ch, 0x11a, buf, sizeof(buf), bg))) return r;
+	*status = qam_status(fec);
+	*mse = (((u32) buf[0] << 8) | buf[1]) << 4;	// scaled up to roughly the VSB range
+	return 0;
+}
+
 int tuner::get_mse(u8 ch, u8 * status, u32 * ptmse, u32 * eqmse)
 {
 	u8 lock;
 	if (sock.get_demod8(ch, 0x11d, &lock)) return 1;	// carrier recovery lock
+	if (is_qam(ch)) {
+		if (!(lock & 0x02)) {	// QAM carrier lock is bit 1, not bit 7
+			*status = 0;
+			*ptmse = 0xfffff;
+			*eqmse = 0xfffff;
+			return 0;
+		}
+		if (get_qam_mse(ch, status, eqmse, 0)) return 1;
+		*ptmse = *eqmse;
+		lt_observe(ch, *status);
+		return 0;
+	}
 	if (!(lock & 0x80)) {
 		*status = 0;
 		*ptmse = 0xfffff;
@@ -488,15 +1180,11 @@ int tuner::get_mse(u8 ch, u8 * status, u32 * ptmse, u32 * eqmse)
 	}
 
 	if (sock.get_demod8(ch, 3, &lock)) return 1;	// register 3: general status
-	*status =  1 |
-		(((lock & 8) >> 2) ^ 2) |	// has lock (nlock=="inlock")
-		(lock & 4) |			// has sync lock
-		((lock & 1) << 3) |		// snr above tov
-		((lock & 2) << 3);		// has viterbi ("fec ok")
+	*status = mse_status(lock);
 
 	// 24-bit value at 0x413: equalizer mean square error (mse) for VSB
 	// 24-bit value at 0x417: phase tracker mean square error (mse) for VSB
-	// ... ignored: 24-bit value at 0x118: carrier recovery frequency offset
+	// 24-bit value at 0x118: carrier recovery frequency offset, not read here: get_cr_offset() reads it for AFC
 	//
 	// ptmse and eqmse can be read in a single operation
 	u8 msebuf[8];
@@ -504,6 +1192,48 @@ int tuner::get_mse(u8 ch, u8 * status, u32 * ptmse, u32 * eqmse)
 
 	*ptmse = ((u32) msebuf[4] << 16) | ((u32) msebuf[5] << 8) | msebuf[6];
 	*eqmse = ((u32) msebuf[0] << 16) | ((u32) msebuf[1] << 8) | msebuf[2];
+	lt_observe(ch, *status);
+	if (afc_state[ch].wait && afc_check(ch)) return 1;	// first carrier lock since set_freq()
+	return 0;
+}
+
+int tuner::sample(u8 ch, sigsample * s)
+{
+	if (ch >= NUM_CHANNELS) {
+		fprintf(stderr, "tuner::sample(%u) invalid channel\n", ch);
+		return 1;
+	}
+
+	// 0x118 - 0x11d in one read: carrier offset (24 bits) and carrier recovery lock (0x11d)
+	u8 crbuf[6];
+	int r = sock.get_demodN(ch, 0x118, crbuf, sizeof(crbuf), 1 /*bg*/);
+	if (r) return r;
+	s->ms = mono_ms();
+	s->tvch = ch_state[ch].tvch;
+	if (!(crbuf[5] & (is_qam(ch) ? 0x02 : 0x80))) {
+		s->status = 0;
+		s->ptmse = 0xfffff;
+		s->eqmse = 0xfffff;
+		s->cr_hz = 0;
+		return 0;
+	}
+	int ofs = (int) (((u32) crbuf[0] << 24) | ((u32) crbuf[1] << 16) | ((u32) crbuf[2] << 8)) >> 8;
+	s->cr_hz = (int) (ofs * CR_OFFSET_FULL_SCALE_HZ / (1 << 24));
+
+	if (is_qam(ch)) {
+		if ((r = get_qam_mse(ch, &s->status, &s->eqmse, 1 /*bg*/))) return r;
+		s->ptmse = s->eqmse;
+		return 0;
+	}
+
+	u8 gen;
+	if ((r = sock.get_demodN(ch, 3, &gen, 1, 1 /*bg*/))) return r;
+	s->status = mse_status(gen);
+
+	u8 msebuf[8];
+	if ((r = sock.get_demodN(ch, 0x413, msebuf, sizeof(msebuf), 1 /*bg*/))) return r;
+	s->ptmse = ((u32) msebuf[4] << 16) | ((u32) msebuf[5] << 8) | msebuf[6];
+	s->eqmse = ((u32) msebuf[0] << 16) | ((u32) msebuf[1] << 8) | msebuf[2];
 	return 0;
 }
 
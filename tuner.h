@@ -13,9 +13,19 @@ this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "socket.h"
+#include "locktime.h"
 
 namespace tuner_ns {
 
+// one reading of a DT3305, see tuner::sample() and sigmon
+struct sigsample {
+	unsigned long ms;	// mono_ms() when it was taken
+	unsigned tvch;		// what the DT3305 was tuned to
+	u8 status;		// same bits as get_mse()
+	u32 ptmse, eqmse;	// same as get_mse()
+	int cr_hz;		// same as get_cr_offset(), 0 without carrier lock
+};
+
 class mpgts;
 class tuner {
 protected:
@@ -26,10 +36,25 @@ public:
 	tuner(u32 ip_, const u8 * mac_, u32 myip_) : sock(ip_, mac_, myip_) {
 		cur_gpio = 0;
 		active_ant = nc;
+		plan = air;
 		for (unsigned i = 0; i < NUM_CHANNELS; i++) {
 			ch_state[i].i = off;
 			ch_state[i].tvch = (unsigned) -1;
+			ch_state[i].mode = VSB;
+			ch_state[i].mode_valid = 0;
+			t_tune[i] = 0;
+			lt_wait[i] = 0;
+			afc_state[i].wait = 0;
+			afc_state[i].steps = 0;
+			afc_state[i].hz = 0;
 		}
+		for (unsigned i = 0; i < TVCH_SLOTS; i++) {
+			ch_ant[i] = nc;
+			afc[i] = 0;
+			ch_qam[i] = QAM256;
+		}
+		afc_on = 1;
+		afc_dir = 1;
 	}
 
 	const u8 * get_mac() const { return sock.get_mac(); }
@@ -47,6 +72,9 @@ public:
 		NUM_CHANNELS = 2,	// one tuner can receive 2 channels simultaneously
 		TVCH_MIN = 2,
 		TVCH_MAX = 51,
+		CATV_MAX = 135,		// cable plan: channels 2 - 135
+		TVCH_SLOTS = CATV_MAX - TVCH_MIN + 1,	// per-channel arrays have room for either plan
+		SCAN_ALL = (1 << NUM_CHANNELS) - 1,	// scan() ch_mask to use every DT3305
 	};
 
 	enum tuner_operating_mode {
@@ -62,11 +90,20 @@ public:
 		coax,	// standard "F connector" for coax to external TV antenna (aka "external antenna" in this class)
 	};
 
+	enum tuner_plan {
+		air,	// North American broadcast channels 2 - 51, VSB
+		cable,	// North American cable (EIA-542 STD) channels 2 - 135, QAM64 or QAM256 per channel
+	};
+
 	static const u32 ch_freq[TVCH_MAX - TVCH_MIN + 1];
 
 protected:
 	// TODO: change this to public after QAM has been tested
+	// set_modulation() does nothing if ch is already in that mode
 	int set_modulation(u8 ch, tuner_operating_mode mode);
+	int verify_demod(u8 ch);	// sanity check that ch really is an LGDT3305
+	struct demod_burst;
+	int write_bursts(u8 ch, const demod_burst * b, unsigned n, const char * name);
 
 	enum tuner_amp_input {
 		off = 0,
@@ -80,16 +117,65 @@ protected:
 
 	int set_amp(u8 ch, tuner_amp_input state);
 
+	// read the TUA6034 status byte
+	int get_tuner_status(u8 ch, u8 * status);
+
 	struct ch_state_st {
 		tuner_amp_input i;
 		unsigned tvch;
+		tuner_operating_mode mode;
+		u8 mode_valid;	// 0 until set_modulation() has written mode
 	};
 	tuner_antennas active_ant;
 	ch_state_st ch_state[NUM_CHANNELS];
+	tuner_antennas ch_ant[TVCH_SLOTS];	// per-channel antenna, nc means use active_ant
+	tuner_plan plan;
+	u8 ch_qam[TVCH_SLOTS];	// cable plan: QAM64 or QAM256 for each channel, learned by scan_cable()
+	unsigned is_qam(u8 ch) const { return ch_state[ch].mode != VSB; }
+	int get_qam_mse(u8 ch, u8 * status, u32 * mse, unsigned bg);	// returns 2 if bg and the read was skipped
+
+	// lock time model: set_freq() starts the clock, get_mse() and scan() record when each stage is reached
+	locktime lt;
+	unsigned long t_tune[NUM_CHANNELS];	// mono_ms() when the PLL was written
+	u8 lt_wait[NUM_CHANNELS];	// (1 << locktime::lock_stage) for each stage not reached yet
+	void lt_observe(u8 ch, u8 status);
+	tuner_antennas cur_antenna(u8 ch) const;	// antenna ch is actually using
+
+	// automatic frequency correction: afc[] is the learned PLL correction per channel in 62.5kHz steps
+	struct afc_st {
+		u8 wait;	// 1: check at the first carrier lock, 2: verify a correction at the next carrier lock
+		int steps;	// the correction being verified
+		int hz;		// the offset that caused it
+	};
+	signed char afc[TVCH_SLOTS];
+	afc_st afc_state[NUM_CHANNELS];
+	unsigned afc_on;
+	int afc_dir;	// +1 or -1, learned sign of the 0x118 offset
+	int afc_check(u8 ch);
+
+	// write the TUA6034 PLL for tvch including afc[]
+	int write_pll(u8 ch, unsigned tvch);
+
+	// clear / restore bit 0x20 of register 0x12a on every DT3305 in ch_mask
+	int cr_isolate(u32 ch_mask, u8 * old12a);
+	int cr_restore(u32 ch_mask, const u8 * old12a);
 
 public:
 	tuner_antennas get_antenna() const { return active_ant; };
 
+	// the channel plan decides which channels exist and their frequencies. set_plan() turns both amps off,
+	// forgets everything learned per channel and puts both DT3305 in the plan's modulation. In the cable plan
+	// set_freq() switches each DT3305 between QAM64 and QAM256 as each channel needs
+	int set_plan(tuner_plan p);
+	tuner_plan get_plan() const { return plan; }
+	unsigned tvch_max() const { return plan == cable ? (unsigned) CATV_MAX : (unsigned) TVCH_MAX; }
+	u32 get_ch_freq(unsigned tvch) const;	// MHz, 0 if tvch is not in the plan
+	tuner_operating_mode get_ch_modulation(unsigned tvch) const {
+		if (plan != cable) return VSB;
+		if (tvch < TVCH_MIN || tvch > CATV_MAX) return QAM256;
+		return (tuner_operating_mode) ch_qam[tvch - TVCH_MIN];
+	}
+
 	// get_freq() does not actually return a value in MHz, it returns a TV channel (so 7==channel 7 / 177MHz)
 	// returns (unsigned) -1 if this amp is off
 	unsigned get_freq(u8 ch) const {
@@ -100,33 +186,101 @@ public:
 
 	// must call scan() or set_antenna() with ant!=nc before calling set_freq()
 	// set_antenna(nc) will set both amps off, that will likely kill any ongoing reception
+	// set_antenna() does not change the antenna of a channel that has its own antenna (see scan_antennas())
 	int set_antenna(tuner_antennas ant);
 
+	// per-channel antenna: set_freq() uses this instead of active_ant unless it is nc
+	tuner_antennas get_ch_antenna(unsigned tvch) const {
+		if (tvch < TVCH_MIN || tvch > tvch_max()) return nc;
+		return ch_ant[tvch - TVCH_MIN];
+	}
+	int set_ch_antenna(unsigned tvch, tuner_antennas ant) {
+		if (tvch < TVCH_MIN || tvch > tvch_max()) return 1;
+		ch_ant[tvch - TVCH_MIN] = ant;
+		return 0;
+	}
+
 	typedef void (* scan_cb)(void * ctx, unsigned idx, unsigned max);
 
+	// detect_antenna() samples carrier lock and the TUA6034 RF AGC on a few likely channels on every antenna,
+	//        using both DT3305 in parallel on different antennas. It does not call set_antenna(), and
+	//        *best is nc if no antenna found any carrier.
+	// detect_antenna() requires both amps to be off (it will not interrupt ongoing reception)
+	int detect_antenna(tuner_antennas * best, unsigned cr_ms = 20);
+
 	// must call scan() or set_antenna() before calling set_freq()
-	// scan() uses all DT3305 to scan in parallel - any ongoing reception will be stopped
+	// scan() uses all DT3305 in ch_mask to scan in parallel - any ongoing reception on them will be stopped
+	// scan() never touches a DT3305 outside of ch_mask, so e.g. ch_mask = 1 << 1 refreshes the channel list
+	//        while DT3305 0 keeps streaming. The antenna must already be set (active_ant != nc) because
+	//        switching antennas would disturb the DT3305 outside of ch_mask.
 	// scan() will take longer if active_ant==nc but it will autodetect the antenna
 	// scan() will take longest if running inside a faraday cage (absolutely no signals found at all)
+	// scan() in the cable plan tries every channel as QAM256 then the rest as QAM64, and uses coax if
+	//        active_ant==nc
 	// scan() will typically work faster with cr_ms of 0, the default is the recommended demod reset delay,
 	//        and larger values make the scan even more sensitive. But if the channel does not appear with cr_ms == 0
 	//        there is a good chance the channel is too weak to lock anyway
 	//
 	// scan() steps:
-	// 1. pick a temporary antenna if active_ant==nc
+	// 1. if active_ant==nc, detect_antenna() picks the antenna, or a temporary antenna if it found nothing
 	// 2. scan all channels
 	// 3. if no signal is detected and this was a temporary antenna, try another antenna
-	int scan(unsigned * n_ch, unsigned ** chlist, scan_cb cb = 0, void * ctx = 0, unsigned cr_ms = 20);
+	int scan(unsigned * n_ch, unsigned ** chlist, scan_cb cb = 0, void * ctx = 0, unsigned cr_ms = 20,
+		u32 ch_mask = SCAN_ALL);
 
-	// tvch must be >= TVCH_MIN and <= TVCH_MAX or (unsigned) -1 (turns the amp off)
+	// scan_antennas() is a slower scan() that finds the best antenna for each channel:
+	// 1. carrier detect every channel on every antenna (like scan())
+	// 2. wait lock_ms on each channel + antenna that had a carrier and compare the lock stage and MSE
+	// 3. set_ch_antenna() for every channel found, and set_antenna() to the antenna most channels use
+	// each DT3305 in ch_mask picks its own antenna, so they do not have to agree
+	int scan_antennas(unsigned * n_ch, unsigned ** chlist, scan_cb cb = 0, void * ctx = 0, unsigned cr_ms = 20,
+		unsigned lock_ms = 300, u32 ch_mask = SCAN_ALL);
+
+	// tvch must be >= TVCH_MIN and <= tvch_max() or (unsigned) -1 (turns the amp off)
 	int set_freq(u8 ch, unsigned tvch, unsigned reset_ms = 20);
+	// set_freq() on a specific antenna, ignoring active_ant and get_ch_antenna(): both DT3305 can be on
+	//        different antennas at once since each has its own filter GPIOs
+	int set_freq_ant(u8 ch, unsigned tvch, tuner_antennas ant, unsigned reset_ms = 20);
 
 	// read signal strength
+	// in QAM the status bits come from the FEC status instead: 2 viterbi, 4 mpeg lock, 0x10 fec ok, and
+	//        ptmse and eqmse are both the carrier recovery MSE
+	// get_mse() also runs AFC: the first time it sees carrier lock after set_freq(), if the carrier offset is
+	//        more than 3/4 of a 62.5kHz PLL step the PLL is moved and the correction is kept for that channel
 	int get_mse(u8 ch, u8 * status, u32 * ptmse, u32 * eqmse);
 
+	// sample() reads everything in a sigsample as background transactions on the control socket: it returns 2
+	//        without a complete sample if a tuning op wants the socket. sample() is safe to call from another
+	//        thread and, unlike get_mse(), it never changes anything (no AFC, no lock time model)
+	int sample(u8 ch, sigsample * s);
+
+	// carrier recovery frequency offset in Hz, only meaningful if carrier recovery is locked
+	int get_cr_offset(u8 ch, int * hz);
+
+	// AFC is on by default. get_afc() returns the learned correction for tvch in 62.5kHz steps
+	void set_afc(unsigned on) { afc_on = on; }
+	int get_afc(unsigned tvch) const {
+		if (tvch < TVCH_MIN || tvch > tvch_max()) return 0;
+		return afc[tvch - TVCH_MIN];
+	}
+
+	// lock_timeout() is how long to wait after set_freq(tvch) for stage st, learned from previous tunes
+	//        it returns dflt_ms until enough tunes of this channel on its antenna have been seen
+	// lock_gave_up() tells the model the caller stopped waiting for ch: any stage not reached is a miss
+	unsigned lock_timeout(unsigned tvch, locktime::lock_stage st, unsigned dflt_ms) const;
+	void lock_gave_up(u8 ch);
+
+	// the lock time model is kept across runs by saving it to a file, one file per tuner
+	int load_locktime(const char * filename) { return lt.load(filename); }
+	int save_locktime(const char * filename) const { return lt.save(filename); }
+
 	// start streaming MPG Transport Stream to specified udp port, NUM_CHANNELS streams max
 	int start_ts(u8 ch, unsigned udp_port);
 	int stop_ts(u8 ch);
+
+protected:
+	// scan() for the cable plan
+	int scan_cable(unsigned * n_ch, unsigned ** chlist, scan_cb cb, void * ctx, unsigned cr_ms, u32 ch_mask);
 };
 
 };
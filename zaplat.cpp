@@ -0,0 +1,80 @@
+/*
+Copyright (c) 2014 David Hubbard
+
+This program is free software: you can redistribute it and/or modify it under the terms of
+the GNU Affero General Public License version 3, as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License version 3 for more details.
+
+You should have received a copy of the GNU Affero General Public License version 3 along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include "iface.h"
+#include "locktime.h"
+#include "zaplat.h"
+
+using namespace tuner_ns;
+
+const char * const zaplat::stage_name[NUM_STAGES] = {
+	"lock", "udp", "pat", "pmt", "vct", "pcr",
+};
+
+void zaplat::print(FILE * f) const
+{
+	unsigned header = 1;
+	for (unsigned t = 0; t < MAX_TVCH; t++) {
+		unsigned any = 0;
+		for (unsigned s = 0; s < NUM_STAGES; s++) any |= h[t][s].total();
+		if (!any) continue;
+		if (header) {
+			fprintf(f, "zap ms p50/p95:");
+			for (unsigned s = 0; s < NUM_STAGES; s++) fprintf(f, " %9s", stage_name[s]);
+			fprintf(f, "\n");
+			header = 0;
+		}
+		fprintf(f, "        ch %3u:", t);
+		for (unsigned s = 0; s < NUM_STAGES; s++) {
+			const lathist & l = h[t][s];
+			if (!l.total()) fprintf(f, " %9s", "-");
+			else fprintf(f, " %4u/%4u", l.percentile(50), l.percentile(95));
+		}
+		fprintf(f, "\n");
+	}
+}
+
+void zapclock::begin(unsigned tvch_, unsigned long t0_)
+{
+	__atomic_store_n(&armed, 0, __ATOMIC_SEQ_CST);	// see mark()
+	tvch = tvch_;
+	t0 = t0_;
+	for (unsigned i = 0; i < zaplat::NUM_STAGES; i++) __atomic_store_n(&t[i], 0, __ATOMIC_RELAXED);
+}
+
+void zapclock::mark(zaplat::zap_stage st)
+{
+	unsigned tvch_ = tvch;
+	unsigned long t0_ = t0;
+	if (!t0_ || st >= zaplat::NUM_STAGES || __atomic_load_n(&t[st], __ATOMIC_RELAXED)) return;
+	unsigned long now = mono_ms();
+	__atomic_store_n(&t[st], now, __ATOMIC_SEQ_CST);
+
+	// the caller checked is_armed() but begin() may have run since then and cleared t[] already:
+	// seq_cst on both sides means either begin() clears this store or this sees armed == 0 and undoes it
+	if (!__atomic_load_n(&armed, __ATOMIC_SEQ_CST)) {
+		__atomic_compare_exchange_n(&t[st], &now, 0, 0 /*strong*/, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+		return;
+	}
+	if (hist) hist->add(tvch_, st, now - t0_);
+}
+
+long zapclock::get(zaplat::zap_stage st) const
+{
+	if (st >= zaplat::NUM_STAGES) return -1;
+	unsigned long v = __atomic_load_n(&t[st], __ATOMIC_RELAXED);
+	if (!v) return -1;
+	return (long) (v - t0);
+}
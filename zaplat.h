@@ -0,0 +1,81 @@
+/*
+Copyright (c) 2014 David Hubbard
+
+This program is free software: you can redistribute it and/or modify it under the terms of
+the GNU Affero General Public License version 3, as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License version 3 for more details.
+
+You should have received a copy of the GNU Affero General Public License version 3 along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+namespace tuner_ns {
+
+// zaplat is channel change latency: histograms per channel of the time from set_freq() to each stage a
+// viewer waits for
+class zaplat {
+public:
+	enum zap_stage {
+		lock = 0,	// sync lock, as seen by get_mse()
+		udp,		// first UDP datagram of the stream
+		pat,		// first PAT
+		pmt,		// first PMT
+		vct,		// first TVCT / CVCT / SVCT
+		pcr,		// first PCR on the PMT's PCR PID
+		NUM_STAGES
+	};
+	static const char * const stage_name[NUM_STAGES];
+
+	enum zaplat_constants {
+		MAX_TVCH = locktime::MAX_TVCH,
+	};
+
+	void add(unsigned tvch, zap_stage st, unsigned long ms) {
+		if (tvch >= MAX_TVCH || st >= NUM_STAGES) return;
+		h[tvch][st].add(ms);
+	}
+	const lathist * get(unsigned tvch, zap_stage st) const {
+		if (tvch >= MAX_TVCH || st >= NUM_STAGES) return 0;
+		return &h[tvch][st];
+	}
+
+	// print p50 and p95 of every stage for each channel that has any samples
+	void print(FILE * f) const;
+
+protected:
+	lathist h[MAX_TVCH][NUM_STAGES];
+};
+
+// zapclock times the current channel change on one DT3305
+// begin() is called by set_freq(). The stages from the stream are only counted once the receive thread
+// has demuxed what was already queued from the old channel (see mpgts::rx_flush()), thrown away the old
+// channel's tables and called arm(), so stale datagrams do not count
+class zapclock {
+public:
+	zapclock() : hist(0), tvch(0), t0(0), armed(0) {
+		for (unsigned i = 0; i < zaplat::NUM_STAGES; i++) t[i] = 0;
+	}
+
+	zaplat * hist;	// mark() adds to this
+
+	void begin(unsigned tvch_, unsigned long t0_);
+	void arm() { __atomic_store_n(&armed, 1, __ATOMIC_RELEASE); }
+	unsigned is_armed() const { return __atomic_load_n(&armed, __ATOMIC_ACQUIRE); }
+
+	// mark() records the first time stage st is reached, any later mark() of st is ignored
+	void mark(zaplat::zap_stage st);
+
+	// get() returns ms from set_freq() to stage st, or -1 if it has not happened
+	long get(zaplat::zap_stage st) const;
+
+protected:
+	unsigned tvch;
+	unsigned long t0;
+	unsigned armed;
+	unsigned long t[zaplat::NUM_STAGES];	// mono_ms() of each stage, 0 until it happens
+};
+
+}